@@ -0,0 +1,14 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdint.h>
+
+// Start TIM6-paced DAC output of a DMA ping-pong buffer on OUTR_PIN.
+// Each half of the buffer is re-rendered by synth_renderBlock() from the
+// DMA half-transfer and transfer-complete interrupts.
+void audio_init();
+
+// Blocks rendered since audio_init(), for checking the engine keeps up
+extern volatile uint32_t audioBlockCount;
+
+#endif
@@ -1,7 +1,29 @@
 #ifndef AUTODETECTION_H
 #define AUTODETECTION_H
 
-void autoDetectHandshake();
-void readHandshake(bool &west, bool &east);
+#include <stdint.h>
+#include "chain.h"
 
-#endif
\ No newline at end of file
+// Handshake inputs in the matrix scan: row 5 and row 6, column 3
+#define HANDSHAKE_WEST_BIT 23
+#define HANDSHAKE_EAST_BIT 27
+
+// Position in the chain of the module playing octave, or -1 if none does
+int chain_positionOf(uint8_t octave);
+
+// ID announced by the module at position during enumeration
+uint32_t chain_moduleId(int position);
+
+// Enumeration runs in scanKeysTask, one step per scan, and never waits:
+// chain_begin once, then chain_update with every debounced scan. It
+// returns true on the scan where a new modulePosition, moduleCount and
+// moduleOctave take effect. chain_pending says it needs calling every scan
+// period even when no input changes.
+void chain_begin(uint32_t now);
+bool chain_update(uint32_t inputs, uint32_t now);
+bool chain_pending();
+
+// A frame in the CAN_ID_CONTROL class, from decodeTask
+void chain_receive(const uint8_t msg[8]);
+
+#endif
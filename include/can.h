@@ -1,12 +1,80 @@
 #ifndef CAN_H
 #define CAN_H
 
+#include <stdint.h>
+
+// Arbitration IDs, lowest first on the bus. Every frame carries its sender
+// in the low bits, so no two modules ever send the same ID: note and
+// telemetry frames the module's position. Control frames are sent before
+// the module has a position, so until its first enumeration settles they
+// carry a tag folded from the module ID instead. Tags start above the
+// positions, so an unsettled module can only share an ID with another
+// unsettled one, and those take turns on the bus.
+#define CAN_ID_NOTE 0x100
+#define CAN_ID_CONTROL 0x200
+#define CAN_ID_TELEMETRY 0x300
+#define CAN_ID_MODULE_MASK 0xff
+#define CAN_CONTROL_TAG_FIRST 8 // Past the last position, CHAIN_MAX_MODULES - 1
+
+static inline uint32_t can_idClass(uint32_t id)
+{
+    return id & ~(uint32_t)CAN_ID_MODULE_MASK;
+}
+
+static inline uint8_t can_controlTag(uint32_t moduleId)
+{
+    moduleId ^= moduleId >> 16;
+    moduleId = (moduleId ^ moduleId >> 8) & 0xff;
+    return (uint8_t)(CAN_CONTROL_TAG_FIRST + moduleId % (256 - CAN_CONTROL_TAG_FIRST));
+}
+
+// A received frame with the ID it arrived under and the RTOS tick the RX
+// interrupt took it on, which its key events are timed from
+struct CanFrame
+{
+    uint32_t id;
+    uint8_t data[8];
+    uint32_t tick;
+};
+
+// Frames the RX interrupt can hold for decodeTask, on top of the three in
+// the hardware FIFO
+#define CAN_RX_RING_SIZE 32
+
+// Outgoing traffic classes, highest priority first
+enum CanTxClass
+{
+    CAN_TX_NOTE,      // Key event frames
+    CAN_TX_CONTROL,   // Handshake and configuration
+    CAN_TX_TELEMETRY, // Bulk, sent only when nothing else waits
+    CAN_TX_CLASSES
+};
+
+// Queue a frame in its class and return at once. Frames are handed to the
+// mailboxes from here or from the TX-complete interrupt, highest class
+// first; returns false, and counts a drop, if the class queue is full.
+bool can_send(CanTxClass txClass, const uint8_t data[8]);
+uint32_t can_dropped(CanTxClass txClass);
+uint8_t can_highWater(CanTxClass txClass); // Deepest the class queue has been
+bool can_busy(CanTxClass txClass);         // A frame of the class is still to leave
+
+// Sets the tag control frames are sent under, from the module ID
+void can_setModuleId(uint32_t moduleId);
+// Control frames go out under the module's position from now on, once an
+// enumeration has settled
+void can_setPositioned();
+
+// Frames lost on receive, in the hardware FIFO or the ring behind it
+uint32_t can_rxOverruns();
+
+// TX-complete interrupt, registered with CAN_RegisterTX_ISR
 void CAN_TX_ISR(void);
+// RX interrupt, registered with CAN_RegisterRX_ISR. Empties the FIFO into
+// the ring and wakes decodeTask.
 void CAN_RX_ISR(void);
 void CAN_RX_ISRTest(void);
 void CAN_TX_Function(void *pvParameters);
 void decodeTask(void *pvParameters);
 void decodeFunction(void *pvParameters);
-void CAN_TX_Task(void *pvParameters);
 
 #endif
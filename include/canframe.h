@@ -0,0 +1,40 @@
+#ifndef CANFRAME_H
+#define CANFRAME_H
+
+// Binary CAN payload carrying up to four key events. Portable, so the
+// encoder and decoder can be exercised on a host.
+//
+//   byte 0      version:3 | count-1:2 | baseOctave:3   (MSB first)
+//   bytes 1-7   four 14-bit events, little-endian from bit 8 of the frame:
+//               pressed:1 | note:6 | delta:7            (LSB first)
+//
+// note is semitones above C of baseOctave, so one frame spans five octaves.
+// delta is ms since the previous event in the frame (the first is 0),
+// saturating at 127. The version field keeps the frame apart from the
+// ASCII chain enumeration messages ('C' and 'E' are version 2).
+
+#include <stdint.h>
+#include "noteevent.h"
+
+#define CAN_FRAME_VERSION 1
+#define CAN_FRAME_EVENTS 4
+#define CAN_FRAME_NOTES 64
+#define CAN_FRAME_MAX_DELTA 127
+
+static inline bool canframe_isKeyFrame(const uint8_t msg[8])
+{
+    return (msg[0] >> 5) == CAN_FRAME_VERSION;
+}
+
+// Pack the longest prefix of events that fits one frame: at most
+// CAN_FRAME_EVENTS, all within CAN_FRAME_NOTES of the lowest C. Returns the
+// number packed, at least 1 if count is, or 0 for an event that cannot be
+// sent at all (octave above 7 or note index above 11), which is skipped.
+int canframe_encode(const NoteEvent *events, int count, uint8_t msg[8]);
+
+// Unpack a key frame into events, timed so the last one is at rxTime and
+// the rest keep their spacing. Returns the number of events, or 0 if msg is
+// not a key frame of this version.
+int canframe_decode(const uint8_t msg[8], uint32_t rxTime, NoteEvent events[CAN_FRAME_EVENTS]);
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef CANLINK_H
+#define CANLINK_H
+
+// The loops either side of the CAN controller: emptying the receive FIFO,
+// decodeTask's pass over the frames it took, and keyEventTask's batching of
+// key events into note frames. Portable, so the multi-module simulator in
+// src/host runs these loops rather than copies of them; the controller,
+// the RTOS and the consumers are reached through the types passed in.
+
+#include <stdint.h>
+#include "can.h"
+#include "canframe.h"
+#include "eventring.h"
+#include "noteevent.h"
+
+// Empty the receive FIFO into the ring, every frame stamped with tick. Fifo
+// provides
+//   bool level()                              A frame is waiting
+//   void rx(uint32_t &id, uint8_t data[8])    Take it
+template <typename Fifo, unsigned SIZE>
+void canlink_drain(Fifo &fifo, EventRing<CanFrame, SIZE, 1> &frames, uint32_t tick)
+{
+    while (fifo.level())
+    {
+        CanFrame &frame = frames.claim();
+        fifo.rx(frame.id, frame.data);
+        frame.tick = tick;
+        frames.commit();
+    }
+}
+
+// One wakeup of decodeTask: take every frame in the ring, pass control
+// frames on to the enumeration and, on the master only, decode note frames
+// into key events timed from their receive tick. Sink provides
+//   void activity()                                      Before the frames are taken
+//   void keyEvents(const NoteEvent *events, int count)
+//   void control(const uint8_t msg[8])
+//   void wakeKeys()                                      Once, after any key events
+//   void wakeChain()                                     Once, after any control frames
+template <unsigned SIZE, typename Sink>
+void canlink_decode(EventRing<CanFrame, SIZE, 1> &frames, bool master, Sink &sink)
+{
+    sink.activity();
+    bool keys = false;
+    bool control = false;
+    CanFrame frame;
+    while (frames.pop(0, frame))
+    {
+        uint32_t idClass = can_idClass(frame.id);
+        if (idClass == CAN_ID_CONTROL)
+        {
+            sink.control(frame.data);
+            control = true;
+            continue;
+        }
+        if (!master || idClass != CAN_ID_NOTE)
+            continue;
+        NoteEvent events[CAN_FRAME_EVENTS];
+        int count = canframe_decode(frame.data, frame.tick, events);
+        if (count)
+        {
+            sink.keyEvents(events, count);
+            keys = true;
+        }
+    }
+    if (keys)
+        sink.wakeKeys();
+    if (control)
+        sink.wakeChain();
+}
+
+// The CAN consumer of keyEventTask: everything pending at the cursor goes
+// out, up to four events to a frame, so a chord is sent as one frame. The
+// master keeps its keys to itself, so with forward false the events are
+// only consumed. send(const uint8_t msg[8]) queues a note frame.
+template <unsigned SIZE, unsigned CONSUMERS, typename Send>
+void canlink_sendKeyEvents(EventRing<NoteEvent, SIZE, CONSUMERS> &events, unsigned consumer, bool forward,
+                           Send send)
+{
+    NoteEvent batch[SIZE];
+    unsigned batched;
+    do
+    {
+        batched = 0;
+        while (batched < SIZE && events.pop(consumer, batch[batched]))
+        {
+            if (forward)
+                batched++;
+        }
+        for (unsigned start = 0; start < batched;)
+        {
+            uint8_t msg[8];
+            int sent = canframe_encode(batch + start, batched - start, msg);
+            if (sent > 0)
+                send(msg);
+            start += sent > 0 ? sent : 1;
+        }
+    } while (batched == SIZE);
+}
+
+#endif
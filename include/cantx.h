@@ -0,0 +1,138 @@
+#ifndef CANTX_H
+#define CANTX_H
+
+// One transmit queue per traffic class in front of the controller's three
+// mailboxes. Each class has at most one frame in the mailboxes at a time,
+// which keeps its frames in order even though the controller sends pending
+// mailboxes by ID, and lets a note frame always find a mailbox without
+// waiting for bulk traffic to drain.
+//
+// Portable: Mailboxes provides
+//   bool tryTx(uint32_t id, const uint8_t data[8], uint32_t &mailbox)
+//   bool pending(uint32_t mailbox)
+// with mailbox never 0. The caller keeps send() and refill() from running
+// at the same time; on the board, by masking the TX interrupt.
+
+#include <stdint.h>
+#include <string.h>
+#include "can.h"
+
+#define CAN_TX_DEPTH_NOTE 32
+#define CAN_TX_DEPTH_OTHER 8
+
+template <typename Mailboxes>
+class CanTxScheduler
+{
+private:
+    struct Queue
+    {
+        uint8_t (*frames)[8];
+        uint8_t depth;
+        uint8_t head;
+        uint8_t count;
+        uint8_t highWater;
+        uint32_t mailbox; // Holding this class's frame, or 0
+        uint32_t dropped;
+    };
+
+    Mailboxes mailboxes;
+    uint8_t noteFrames[CAN_TX_DEPTH_NOTE][8];
+    uint8_t controlFrames[CAN_TX_DEPTH_OTHER][8];
+    uint8_t telemetryFrames[CAN_TX_DEPTH_OTHER][8];
+    Queue queues[CAN_TX_CLASSES] = {
+        {noteFrames, CAN_TX_DEPTH_NOTE, 0, 0, 0, 0, 0},
+        {controlFrames, CAN_TX_DEPTH_OTHER, 0, 0, 0, 0, 0},
+        {telemetryFrames, CAN_TX_DEPTH_OTHER, 0, 0, 0, 0, 0}};
+
+    uint8_t controlTag = 0;
+    bool positioned = false;
+
+    uint32_t classId(int txClass, uint8_t position) const
+    {
+        if (txClass == CAN_TX_CONTROL)
+            return CAN_ID_CONTROL + (positioned ? position : controlTag);
+        return (txClass == CAN_TX_NOTE ? CAN_ID_NOTE : CAN_ID_TELEMETRY) + position;
+    }
+
+public:
+    explicit CanTxScheduler(const Mailboxes &mailboxes = Mailboxes()) : mailboxes(mailboxes)
+    {
+    }
+
+    // Control frames go out under this tag until setPositioned, see
+    // can_controlTag
+    void setControlTag(uint8_t tag)
+    {
+        controlTag = tag;
+        positioned = false;
+    }
+
+    // The position passed in is settled, so control frames can go out under
+    // it like the other classes
+    void setPositioned()
+    {
+        positioned = true;
+    }
+
+    // Move queued frames into free mailboxes, highest class first. Note and
+    // telemetry frames go out under the module's position.
+    void refill(uint8_t position)
+    {
+        for (int c = 0; c < CAN_TX_CLASSES; c++)
+        {
+            Queue &queue = queues[c];
+            if (queue.mailbox && mailboxes.pending(queue.mailbox))
+                continue;
+            queue.mailbox = 0;
+            if (!queue.count)
+                continue;
+            uint32_t mailbox;
+            if (!mailboxes.tryTx(classId(c, position), queue.frames[queue.head], mailbox))
+                return;
+            queue.mailbox = mailbox;
+            queue.head = (queue.head + 1) % queue.depth;
+            queue.count--;
+        }
+    }
+
+    // Queue a frame and start whatever can be started. Returns false, and
+    // counts a drop, if the class queue is full.
+    bool send(CanTxClass txClass, const uint8_t data[8], uint8_t position)
+    {
+        Queue &queue = queues[txClass];
+        bool queued = queue.count < queue.depth;
+        if (queued)
+        {
+            memcpy(queue.frames[(queue.head + queue.count) % queue.depth], data, 8);
+            queue.count++;
+            if (queue.count > queue.highWater)
+                queue.highWater = queue.count;
+        }
+        else
+        {
+            queue.dropped++;
+        }
+        refill(position);
+        return queued;
+    }
+
+    // True while the class has a frame queued or not yet sent
+    bool busy(CanTxClass txClass)
+    {
+        Queue &queue = queues[txClass];
+        return queue.count || (queue.mailbox && mailboxes.pending(queue.mailbox));
+    }
+
+    uint32_t dropped(CanTxClass txClass) const
+    {
+        return queues[txClass].dropped;
+    }
+
+    // Most frames ever waiting in the class queue at once
+    uint8_t highWater(CanTxClass txClass) const
+    {
+        return queues[txClass].highWater;
+    }
+};
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef CHAIN_H
+#define CHAIN_H
+
+// Enumeration of a row of modules over the west/east handshake lines and
+// CAN, as a state machine advanced once per key scan so it never holds the
+// scan up. Portable: the owner feeds it the handshake inputs and control
+// messages, drives the handshake outputs it asks for and sends the messages
+// it queues.
+//
+// With every handshake output on, only the west end sees its west input
+// off. It takes position 0, announces itself and, once the announcement has
+// left, switches its east output off, which its neighbour sees as its own
+// west input going off, and so on along the chain. The east end, with
+// nothing to its east, sends the module count that every module needs to
+// work out its octave. Outputs then go back on, and a settled module that
+// sees either input hold a new level for CHAIN_HYSTERESIS_MS broadcasts a
+// restart, so the whole chain enumerates again after a hot-plug. Each
+// restart starts a new epoch and messages from older ones are ignored.
+
+#include <stdint.h>
+
+// Up to eight modules in a row, each playing its own octave. Key frames
+// carry octaves 0-7, so the chain starts at octave 4 unless that would run
+// it past 7.
+#define CHAIN_MAX_MODULES 8
+#define CHAIN_BASE_OCTAVE 4
+
+#define CHAIN_POWER_UP_MS 100   // For every module to switch its handshake outputs on
+#define CHAIN_TIMEOUT_MS 1000   // Give up waiting for the east end
+#define CHAIN_TX_WAIT_MS 50     // Longest wait for an announcement to leave
+#define CHAIN_HYSTERESIS_MS 20  // A handshake input must hold a new level this long to count
+
+// Control messages in the CAN_ID_CONTROL class; byte 1 is the epoch
+#define CHAIN_MSG_ANNOUNCE 'E' // position, then the module's 32-bit ID
+#define CHAIN_MSG_COMPLETE 'C' // number of modules
+#define CHAIN_MSG_RESTART 'R'
+
+static inline int chain_firstOctave(int count)
+{
+    return count > 8 - CHAIN_BASE_OCTAVE ? 8 - count : CHAIN_BASE_OCTAVE;
+}
+
+enum ChainStage : uint8_t
+{
+    CHAIN_POWER_UP,      // Outputs on, waiting for the other modules
+    CHAIN_WAIT_WEST,     // For the west input to go off
+    CHAIN_ANNOUNCED,     // For the announcement to leave
+    CHAIN_WAIT_COMPLETE, // For the east end's count
+    CHAIN_SETTLING,      // Outputs back on, waiting for the chain to follow
+    CHAIN_SETTLED        // Watching the inputs for a hot-plug
+};
+
+class ChainDetector
+{
+private:
+    uint32_t id = 0;
+    uint32_t ids[CHAIN_MAX_MODULES] = {};
+    ChainStage stage = CHAIN_POWER_UP;
+    uint8_t epoch = 0;
+    uint32_t startTime = 0;
+    uint32_t stageTime = 0;
+    int8_t position = -1;
+    int8_t westPosition = -1; // Highest position announced this epoch
+    uint8_t count = 0;        // From the east end, 0 until then
+    bool eastOut = true;
+
+    // Settled configuration, kept while the next one is found
+    int8_t settledPosition = 0;
+    uint8_t settledCount = 1;
+
+    // Inputs when settled, and since when they have differed
+    bool baseWest = true;
+    bool baseEast = true;
+    bool changing = false;
+    uint32_t changeTime = 0;
+
+    uint8_t outbox[8] = {};
+    bool outboxFull = false;
+
+    void enter(ChainStage next, uint32_t now)
+    {
+        stage = next;
+        stageTime = now;
+    }
+
+    void restart(uint32_t now)
+    {
+        position = -1;
+        westPosition = -1;
+        count = 0;
+        eastOut = true;
+        startTime = now;
+        enter(CHAIN_POWER_UP, now);
+    }
+
+    void queue(uint8_t type, uint8_t a, uint32_t word = 0)
+    {
+        uint8_t msg[8] = {type, epoch, a, (uint8_t)word, (uint8_t)(word >> 8), (uint8_t)(word >> 16),
+                          (uint8_t)(word >> 24), 0};
+        for (int i = 0; i < 8; i++)
+            outbox[i] = msg[i];
+        outboxFull = true;
+    }
+
+    static int8_t nextPosition(int8_t west)
+    {
+        return west + 1 < CHAIN_MAX_MODULES ? west + 1 : CHAIN_MAX_MODULES - 1;
+    }
+
+    bool settle(int modules, uint32_t now)
+    {
+        if (position < 0)
+            position = nextPosition(westPosition);
+        if (modules <= position)
+            modules = position + 1;
+        if (modules > CHAIN_MAX_MODULES)
+            modules = CHAIN_MAX_MODULES;
+        count = (uint8_t)modules;
+        settledPosition = position;
+        settledCount = count;
+        eastOut = true;
+        enter(CHAIN_SETTLING, now);
+        return true;
+    }
+
+public:
+    // Start from power-up; moduleId should be unique on the bus
+    void begin(uint32_t moduleId, uint32_t now)
+    {
+        id = moduleId;
+        restart(now);
+    }
+
+    // A control message from another module
+    void receive(const uint8_t msg[8], uint32_t now)
+    {
+        int8_t age = (int8_t)(msg[1] - epoch);
+        if (msg[0] == CHAIN_MSG_RESTART)
+        {
+            if (age > 0)
+            {
+                epoch = msg[1];
+                restart(now);
+            }
+            return;
+        }
+        if (age != 0 || stage >= CHAIN_SETTLING)
+            return;
+        if (msg[0] == CHAIN_MSG_ANNOUNCE && msg[2] < CHAIN_MAX_MODULES)
+        {
+            ids[msg[2]] = msg[3] | msg[4] << 8 | msg[5] << 16 | (uint32_t)msg[6] << 24;
+            if ((int8_t)msg[2] > westPosition)
+                westPosition = msg[2];
+        }
+        else if (msg[0] == CHAIN_MSG_COMPLETE)
+        {
+            count = msg[2];
+        }
+    }
+
+    // Advance by one scan. west and east are the handshake inputs, true when
+    // off; controlIdle says every queued control message has left. Returns
+    // true on the update where a new configuration takes effect.
+    bool update(bool west, bool east, bool controlIdle, uint32_t now)
+    {
+        if (stage < CHAIN_SETTLING && now - startTime >= CHAIN_TIMEOUT_MS)
+            return settle(count, now);
+
+        switch (stage)
+        {
+        case CHAIN_POWER_UP:
+            if (now - stageTime >= CHAIN_POWER_UP_MS)
+                enter(CHAIN_WAIT_WEST, now);
+            break;
+        case CHAIN_WAIT_WEST:
+            // Held off long enough for the neighbour's announcement to have
+            // been taken in
+            if (!west)
+                stageTime = now;
+            if (now - stageTime < CHAIN_HYSTERESIS_MS)
+                break;
+            position = nextPosition(westPosition);
+            ids[position] = id;
+            if (position == 0 && east)
+                return settle(1, now); // Alone
+            queue(CHAIN_MSG_ANNOUNCE, (uint8_t)position, id);
+            enter(CHAIN_ANNOUNCED, now);
+            break;
+        case CHAIN_ANNOUNCED:
+            if (outboxFull || (!controlIdle && now - stageTime < CHAIN_TX_WAIT_MS))
+                break;
+            eastOut = false;
+            if (east)
+            {
+                queue(CHAIN_MSG_COMPLETE, (uint8_t)(position + 1));
+                return settle(position + 1, now);
+            }
+            enter(CHAIN_WAIT_COMPLETE, now);
+            break;
+        case CHAIN_WAIT_COMPLETE:
+            if (count)
+                return settle(count, now);
+            break;
+        case CHAIN_SETTLING:
+            if (now - stageTime >= CHAIN_POWER_UP_MS)
+            {
+                baseWest = west;
+                baseEast = east;
+                changing = false;
+                enter(CHAIN_SETTLED, now);
+            }
+            break;
+        case CHAIN_SETTLED:
+            if (west == baseWest && east == baseEast)
+            {
+                changing = false;
+            }
+            else if (!changing)
+            {
+                changing = true;
+                changeTime = now;
+            }
+            else if (now - changeTime >= CHAIN_HYSTERESIS_MS)
+            {
+                epoch++;
+                queue(CHAIN_MSG_RESTART, 0);
+                restart(now);
+            }
+            break;
+        }
+        return false;
+    }
+
+    // True while update() has timers running and must be called every scan
+    bool pending() const
+    {
+        return stage != CHAIN_SETTLED || changing;
+    }
+
+    bool settled() const
+    {
+        return stage == CHAIN_SETTLED;
+    }
+
+    // Handshake outputs to drive; the west one is always on
+    bool westOutput() const
+    {
+        return true;
+    }
+
+    bool eastOutput() const
+    {
+        return eastOut;
+    }
+
+    // Takes the control message waiting to be sent, if there is one
+    bool takeMessage(uint8_t msg[8])
+    {
+        if (!outboxFull)
+            return false;
+        for (int i = 0; i < 8; i++)
+            msg[i] = outbox[i];
+        outboxFull = false;
+        return true;
+    }
+
+    // The configuration in force, from the last enumeration to finish
+    int modulePosition() const
+    {
+        return settledPosition;
+    }
+
+    int moduleCount() const
+    {
+        return settledCount;
+    }
+
+    uint32_t moduleId(int position) const
+    {
+        return ids[position];
+    }
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+// Vertical-counter debouncer for 32 inputs at once. Each input has its own
+// counter, but the counters are stored bit-sliced, count[b] holding bit b of
+// all 32, so one update is a few bitwise operations per counter bit however
+// many inputs are bouncing. An input only changes state after DEPTH
+// consecutive samples that disagree with it; any agreeing sample resets its
+// counter.
+
+#include <stdint.h>
+
+// Samples an input must hold before its change is accepted. At the 1 kHz
+// scan rate this is also the added latency in ms.
+#ifndef DEBOUNCE_DEPTH
+#define DEBOUNCE_DEPTH 4
+#endif
+
+template <unsigned DEPTH>
+class VerticalDebouncer
+{
+    static_assert(DEPTH >= 1 && DEPTH <= 256, "DEBOUNCE_DEPTH must be 1..256");
+
+private:
+    // Bits needed to count up to DEPTH - 1, at least one
+    static constexpr unsigned bitsFor(unsigned n)
+    {
+        return n < 2 ? 1 : 1 + bitsFor(n >> 1);
+    }
+    static constexpr unsigned BITS = bitsFor(DEPTH - 1);
+
+    uint32_t count[BITS] = {};
+    uint32_t state;
+
+public:
+    explicit VerticalDebouncer(uint32_t initial = 0xffffffff) : state(initial) {}
+
+    // Feed one raw sample, returns the debounced inputs
+    uint32_t update(uint32_t raw)
+    {
+        uint32_t delta = raw ^ state;
+
+        // Inputs whose counter already shows DEPTH - 1 disagreeing samples
+        uint32_t full = delta;
+        for (unsigned b = 0; b < BITS; b++)
+            full &= (((DEPTH - 1) >> b) & 1) ? count[b] : ~count[b];
+
+        // Ripple-carry increment where the sample disagrees, clear elsewhere
+        // and wherever the input is about to change
+        uint32_t carry = delta;
+        uint32_t keep = delta & ~full;
+        for (unsigned b = 0; b < BITS; b++)
+        {
+            uint32_t c = count[b];
+            count[b] = (c ^ carry) & keep;
+            carry &= c;
+        }
+
+        state ^= full;
+        return state;
+    }
+
+    uint32_t value() const
+    {
+        return state;
+    }
+
+    // True while any input has an unconfirmed change, so the caller should
+    // keep sampling even if the raw inputs stop moving
+    bool pending() const
+    {
+        uint32_t any = 0;
+        for (unsigned b = 0; b < BITS; b++)
+            any |= count[b];
+        return any != 0;
+    }
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef EVENTRING_H
+#define EVENTRING_H
+
+// Single-producer, multi-consumer broadcast ring. Every consumer sees every
+// event through its own read index, so fan-out costs one index increment per
+// consumer and consumers never wait on each other. The producer never
+// blocks: a consumer that falls more than SIZE events behind loses the
+// oldest ones, counted in its overflow counter.
+//
+// Consumers copy a slot and then check the producer has not reached it in
+// the meantime, so a higher-priority producer can preempt a read safely.
+
+#include <stdint.h>
+
+template <typename T, unsigned SIZE, unsigned CONSUMERS>
+class EventRing
+{
+    static_assert((SIZE & (SIZE - 1)) == 0, "ring size must be a power of two");
+
+private:
+    T slots[SIZE];
+    volatile uint32_t head = 0; // Events ever pushed
+    uint32_t tail[CONSUMERS] = {};
+    volatile uint32_t overflow[CONSUMERS] = {};
+
+public:
+    // Producer only
+    void push(const T &event)
+    {
+        claim() = event;
+        commit();
+    }
+
+    // Producer only: fill the next slot in place, then commit it so the
+    // consumers see it
+    T &claim()
+    {
+        return slots[head & (SIZE - 1)];
+    }
+
+    void commit()
+    {
+        __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    // Each consumer index must only be used from one task
+    bool pop(unsigned consumer, T &event)
+    {
+        uint32_t t = tail[consumer];
+        while (1)
+        {
+            uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+            if (h == t)
+                return false;
+            // The producer may be writing slot h right now, which aliases
+            // t once t is SIZE behind, so at most SIZE - 1 are readable
+            if (h - t >= SIZE)
+            {
+                overflow[consumer] += h - t - (SIZE - 1);
+                t = h - (SIZE - 1);
+            }
+            event = slots[t & (SIZE - 1)];
+            if (__atomic_load_n(&head, __ATOMIC_ACQUIRE) - t < SIZE)
+                break;
+        }
+        tail[consumer] = t + 1;
+        return true;
+    }
+
+    uint32_t overflows(unsigned consumer) const
+    {
+        return overflow[consumer];
+    }
+};
+
+#endif
@@ -0,0 +1,271 @@
+#ifndef FLASHLOG_H
+#define FLASHLOG_H
+
+// Log-structured record store for a few pages of flash. Records are only
+// ever appended, page after page round the region, so every page is erased
+// equally often. The latest record of each type is the live one. Mounting
+// reads the region once, oldest page first, and keeps the position of each
+// live record; its data is then read straight from flash.
+//
+// Each page starts with a header of FLASHLOG_MAGIC and a sequence number
+// one higher than the page before. Each record is a header double word:
+// type, 0xff, length, then the CRC-32 of the type, length and data. The
+// data follows, padded with 0xff to a double word. The header is programmed
+// first, so a record cut short by a reset fails its CRC and is skipped.
+//
+// The page after the head is kept erased, so an append never waits for an
+// erase. Moving onto it copies forward whatever is still live in the page
+// after that, the oldest, which then needs erasing before the next move;
+// maintain() does that when the caller can afford the stall. A page only
+// joins the log once its own header is programmed, after everything in it. Every type's
+// largest record together must fit in a page.
+//
+// Portable: Flash provides
+//   static const uint32_t PAGE_SIZE; static const uint16_t PAGES;
+//   const uint8_t *data()                       the region, readable
+//   bool erase(uint16_t page)                   to all 0xff
+//   bool program(uint32_t offset, uint64_t value)  one erased double word
+
+#include <stdint.h>
+#include <string.h>
+
+#define FLASHLOG_TYPES 4
+#define FLASHLOG_MAGIC 0x474f4c53UL // "SLOG"
+#define FLASHLOG_ERASED 0xffffffffffffffffULL
+
+static inline uint32_t flashlog_crc32(uint32_t crc, const uint8_t *data, uint32_t n)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+    crc = ~crc;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        crc = table[(crc ^ data[i]) & 15] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 15] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+template <typename Flash>
+class FlashLog
+{
+private:
+    static const uint32_t PAGE_SIZE = Flash::PAGE_SIZE;
+    static const uint16_t PAGES = Flash::PAGES;
+
+    Flash &flash;
+    uint16_t head = PAGES - 1; // Page being appended to
+    uint32_t used = PAGE_SIZE; // Bytes of it written, the whole page until mounted
+    uint32_t sequence = 0;     // Of the head page
+    bool dirty = false;        // The oldest page still needs erasing
+    uint32_t live[FLASHLOG_TYPES] = {}; // Offset of each type's record header + 1, or 0
+
+    static uint32_t padded(uint32_t length)
+    {
+        return (length + 7) & ~7UL;
+    }
+
+    uint64_t read64(uint32_t offset)
+    {
+        uint64_t value;
+        memcpy(&value, flash.data() + offset, sizeof(value));
+        return value;
+    }
+
+    uint16_t following(uint16_t page)
+    {
+        return (uint16_t)((page + 1) % PAGES);
+    }
+
+    bool erased(uint16_t page)
+    {
+        for (uint32_t i = 0; i < PAGE_SIZE; i += 8)
+            if (read64(page * PAGE_SIZE + i) != FLASHLOG_ERASED)
+                return false;
+        return true;
+    }
+
+    // Record every valid record in a page as live, and return where the
+    // page's writes end
+    uint32_t scan(uint16_t page)
+    {
+        uint32_t base = page * PAGE_SIZE;
+        uint32_t offset = 8;
+        while (offset + 8 <= PAGE_SIZE)
+        {
+            uint64_t header = read64(base + offset);
+            if (header == FLASHLOG_ERASED)
+                break;
+            uint8_t type = (uint8_t)header;
+            uint16_t length = (uint16_t)(header >> 16);
+            if (length > PAGE_SIZE - offset - 8)
+                return PAGE_SIZE; // Not a header: nothing more can go here
+            if (type < FLASHLOG_TYPES && (uint32_t)(header >> 32) == crc(type, length, flash.data() + base + offset + 8))
+                live[type] = base + offset + 1;
+            offset += 8 + padded(length);
+        }
+        return offset;
+    }
+
+    static uint32_t crc(uint8_t type, uint16_t length, const uint8_t *data)
+    {
+        uint8_t prefix[3] = {type, (uint8_t)length, (uint8_t)(length >> 8)};
+        return flashlog_crc32(flashlog_crc32(0, prefix, sizeof(prefix)), data, length);
+    }
+
+    // Program a record at offset in the region, returning the bytes taken
+    uint32_t write(uint32_t offset, uint8_t type, const uint8_t *data, uint16_t length)
+    {
+        uint64_t header = type | 0xff00ULL | (uint64_t)length << 16 | (uint64_t)crc(type, length, data) << 32;
+        if (!flash.program(offset, header))
+            return 0;
+        for (uint32_t i = 0; i < length; i += 8)
+        {
+            uint64_t value = FLASHLOG_ERASED;
+            memcpy(&value, data + i, length - i < 8 ? length - i : 8);
+            if (!flash.program(offset + 8 + i, value))
+                return 0;
+        }
+        return 8 + padded(length);
+    }
+
+    // Fill the erased page after the head with whatever is still live in
+    // the oldest page, except type, then the new record, and only then its
+    // header. Until that is programmed the page is not part of the log, so
+    // a reset part way leaves the log as it was.
+    bool advance(uint8_t type, const uint8_t *data, uint16_t length)
+    {
+        if (dirty)
+            return false;
+        uint16_t next = following(head);
+        uint16_t oldest = following(next);
+        uint32_t base = next * PAGE_SIZE;
+        uint32_t offset = 8;
+        uint32_t moved[FLASHLOG_TYPES];
+        memcpy(moved, live, sizeof(moved));
+        for (uint8_t t = 0; t < FLASHLOG_TYPES; t++)
+        {
+            if (t == type || !live[t] || (live[t] - 1) / PAGE_SIZE != oldest)
+                continue;
+            const uint8_t *record = flash.data() + live[t] + 7;
+            uint32_t size = write(base + offset, t, record, (uint16_t)(read64(live[t] - 1) >> 16));
+            if (!size)
+            {
+                dirty = true; // Erase it again before trying
+                return false;
+            }
+            moved[t] = base + offset + 1;
+            offset += size;
+        }
+        uint32_t size = offset + 8 + padded(length) <= PAGE_SIZE ? write(base + offset, type, data, length) : 0;
+        if (!size || !flash.program(base, FLASHLOG_MAGIC | (uint64_t)(sequence + 1) << 32))
+        {
+            dirty = true; // Erase it again before trying
+            return false;
+        }
+        moved[type] = base + offset + 1;
+        memcpy(live, moved, sizeof(live));
+        head = next;
+        sequence++;
+        used = offset + size;
+        dirty = !erased(oldest);
+        return true;
+    }
+
+public:
+    FlashLog(Flash &flash) : flash(flash)
+    {
+    }
+
+    // Find the head and every live record in one pass over the region
+    void mount()
+    {
+        memset(live, 0, sizeof(live));
+        head = PAGES - 1;
+        used = PAGE_SIZE;
+        sequence = 0;
+        bool found = false;
+        for (uint16_t p = 0; p < PAGES; p++)
+        {
+            uint64_t header = read64(p * PAGE_SIZE);
+            uint32_t seq = (uint32_t)(header >> 32);
+            if ((uint32_t)header == FLASHLOG_MAGIC && (!found || (int32_t)(seq - sequence) > 0))
+            {
+                head = p;
+                sequence = seq;
+                found = true;
+            }
+        }
+
+        // Pages in the order written; one left from an earlier round of the
+        // log, or never started, is not part of it
+        if (found)
+        {
+            for (uint16_t i = 1; i <= PAGES; i++)
+            {
+                uint16_t p = (uint16_t)((head + i) % PAGES);
+                uint64_t header = read64(p * PAGE_SIZE);
+                if ((uint32_t)header != FLASHLOG_MAGIC || (uint32_t)(header >> 32) != sequence - (PAGES - i))
+                    continue;
+                uint32_t end = scan(p);
+                if (p == head)
+                    used = end;
+            }
+        }
+        dirty = !erased(following(head));
+    }
+
+    // Append a record, which becomes the live one of its type. Fails if it
+    // is too big, if flash fails, or if the page is full and the next is
+    // still waiting for maintain().
+    bool append(uint8_t type, const void *data, uint16_t length)
+    {
+        if (type >= FLASHLOG_TYPES || 8 + padded(length) > PAGE_SIZE - 8)
+            return false;
+        if (used + 8 + padded(length) > PAGE_SIZE)
+            return advance(type, (const uint8_t *)data, length);
+        uint32_t offset = head * PAGE_SIZE + used;
+        uint32_t size = write(offset, type, (const uint8_t *)data, length);
+        if (!size)
+        {
+            used = PAGE_SIZE; // Leave the rest of the page
+            return false;
+        }
+        live[type] = offset + 1;
+        used += size;
+        return true;
+    }
+
+    // The live record of a type, read in place, or nullptr
+    const uint8_t *find(uint8_t type, uint16_t &length)
+    {
+        if (type >= FLASHLOG_TYPES || !live[type])
+            return nullptr;
+        length = (uint16_t)(read64(live[type] - 1) >> 16);
+        return flash.data() + live[type] + 7;
+    }
+
+    // The oldest page needs erasing before the log can move on
+    bool pending() const
+    {
+        return dirty;
+    }
+
+    // Erase it; the caller picks a time it can stall for the erase
+    bool maintain()
+    {
+        if (!dirty)
+            return true;
+        uint16_t oldest = following(head);
+        if (!flash.erase(oldest))
+            return false;
+        for (uint8_t t = 0; t < FLASHLOG_TYPES; t++)
+            if (live[t] && (live[t] - 1) / PAGE_SIZE == oldest)
+                live[t] = 0;
+        dirty = false;
+        return true;
+    }
+};
+
+#endif
@@ -7,49 +7,55 @@
 #include <U8g2lib.h>
 #include <ES_CAN.h>
 #include "Knob.h"
+#include "synth.h"
+#include "sequencer.h"
+#include "noteevent.h"
+#include "eventring.h"
+#include "autodetection.h"
 
 // ---------------------- CONFIG ----------------------
 // #define OCTAVE 4                  // or 4, depending on the board
 #define TICK_DURATION_SAMPLES 100 // Adjust duration (in number of audio samples)
-#define TICK_AMPLITUDE 50         // Adjust amplitude of the click
 
+// Set by chain_update when the chain settles. Position 0 is the west end, which plays and
+// records for the whole chain.
+extern volatile int modulePosition;
+extern volatile int moduleCount;
 extern volatile int moduleOctave;
 
-extern bool prevWest;
-extern bool prevEast;
-// Audio sampling frequency
-static const uint32_t fs = 22000;
+// Audio sampling frequency, set with -D SYNTH_SAMPLE_RATE
+static const uint32_t fs = SYNTH_SAMPLE_RATE;
 
-// Step size arrays for C4 & C5
-extern const uint32_t stepSizes4[12];
-extern const uint32_t stepSizes5[12];
-extern const uint32_t stepSizes6[12];
+// Step sizes for C4, C5 and C6 upwards, views into tuningTable
+extern const uint32_t *const stepSizes4;
+extern const uint32_t *const stepSizes5;
+extern const uint32_t *const stepSizes6;
 extern volatile uint32_t currentStepSize;
-extern volatile uint32_t currentStepSize1;
-extern volatile uint32_t currentStepSize2;
-extern volatile uint32_t currentStepSize3;
-extern volatile uint32_t currentStepSize4;
-extern volatile uint32_t currentStepSize5;
-extern uint32_t phaseAcc1;
-extern uint32_t phaseAcc2;
-extern uint32_t phaseAcc3;
-extern uint32_t phaseAcc4;
-extern uint32_t phaseAcc5;
-
-// Pressed-key tracking
-extern SemaphoreHandle_t localKeyMutex;
-extern SemaphoreHandle_t externalKeyMutex;
-extern std::bitset<12> keys4;
-extern std::bitset<12> keys5;
-extern std::bitset<12> keys6;
-
-extern std::bitset<2> prevKnobState;
-extern Knob knob3;
-extern Knob knob2;
-
-extern QueueHandle_t msgInQ;
-extern QueueHandle_t msgOutQ;
-extern SemaphoreHandle_t CAN_TX_Semaphore;
+extern SynthState synthState;
+extern SynthControl synthControl; // Writers' copy of the renderer's snapshot
+extern SemaphoreHandle_t voiceMutex; // Held while editing and publishing synthControl
+
+// Pressed keys of every module, by position in the chain
+extern SemaphoreHandle_t keyStateMutex;
+extern std::bitset<12> moduleKeys[CHAIN_MAX_MODULES];
+
+// Key events, each ring written by one task and read independently by every
+// consumer. Timestamps are in ticks (1 ms).
+enum KeyConsumer
+{
+    KEY_CONSUMER_VOICE,
+    KEY_CONSUMER_SAMPLER,
+    KEY_CONSUMER_DISPLAY,
+    KEY_CONSUMER_CAN,
+    KEY_CONSUMERS
+};
+#define KEY_EVENT_RING_SIZE 32
+typedef EventRing<NoteEvent, KEY_EVENT_RING_SIZE, KEY_CONSUMERS> KeyEventRing;
+extern KeyEventRing localKeyEvents;  // From scanKeysTask
+extern KeyEventRing remoteKeyEvents; // From decodeTask
+// Tick of the last key event or CAN frame seen. Every module hears every
+// frame, so this is the last activity anywhere in the chain.
+extern volatile TickType_t lastActivityTick;
 
 extern uint8_t RX_Message[8];
 
@@ -59,16 +65,20 @@ struct SystemState
     std::bitset<32> inputs;
     SemaphoreHandle_t mutex;
     int rotationVariable;
-    int volume;
-    Knob knob3{0, 8};
-    Knob knob2{0, 8};
+    // Set by scanKeysTask from knob events only, read without the mutex
+    volatile int volume;
+    volatile int waveform;
+    volatile int envelope[4] = {ENV_DEFAULT_ATTACK, ENV_DEFAULT_DECAY, ENV_DEFAULT_SUSTAIN, ENV_DEFAULT_RELEASE};
+    volatile bool envelopePage; // Knobs 0 and 1 on sustain and release
 };
 
 extern SystemState sysState;
 
 // sampler
-extern volatile bool samplerEnabled;
-extern volatile TickType_t samplerLoopStartTime;
+extern volatile bool samplerEnabled; // Toggled by a knob 2 press
+extern Sequencer sequencer;          // Plays the loop from the audio path
+extern volatile uint8_t loopTrack;         // Track overdubs go to, stepped by a knob 3 press
+extern volatile uint32_t loopUndoRequests; // Bumped by a knob 2 long press
 
 extern volatile bool metronomeActive;
 extern volatile uint32_t metronomeCounter;
@@ -80,6 +90,8 @@ extern U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C u8g2;
 // inside globals.h
 extern TaskHandle_t scanKeysHandle;
 extern TaskHandle_t displayTaskHandle;
+extern TaskHandle_t keyEventHandle;
+extern TaskHandle_t decodeHandle;
 
 // scanKeys Iterations
 extern uint32_t scanKeysIterations;
@@ -103,7 +115,7 @@ extern TickType_t decodeStartTime;
 
 // CAN_TX iterations
 extern uint32_t CAN_TX_Iterations;
-extern TickType_t CAN_TX_StartTime;
+extern uint32_t CAN_TX_Micros; // Spent in can_send by CAN_TX_Function
 
 // --------------- Function Prototypes ---------------
 void setOutMuxBit(const uint8_t bitIdx, const bool value);
@@ -1,8 +1,12 @@
 #ifndef ISR_H
 #define ISR_H
 
+#include <stdint.h>
+#include <stddef.h>
 
+void renderAudioBlock(uint8_t *out, size_t n);
 void sampleISR(void);
 void sampleISRTest();
+void mixKernelFunction(void *pvParameters);
 
 #endif 
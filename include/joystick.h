@@ -0,0 +1,17 @@
+#ifndef JOYSTICK_H
+#define JOYSTICK_H
+
+#include <stdint.h>
+
+// Sample both joystick axes continuously: ADC1 converts JOYX_PIN and
+// JOYY_PIN in turn with 16x hardware oversampling, and DMA2 channel 3 keeps
+// the latest pair in memory. No interrupt or task is involved.
+void joystick_init();
+
+// Low-pass filter the latest samples and return X as pitch bend (Q15, -1..1)
+// and Y deflection either way as modulation (Q15, 0..1), both 0 inside a dead
+// zone around the rest position. Called once per audio block from
+// renderAudioBlock; returns 0s until the first conversion lands.
+void joystick_read(int16_t &pitchBend, int16_t &modulation);
+
+#endif
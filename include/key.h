@@ -1,6 +1,17 @@
 #ifndef KEY_H
 #define KEY_H
 
+#include <stdint.h>
+#include "noteevent.h"
+
+void noteOn(uint8_t octave, uint8_t noteIndex);
+void noteOff(uint8_t octave, uint8_t noteIndex);
+void allNotesOff();
+void playKeyEvents(const NoteEvent *events, int count);
+void showKeyEvent(const NoteEvent &event);
+
+void keyEventTask(void *pvParameters);
+
 void scanKeysTask(void *pvParameters);
 void scanKeysFunction(void *pvParameters);
 #endif 
\ No newline at end of file
@@ -1,110 +1,187 @@
 #ifndef KNOB_H
 #define KNOB_H
 
-#include <Arduino.h>
-#include <bitset>
+// Decoder for the four rotary encoders on the input matrix. All four are
+// updated from one matrix snapshot per scan, and each reports what changed
+// as KnobEvents rather than a value to poll. What a knob controls is up to
+// whoever handles the events.
+
+#include <stdint.h>
+
+#define KNOB_COUNT 4
+#define KNOB_EVENTS_MAX (KNOB_COUNT * 2) // Per update: a rotation and a press per knob
+
+// Quadrature transitions between detents. The encoders rest where A == B.
+#define KNOB_STEPS_PER_DETENT 2
+
+// Detents closer together than these in the same direction count 4 or 2
+#define KNOB_ACCEL_FAST_MS 20
+#define KNOB_ACCEL_MEDIUM_MS 50
+
+#define KNOB_LONG_PRESS_MS 600
+#define KNOB_HOLD_POLL_MS 10 // Long press resolution while nothing else changes
+
+enum KnobEventType : uint8_t
+{
+    KNOB_ROTATE,     // delta detents, already accelerated
+    KNOB_PRESS,      // Released before KNOB_LONG_PRESS_MS
+    KNOB_LONG_PRESS  // Held for KNOB_LONG_PRESS_MS; no KNOB_PRESS follows
+};
+
+struct KnobEvent
+{
+    uint8_t knob;
+    KnobEventType type;
+    int8_t delta;
+};
+
+// Matrix bit of each knob's A input (B is the next bit up) and of its press
+// switch, which reads 0 while pressed
+static constexpr uint8_t knobRotationBit[KNOB_COUNT] = {18, 16, 14, 12};
+static constexpr uint8_t knobPressBit[KNOB_COUNT] = {24, 25, 20, 21};
+
+// Quarter steps for each (previous << 2 | current) AB state pair. The
+// forward sequence is 00, 01, 11, 10. Both inputs changing at once means a
+// state was missed and is marked 2, to be taken in the last direction seen.
+static constexpr int8_t quadratureTable[16] = {
+    0, 1, -1, 2,
+    -1, 0, 2, 1,
+    1, 2, 0, -1,
+    2, -1, 1, 0};
 
 class Knob
 {
 private:
-    int rotationValue; // Current rotation value
-    int lastUpdateValue = 0;
-    int lowerLimit;           // Minimum limit for rotation
-    int upperLimit;           // Maximum limit for rotation
-    std::bitset<2> prevState; // Previous state of the quadrature inputs
-    bool press;
-    bool prevPress;
-    enum class pressState
-    {
-        IDLE,
-        PRESSED,
-        RELEASED
-    };
-    pressState currentPressState = pressState::IDLE;
+    uint8_t state = 0;      // Last AB inputs
+    int8_t quarterSteps = 0; // Since the last detent
+    int8_t direction = 1;
+    bool held = false;
+    bool longReported = false;
+    uint32_t pressTime = 0;
+    uint32_t detentTime = 0;
 
 public:
-    // Constructor
-    Knob(int minLimit = -100, int maxLimit = 100) : rotationValue(0), lowerLimit(minLimit), upperLimit(maxLimit), prevState(0) {}
-
-    // Set limits for rotation value
-    void setLimits(int minLimit, int maxLimit)
+    // Take the inputs as they are without counting anything
+    void reset(uint8_t ab, bool pressed)
     {
-        lowerLimit = minLimit;
-        upperLimit = maxLimit;
+        state = ab;
+        quarterSteps = 0;
+        held = pressed;
+        longReported = pressed; // A press already down at start is not a press
     }
 
-    void updatePress(std::bitset<1> currentPress)
+    // Returns detents moved, scaled up when turned quickly
+    int8_t rotate(uint8_t ab, uint32_t now)
     {
-        switch (currentPressState)
-        {
-        case pressState::IDLE:
-            if (currentPress == std::bitset<1>("0"))
-            {                   // Button is pressed
-                press = !press; // Toggle press state
-                currentPressState = pressState::PRESSED;
-            }
-            break;
+        int8_t step = quadratureTable[(state << 2) | ab];
+        state = ab;
+        if (step == 2)
+            step = 2 * direction;
+        else if (step)
+            direction = step;
+        quarterSteps += step;
 
-        case pressState::PRESSED:
-            if (currentPress == std::bitset<1>("1"))
-            { // Button is released
-                currentPressState = pressState::RELEASED;
-            }
-            break;
+        bool detent = (ab == 0 || ab == 3);
+        if (!detent)
+            return 0;
+        int8_t detents = quarterSteps / KNOB_STEPS_PER_DETENT;
+        quarterSteps = 0;
+        if (!detents)
+            return 0;
 
-        case pressState::RELEASED:
-            if (currentPress == std::bitset<1>("0"))
-            { // Wait for full release before allowing another press
-                currentPressState = pressState::IDLE;
-            }
-            break;
-        }
+        uint32_t interval = now - detentTime;
+        detentTime = now;
+        if (interval < KNOB_ACCEL_FAST_MS)
+            detents *= 4;
+        else if (interval < KNOB_ACCEL_MEDIUM_MS)
+            detents *= 2;
+        return detents;
     }
 
-    // Update the rotation value based on quadrature encoder inputs
-    void updateRotation(std::bitset<2> currentState)
+    // Returns true with the event type when a press or long press completes
+    bool press(bool pressed, uint32_t now, KnobEventType &type)
     {
-        if (prevState != currentState)
+        if (pressed && !held)
         {
-            if (prevState == std::bitset<2>("00") && currentState == std::bitset<2>("01"))
-            {
-                rotationValue = constrain(rotationValue + 1, lowerLimit, upperLimit);
-                lastUpdateValue = 1;
-            }
-            else if (prevState == std::bitset<2>("11") && currentState == std::bitset<2>("10"))
-            {
-                rotationValue = constrain(rotationValue + 1, lowerLimit, upperLimit);
-                lastUpdateValue = 1;
-            }
-            else if (prevState == std::bitset<2>("10") && currentState == std::bitset<2>("11"))
-            {
-                rotationValue = constrain(rotationValue - 1, lowerLimit, upperLimit);
-                lastUpdateValue = -1;
-            }
-            else if (prevState == std::bitset<2>("01") && currentState == std::bitset<2>("00"))
-            {
-                rotationValue = constrain(rotationValue - 1, lowerLimit, upperLimit);
-                lastUpdateValue = -1;
-            }
-            else if ((prevState == std::bitset<2>("00") && currentState == std::bitset<2>("11")) ||
-                     (prevState == std::bitset<2>("11") && currentState == std::bitset<2>("00")))
+            held = true;
+            longReported = false;
+            pressTime = now;
+            return false;
+        }
+        if (pressed && !longReported && now - pressTime >= KNOB_LONG_PRESS_MS)
+        {
+            longReported = true;
+            type = KNOB_LONG_PRESS;
+            return true;
+        }
+        if (!pressed && held)
+        {
+            held = false;
+            if (!longReported)
             {
-                rotationValue = constrain(rotationValue + lastUpdateValue, lowerLimit, upperLimit);
+                type = KNOB_PRESS;
+                return true;
             }
         }
-        prevState = currentState;
+        return false;
+    }
+
+    bool isHeld() const
+    {
+        return held && !longReported;
+    }
+};
+
+class KnobBank
+{
+private:
+    Knob knobs[KNOB_COUNT];
+
+    static uint8_t rotationInputs(uint32_t inputs, int k)
+    {
+        return (inputs >> knobRotationBit[k]) & 3;
     }
 
-    bool getPress()
+    static bool pressed(uint32_t inputs, int k)
     {
-        return press;
+        return !((inputs >> knobPressBit[k]) & 1);
     }
 
-    // Get the current rotation value
-    int getRotationValue() const
+public:
+    void reset(uint32_t inputs)
     {
-        return rotationValue;
+        for (int k = 0; k < KNOB_COUNT; k++)
+            knobs[k].reset(rotationInputs(inputs, k), pressed(inputs, k));
+    }
+
+    // Decode one matrix snapshot. Writes up to KNOB_EVENTS_MAX events and
+    // returns how many.
+    int update(uint32_t inputs, uint32_t now, KnobEvent *events)
+    {
+        int count = 0;
+        for (int k = 0; k < KNOB_COUNT; k++)
+        {
+            int8_t delta = knobs[k].rotate(rotationInputs(inputs, k), now);
+            if (delta)
+                events[count++] = {(uint8_t)k, KNOB_ROTATE, delta};
+            KnobEventType type;
+            if (knobs[k].press(pressed(inputs, k), now, type))
+                events[count++] = {(uint8_t)k, type, 0};
+        }
+        return count;
+    }
+
+    // True while a press could still turn into a long press, which needs
+    // update() calls even when no input changes
+    bool pressPending() const
+    {
+        for (int k = 0; k < KNOB_COUNT; k++)
+        {
+            if (knobs[k].isHeld())
+                return true;
+        }
+        return false;
     }
 };
 
-#endif // KNOB_H
\ No newline at end of file
+#endif // KNOB_H
@@ -0,0 +1,75 @@
+#ifndef LOOPER_H
+#define LOOPER_H
+
+// Compact loop storage for the sequencer: up to LOOPER_TRACKS tracks packed
+// end to end in one byte array. Each event is its time since the previous
+// event on the track, in sequencer ticks (1 ms), as a varint (7 bits a byte,
+// low bits first), then one byte holding the note number with bit 7 set for
+// a release. An event takes 2 bytes within 127 ms of the one before, and 3
+// bytes up to 16 s, against 8 for a NoteEvent.
+//
+// A bank is never edited in place while it may be playing. An overdub
+// merges a take into one track while copying the bank into another, so the
+// bank it started from is left intact to go back to.
+//
+// Portable, like synth.h.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LOOPER_TRACKS 8
+#define LOOPER_BANK_BYTES 1520 // With end[], 1536 bytes a bank
+
+#define LOOPER_RELEASE 0x80 // In the event byte; the low 7 bits are the note
+#define LOOPER_NOTE_MASK 0x7f
+
+struct LoopBank
+{
+    uint16_t end[LOOPER_TRACKS]; // Track t runs from end[t - 1], or 0, to end[t]
+    uint8_t data[LOOPER_BANK_BYTES];
+};
+
+// A recorded event, as loop position << 8 | event byte, so takes sort by
+// position with plain integer compares. Positions must be below 2^24.
+static inline uint32_t looper_takeEvent(uint32_t position, char type, uint8_t note)
+{
+    return position << 8 | (type == 'R' ? LOOPER_RELEASE : 0) | (note & LOOPER_NOTE_MASK);
+}
+
+static inline uint16_t looper_trackStart(const LoopBank &bank, int track)
+{
+    return track ? bank.end[track - 1] : 0;
+}
+
+// Decode the event at offset i, adding its delta to position. Returns the
+// event byte and leaves i on the next event.
+static inline uint8_t looper_next(const uint8_t *data, uint16_t &i, uint32_t &position)
+{
+    uint32_t delta = 0;
+    uint8_t shift = 0;
+    uint8_t byte;
+    do
+    {
+        byte = data[i++];
+        delta |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    position += delta;
+    return data[i++];
+}
+
+// Empty every track
+void looper_clear(LoopBank &bank);
+
+// Bytes used by all tracks
+static inline uint16_t looper_used(const LoopBank &bank)
+{
+    return bank.end[LOOPER_TRACKS - 1];
+}
+
+// Copy from into to with count take events, in position order, merged into
+// track. On equal positions the track's own events play first. Returns
+// false, leaving to untouched, if the result does not fit.
+bool looper_overdub(const LoopBank &from, int track, const uint32_t *take, int count, LoopBank &to);
+
+#endif
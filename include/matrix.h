@@ -0,0 +1,68 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+// Key matrix scanner on direct GPIO registers. The row address and OUT pins
+// all sit on port B and the columns on port A, so a row is selected with one
+// BSRR write and read with one IDR read instead of nine Arduino pin calls.
+
+#include <stdint.h>
+#include <STM32FreeRTOS.h>
+
+enum GpioPort
+{
+    PORT_A,
+    PORT_B
+};
+
+struct PortPin
+{
+    GpioPort port;
+    uint8_t bit;
+};
+
+// Same pins as pins.h, as wired on the Nucleo-L432KC
+constexpr PortPin RA0_PORTPIN = {PORT_B, 0}; // D3
+constexpr PortPin RA1_PORTPIN = {PORT_B, 1}; // D6
+constexpr PortPin RA2_PORTPIN = {PORT_B, 4}; // D12
+constexpr PortPin OUT_PORTPIN = {PORT_B, 5}; // D11
+constexpr PortPin REN_PORTPIN = {PORT_A, 6}; // A5
+constexpr PortPin C0_PORTPIN = {PORT_A, 3};  // A2
+constexpr PortPin C1_PORTPIN = {PORT_A, 8};  // D9
+constexpr PortPin C2_PORTPIN = {PORT_A, 7};  // A6
+constexpr PortPin C3_PORTPIN = {PORT_A, 9};  // D1
+
+#define MATRIX_ROWS 7
+
+// CPU cycles per scan: the whole of matrix_scan, or just the end-of-sweep
+// interrupt once scanning runs in the background
+extern volatile uint32_t matrixScanCycles;
+extern volatile uint32_t matrixScanCyclesMax;
+
+// Enables the cycle counter and works out the row settling time; pins must
+// already be configured with pinMode
+void matrix_init();
+
+// Scan rows 0..MATRIX_ROWS-1, bit row * 4 + col of the result is that key's
+// input, low when pressed
+uint32_t matrix_scan();
+
+// The four column inputs of a single row
+uint8_t matrix_readRow(uint8_t row);
+
+// Latch value into the output flip-flop selected by row, e.g. DEN_BIT. Every
+// later scan re-latches the same value when it selects that row.
+void matrix_setOutput(uint8_t row, bool value);
+
+// Hand scanning to hardware: TIM2 steps the row address and REN through DMA
+// and a fourth DMA channel captures the column port for each row. At the end
+// of every sweep (MATRIX_SCAN_HZ) an interrupt packs the seven captures and,
+// only if the matrix changed, notifies task with the matrix_scan layout as
+// its notification value. After this call matrix_scan must not be used, and
+// matrix_readRow returns the last capture.
+#define MATRIX_SCAN_HZ 1000
+void matrix_startBackgroundScan(TaskHandle_t task);
+
+// Most recent background sweep
+uint32_t matrix_lastScan();
+
+#endif
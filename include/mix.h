@@ -0,0 +1,33 @@
+#ifndef MIX_H
+#define MIX_H
+
+// Voice-mixing kernel. On Cortex-M4 it packs one sample from each of two
+// voices into a register and mixes both with a single SMLAD, then QADDs into
+// the accumulator. The portable path computes bit-identical results so the
+// two can be fuzz-compared, and so the host renderer matches the firmware.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP && !defined(MIX_FORCE_PORTABLE)
+#define MIX_HAVE_DSP 1
+#else
+#define MIX_HAVE_DSP 0
+#endif
+
+// acc[i] = saturate32(acc[i] + a[i] * gA(i) + b[i] * gB(i)) for i < n, where
+// gA(i) = gainA + i * stepA and likewise for b, so envelope levels ramp
+// smoothly across a block. Gains must stay Q15 in 0..32767 over the whole
+// ramp, which keeps each two-voice product sum inside int32 so only the
+// accumulation needs saturating. a and b must be 4-byte aligned; an odd voice
+// is mixed by passing it as both a and b with gainB and stepB 0.
+void mix_accumulatePair(int32_t *acc, const int16_t *a, const int16_t *b,
+                        int16_t gainA, int16_t gainB,
+                        int16_t stepA, int16_t stepB, size_t n);
+
+// Plain C++ reference, always built
+void mix_accumulatePairPortable(int32_t *acc, const int16_t *a, const int16_t *b,
+                                int16_t gainA, int16_t gainB,
+                                int16_t stepA, int16_t stepB, size_t n);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef NOTEEVENT_H
+#define NOTEEVENT_H
+
+// Recorded key event, shared by the sampler and the host renderer
+
+#include <stdint.h>
+
+struct NoteEvent
+{
+    uint32_t timestamp; // Ticks (ms); the sample it started on once played by the sequencer
+    char type;          // 'P' press, 'R' release
+    uint8_t octave;
+    uint8_t noteIndex;
+};
+
+#endif
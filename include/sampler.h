@@ -4,22 +4,21 @@
 #include <Arduino.h>
 #include <STM32FreeRTOS.h>
 #include "globals.h"
-
-struct NoteEvent
-{
-    uint32_t timestamp;
-    char type;
-    uint8_t octave;
-    uint8_t noteIndex;
-};
+#include "noteevent.h"
+#include "sequencer.h"
 
 void sampler_init();
 
-void sampler_recordEvent(char type, uint8_t octave, uint8_t noteIndex);
+void sampler_recordEvent(const NoteEvent &event);
+
+// For the store: changes to the loop since start-up, a copy of it with the
+// version copied, and at boot a loop to play when the sampler is first started
+uint32_t sampler_loopVersion();
+uint32_t sampler_copyLoop(LoopBank &out);
+void sampler_restoreLoop(const LoopBank &loop);
 
 void samplerTask(void *pvParameters);
 void samplerFunction(void *pvParameters);
-void metronomeTask(void *pvParameters);
 void metronomeFunction(void *pvParameters);
 
 #endif
@@ -0,0 +1,109 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+// Loop playback clocked by the renderer's sample counter. The audio path
+// calls sequencer_render in place of synth_renderBlock; it splits the block
+// at every event and beat so each starts on its exact sample, so playback
+// and the metronome never drift against each other or the audio clock.
+//
+// Portable, like synth.h. The sampler hands over a new bank of tracks at any
+// time with sequencer_publish; the audio path only switches to it as the
+// loop wraps, and bumps loops once it has. The sampler must not reuse the
+// previous bank until loops has moved on since publishing. Muting and
+// soloing take effect at once: a track that is not heard skips its presses
+// but still plays its releases, so nothing is left hanging. Playback only
+// releases voices it started at VOICE_PRIORITY_PLAYBACK, on a release or on
+// stopping, so a note a player holds sounds on.
+
+#include <stdint.h>
+#include <stddef.h>
+#include "synth.h"
+#include "noteevent.h"
+#include "looper.h"
+#include "eventring.h"
+#include "triplebuffer.h"
+
+// Events played, for the display to mirror without waking per event
+#define SEQUENCER_PLAYED_RING_SIZE 32
+
+// Loop positions are stored in ticks, the resolution key events are timed
+// to, and rescaled to samples as they fall due
+#define SEQUENCER_TICK_HZ 1000
+
+struct SequencerPattern
+{
+    const LoopBank *bank; // nullptr for an empty loop
+    bool running;
+};
+
+struct Sequencer
+{
+    TripleBuffer<SequencerPattern> pattern; // From the sampler
+    uint32_t loopTicks;
+    uint32_t loopSamples;
+    uint32_t tickSamples; // Samples a tick, Q16
+    uint32_t beatSamples;
+    uint32_t clickSamples; // Length of the metronome click
+
+    // Track masks, set by the player
+    volatile uint8_t muted;
+    volatile uint8_t soloed; // When any are, only these are heard
+
+    // Audio path only, read elsewhere as plain words
+    const LoopBank *bank;
+    uint16_t cursor[LOOPER_TRACKS]; // Offset of the event after each due one
+    uint32_t tick[LOOPER_TRACKS];   // Position of its next event in ticks
+    uint32_t due[LOOPER_TRACKS];    // And in samples, UINT32_MAX past the last
+    uint8_t event[LOOPER_TRACKS];   // And its event byte
+    bool running;
+    uint32_t nextBeat;       // Position of the next click
+    volatile uint32_t loopStart; // Sample the current pass began on
+    volatile uint32_t loops;     // Passes finished, and patterns taken up
+    volatile uint32_t lastBeat;  // Sample the last click began on
+
+    // Each event played, with its timestamp set to the sample it started on
+    EventRing<NoteEvent, SEQUENCER_PLAYED_RING_SIZE, 1> played;
+};
+
+// Loop length in ticks, beat length in samples; stopped with an empty loop
+void sequencer_init(Sequencer &seq, uint32_t sampleRate, uint32_t loopTicks, uint32_t beatSamples,
+                    uint32_t clickSamples);
+
+// Hand over a bank, kept unchanged until loops moves on. Going from stopped
+// to running starts the loop on the next sample rendered.
+void sequencer_publish(Sequencer &seq, const LoopBank *bank, bool running);
+
+// Sample a loop position in ticks falls on, and the tick a sample falls in.
+// A sample never comes before the start of its tick.
+static inline uint32_t sequencer_tickSample(const Sequencer &seq, uint32_t tick)
+{
+    return (uint32_t)((uint64_t)tick * seq.tickSamples >> 16);
+}
+
+static inline uint32_t sequencer_sampleTick(const Sequencer &seq, uint32_t sample)
+{
+    return (uint32_t)(((uint64_t)sample << 16) / seq.tickSamples);
+}
+
+// Position in the loop of the sample age samples before the next one to be
+// rendered, for callers outside the audio path. The clock and the start of
+// the pass are read as a pair the audio path did not move in between, as it
+// always advances samples; a sample before the pass began, such as a key
+// pressed just ahead of the wrap, lands at the end of the loop.
+static inline uint32_t sequencer_positionAgo(const Sequencer &seq, const SynthState &state, uint32_t age)
+{
+    uint32_t sample, loopStart;
+    do
+    {
+        sample = state.samples;
+        loopStart = seq.loopStart;
+    } while (sample != state.samples);
+    int32_t offset = (int32_t)(sample - age - loopStart) % (int32_t)seq.loopSamples;
+    return offset < 0 ? (uint32_t)(offset + (int32_t)seq.loopSamples) : (uint32_t)offset;
+}
+
+// Render n samples as synth_renderBlock, playing every event and beat due
+// within them on its own sample
+void sequencer_render(Sequencer &seq, SynthState &state, uint8_t *out, size_t n);
+
+#endif
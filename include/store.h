@@ -0,0 +1,52 @@
+#ifndef STORE_H
+#define STORE_H
+
+// Settings and the sampler's loop, kept across resets as records in a
+// FlashLog (flashlog.h) over the top pages of internal flash. store_load
+// applies what was saved at boot; storeTask saves changes once they have
+// settled, at the lowest priority.
+//
+// The record layouts are portable, so host tools can read and write them.
+
+#include <stdint.h>
+#include <stddef.h>
+#include "looper.h"
+
+#define STORE_PAGES 8        // 16 KB at the top of flash
+#define STORE_PAGE_SIZE 2048 // The L432's erase page
+
+enum StoreRecord : uint8_t
+{
+    STORE_SETTINGS,
+    STORE_LOOP
+};
+
+struct StoredSettings
+{
+    uint8_t volume;
+    uint8_t waveform;
+    uint8_t envelope[4];
+    uint8_t envelopePage;
+    uint8_t samplerEnabled;
+    uint8_t loopTrack;
+    uint8_t muted;
+    uint8_t soloed;
+};
+
+struct StoredLoop
+{
+    uint32_t loopTicks; // A loop saved at another length is not restored
+    LoopBank bank;        // Stored up to the end of its last track
+};
+
+static inline uint16_t store_loopLength(const StoredLoop &loop)
+{
+    return (uint16_t)(offsetof(StoredLoop, bank.data) + looper_used(loop.bank));
+}
+
+// Read the store and apply it; call once before the tasks start
+void store_load();
+
+void storeTask(void *pvParameters);
+
+#endif
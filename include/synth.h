@@ -0,0 +1,202 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+// Portable synthesis core: no Arduino, HAL or FreeRTOS dependencies so the
+// same code can be rendered on a Linux host and compared with the firmware.
+
+#include <stdint.h>
+#include <stddef.h>
+#include "wavetable.h"
+#include "triplebuffer.h"
+#include "tuning.h"
+
+// Samples rendered per DMA half-transfer
+#define AUDIO_BLOCK_SIZE 64
+
+// Voice pool capacity, one bit per voice in VoicePool::activeMask
+#ifndef SYNTH_MAX_VOICES
+#define SYNTH_MAX_VOICES 16
+#endif
+static_assert(SYNTH_MAX_VOICES == 8 || SYNTH_MAX_VOICES == 16 || SYNTH_MAX_VOICES == 32,
+              "SYNTH_MAX_VOICES must be 8, 16 or 32");
+
+// Note numbers tracked by the note-to-voice map
+#define SYNTH_NOTES TUNING_NOTES
+#define SYNTH_GATE_WORDS (SYNTH_NOTES / 32)
+
+#define TICK_AMPLITUDE 50 // Adjust amplitude of the click
+
+// Voice levels are Q15 gains applied to the int16 wavetable output. The
+// envelope runs in Q30 and the mixer takes its top 15 bits.
+#define VOICE_LEVEL_MAX 32767
+#define ENV_LEVEL_MAX (1L << 30)
+
+// Positions of each envelope knob, and where they start
+#define ENV_KNOB_STEPS 16
+#define ENV_DEFAULT_ATTACK 0   // 1 ms
+#define ENV_DEFAULT_DECAY 8    // 100 ms
+#define ENV_DEFAULT_SUSTAIN 12 // 80 %
+#define ENV_DEFAULT_RELEASE 6  // 50 ms
+
+// Pitch bend at full deflection, and vibrato depth and rate at full
+// modulation
+#define SYNTH_BEND_SEMITONES 2
+#define SYNTH_VIBRATO_CENTS 50
+#define SYNTH_VIBRATO_HZ 6
+
+// Voices with a lower priority are stolen first by STEAL_LOWEST_PRIORITY
+#define VOICE_PRIORITY_PLAYBACK 0
+#define VOICE_PRIORITY_LIVE 1
+
+enum StealPolicy
+{
+    STEAL_OLDEST,
+    STEAL_QUIETEST,
+    STEAL_LOWEST_PRIORITY
+};
+
+enum EnvelopeStage
+{
+    ENV_IDLE,
+    ENV_ATTACK,
+    ENV_DECAY,
+    ENV_SUSTAIN,
+    ENV_RELEASE
+};
+
+// Linear ADSR segments, as Q30 level change per sample
+struct EnvelopeParams
+{
+    int32_t attackRate;
+    int32_t decayRate;
+    int32_t sustainLevel; // Q30
+    int32_t releaseRate;
+};
+
+// Structure-of-arrays voice pool, owned by the renderer. Only voices with
+// their bit set in activeMask are rendered. Note-off only moves a voice to
+// ENV_RELEASE; the voice is freed once the release tail has decayed.
+// noteVoice maps each note to its voice so note-on and note-off never scan
+// the pool.
+struct VoicePool
+{
+    uint32_t phaseAcc[SYNTH_MAX_VOICES];
+    uint32_t stepSize[SYNTH_MAX_VOICES];
+    int16_t level[SYNTH_MAX_VOICES]; // Q15 gain at the start of the next block
+    int32_t envLevel[SYNTH_MAX_VOICES];
+    uint8_t envStage[SYNTH_MAX_VOICES];
+    uint8_t note[SYNTH_MAX_VOICES];
+    uint8_t priority[SYNTH_MAX_VOICES];
+    uint8_t wave[SYNTH_MAX_VOICES]; // Waveform, latched at note-on
+    uint32_t age[SYNTH_MAX_VOICES]; // Allocation sequence number
+    uint8_t noteVoice[SYNTH_NOTES]; // Voice index + 1, 0 when never assigned
+    uint32_t sequence;
+    StealPolicy policy;
+    uint8_t waveform; // Waveform given to new notes
+    uint32_t activeMask;
+};
+
+// Everything the control tasks tell the renderer, published as one snapshot
+// so a chord, or an envelope change, is never seen half-written. gate holds
+// one bit per note that should be sounding; the renderer starts and releases
+// voices from the difference with the gates it last applied.
+struct SynthControl
+{
+    uint32_t version; // Bumped on every change so an unchanged snapshot is skipped
+    uint32_t gate[SYNTH_GATE_WORDS];
+    EnvelopeParams envelope;
+    uint8_t volume; // 0..8, as set by knob3
+    uint8_t waveform;
+};
+
+struct SynthState
+{
+    VoicePool voices;
+    TripleBuffer<SynthControl> control;
+    uint32_t appliedVersion;
+    uint32_t appliedGate[SYNTH_GATE_WORDS];
+    const TuningTable *tuning; // Phase increment of every note
+
+    // Metronome click, same semantics as metronomeActive/metronomeCounter
+    bool clickActive;
+    uint32_t clickCounter;
+
+    // Performance controls, set before each synth_renderBlock like the click.
+    // They retune every sounding voice once per block.
+    int16_t pitchBend;  // Q15, -1..1 of SYNTH_BEND_SEMITONES
+    int16_t modulation; // Q15, 0..1 of SYNTH_VIBRATO_CENTS
+    uint32_t lfoPhase;
+    uint32_t lfoStep; // Vibrato phase increment per sample
+
+    volatile uint32_t samples; // Rendered since start-up, the sequencer's clock
+};
+
+// Note number of key noteIndex (0..11) in an octave, C4 = 60 as in MIDI
+static inline uint8_t noteNumber(uint8_t octave, uint8_t noteIndex)
+{
+    return (uint8_t)((octave + 1) * 12 + noteIndex);
+}
+
+// Select the tuning, give control the default envelope and publish it; call
+// before rendering. tuning must outlive state.
+void synth_init(SynthState &state, SynthControl &control, uint32_t sampleRate,
+                const TuningTable &tuning);
+
+// Set the envelope from knob positions 0..ENV_KNOB_STEPS-1. Attack, decay and
+// release pick a time from 1 ms to 2 s; sustain is a fraction of full level.
+void synth_setEnvelope(SynthControl &control, uint32_t sampleRate,
+                       uint8_t attack, uint8_t decay, uint8_t sustain, uint8_t release);
+
+// Gate edits on a control copy; publish with synth_publish once the whole
+// change, e.g. every note of a chord, is made
+static inline void synth_setGate(SynthControl &control, uint8_t note, bool on)
+{
+    if (note >= SYNTH_NOTES)
+        return;
+    uint32_t bit = 1UL << (note & 31);
+    if (on)
+        control.gate[note >> 5] |= bit;
+    else
+        control.gate[note >> 5] &= ~bit;
+}
+
+// Hand a control snapshot to the renderer. Not reentrant: writers must
+// serialise among themselves. Never blocks the renderer.
+void synth_publish(SynthState &state, SynthControl &control);
+
+// Voice pool primitives, called by the renderer as it applies gate changes
+// Start a note on a free voice, stealing one if none is free. Voices already
+// in their release tail are stolen first, quietest first; otherwise the
+// victim is chosen by pool.policy. A note that is still sounding, including
+// in its release, is retriggered on its own voice from its current level,
+// keeping the higher priority if it is still held.
+// Returns the voice index, or -1 if note is out of range.
+int voice_noteOn(VoicePool &pool, uint8_t note, uint32_t stepSize, uint8_t priority);
+
+// Move the voice playing note into its release tail
+void voice_noteOff(VoicePool &pool, uint8_t note);
+
+// Release every sounding voice
+void voice_allNotesOff(VoicePool &pool);
+
+// As voice_noteOff and voice_allNotesOff, but only for voices started at
+// VOICE_PRIORITY_PLAYBACK, so loop playback never cuts a note a player holds
+void voice_playbackOff(VoicePool &pool, uint8_t note);
+void voice_allPlaybackOff(VoicePool &pool);
+
+// Voice currently sounding note, or -1
+static inline int voice_find(const VoicePool &pool, uint8_t note)
+{
+    if (note >= SYNTH_NOTES)
+        return -1;
+    int voice = (int)pool.noteVoice[note] - 1;
+    if (voice < 0 || !(pool.activeMask & (1UL << voice)) || pool.note[voice] != note)
+        return -1;
+    return voice;
+}
+
+// Render n unsigned 8-bit DAC samples. The latest control snapshot is read
+// once per call, and the envelope is advanced once per AUDIO_BLOCK_SIZE.
+void synth_renderBlock(SynthState &state, uint8_t *out, size_t n);
+
+#endif
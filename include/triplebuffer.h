@@ -0,0 +1,53 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+// Single-writer, single-reader triple buffer. The writer fills its private
+// slot and swaps it with the shared middle slot; the reader swaps its slot
+// with the middle one only when a newer value is there. Both sides take one
+// atomic exchange and never wait, so the reader can be an interrupt that
+// preempts the writer part-way through a publish. A seqlock would make the
+// reader retry, which an ISR cannot do against a task it has preempted.
+
+#include <stdint.h>
+
+template <typename T>
+class TripleBuffer
+{
+private:
+    // Bits 0-1 hold the middle slot index, bit 2 is set when it is newer than
+    // the reader's slot
+    static const uint8_t FRESH = 4;
+
+    T slots[3];
+    volatile uint8_t middle = 1;
+    uint8_t writeSlot = 0;
+    uint8_t readSlot = 2;
+
+public:
+    // Writer only; callers with more than one writer task must serialise
+    void publish(const T &value)
+    {
+        slots[writeSlot] = value;
+        uint8_t previous = __atomic_exchange_n(&middle, (uint8_t)(writeSlot | FRESH), __ATOMIC_ACQ_REL);
+        writeSlot = previous & 3;
+    }
+
+    // Writer only; whether the reader has taken up the last value published
+    bool taken() const
+    {
+        return !(__atomic_load_n(&middle, __ATOMIC_ACQUIRE) & FRESH);
+    }
+
+    // Reader only; returns the most recently published value
+    const T &read()
+    {
+        if (__atomic_load_n(&middle, __ATOMIC_RELAXED) & FRESH)
+        {
+            uint8_t previous = __atomic_exchange_n(&middle, readSlot, __ATOMIC_ACQ_REL);
+            readSlot = previous & 3;
+        }
+        return slots[readSlot];
+    }
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+// Phase increments for every MIDI note, generated at compile time from one
+// octave template for any sample rate and reference pitch. Override the
+// defaults with build flags, e.g. -D SYNTH_SAMPLE_RATE=44100.
+
+#include <stdint.h>
+
+#ifndef SYNTH_SAMPLE_RATE
+#define SYNTH_SAMPLE_RATE 22000
+#endif
+
+#ifndef TUNING_A4_HZ
+#define TUNING_A4_HZ 440.0
+#endif
+
+#define TUNING_NOTES 128
+#define TUNING_A4_NOTE 69
+
+// Per-note-name offset from equal temperament, C first
+struct TuningOffsets
+{
+    int16_t cents[12];
+};
+
+struct TuningTable
+{
+    uint32_t step[TUNING_NOTES];
+};
+
+namespace tuning_detail
+{
+    constexpr double LN2 = 0.69314718055994530942;
+
+    // 2^x for |x| <= 1 by Taylor series of e^(x ln 2), far below 1 LSB of
+    // a 32-bit step
+    constexpr double exp2Fraction(double x)
+    {
+        double term = 1.0;
+        double sum = 1.0;
+        for (int n = 1; n < 24; n++)
+        {
+            term *= x * LN2 / n;
+            sum += term;
+        }
+        return sum;
+    }
+
+    constexpr double exp2Int(int k)
+    {
+        double result = 1.0;
+        for (; k > 0; k--)
+            result *= 2.0;
+        for (; k < 0; k++)
+            result *= 0.5;
+        return result;
+    }
+}
+
+// Equal temperament from reference pitch a4Hz, with optional cent offsets.
+// The octave containing A4 is computed once; every other octave is the same
+// frequencies scaled by a power of two. Notes at or above the sample rate
+// saturate rather than wrap.
+constexpr TuningTable makeTuningTable(double sampleRate, double a4Hz = TUNING_A4_HZ,
+                                      TuningOffsets offsets = TuningOffsets{})
+{
+    double octave4[12] = {};
+    for (int i = 0; i < 12; i++)
+    {
+        int semitonesFromA4 = i + 60 - TUNING_A4_NOTE;
+        octave4[i] = a4Hz * tuning_detail::exp2Fraction(semitonesFromA4 / 12.0 + offsets.cents[i] / 1200.0);
+    }
+
+    TuningTable table = {};
+    for (int note = 0; note < TUNING_NOTES; note++)
+    {
+        double freq = octave4[note % 12] * tuning_detail::exp2Int(note / 12 - 5);
+        double step = freq * 4294967296.0 / sampleRate + 0.5;
+        table.step[note] = step >= 4294967295.0 ? 0xffffffffu : (uint32_t)step;
+    }
+    return table;
+}
+
+// Built for SYNTH_SAMPLE_RATE and TUNING_A4_HZ, in flash
+extern const TuningTable tuningTable;
+
+#endif
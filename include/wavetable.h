@@ -0,0 +1,60 @@
+#ifndef WAVETABLE_H
+#define WAVETABLE_H
+
+// Band-limited single-cycle wavetables, generated at compile time and kept in
+// flash. Each waveform has one table per octave band; a band only contains
+// the harmonics that stay below Nyquist for every step size that selects it.
+
+#include <stdint.h>
+
+#define WAVETABLE_BITS 8
+#define WAVETABLE_SIZE (1 << WAVETABLE_BITS)
+#define WAVETABLE_BANDS 8
+
+enum Waveform
+{
+    WAVE_SAW,
+    WAVE_SQUARE,
+    WAVE_TRIANGLE,
+    WAVE_SINE,
+    WAVE_COUNT
+};
+
+struct WaveTables
+{
+    // One guard sample past the end so interpolation never wraps the index
+    int16_t table[WAVE_COUNT][WAVETABLE_BANDS][WAVETABLE_SIZE + 1];
+};
+
+extern const WaveTables waveTables;
+extern const char *const waveformNames[WAVE_COUNT];
+
+// Band 0 holds 127 harmonics and each band above it half as many. A step size
+// in [2^(23+b), 2^(24+b)) has its 2^(7-b)th harmonic below fs/2.
+static inline int wavetable_band(uint32_t stepSize)
+{
+    int band = 8 - __builtin_clz(stepSize | 1);
+    if (band < 0)
+        return 0;
+    if (band >= WAVETABLE_BANDS)
+        return WAVETABLE_BANDS - 1;
+    return band;
+}
+
+static inline const int16_t *wavetable_select(uint8_t waveform, uint32_t stepSize)
+{
+    return waveTables.table[waveform][wavetable_band(stepSize)];
+}
+
+// Linearly interpolated lookup: top 8 phase bits index the table, the next
+// 15 bits interpolate towards the following sample
+static inline int32_t wavetable_lookup(const int16_t *table, uint32_t phaseAcc)
+{
+    uint32_t index = phaseAcc >> (32 - WAVETABLE_BITS);
+    int32_t frac = (phaseAcc >> (17 - WAVETABLE_BITS)) & 0x7fff;
+    int32_t a = table[index];
+    int32_t b = table[index + 1];
+    return a + (((b - a) * frac) >> 15);
+}
+
+#endif
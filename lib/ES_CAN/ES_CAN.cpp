@@ -27,7 +27,7 @@ CAN_HandleTypeDef CAN_Handle = {
         ENABLE,          // AutoWakeUp
         ENABLE,          // AutoRetransmission
         DISABLE,         // ReceiveFifoLocked
-        ENABLE           // TransmitFifoPriority
+        DISABLE          // TransmitFifoPriority: pending mailboxes go out lowest ID first
     },
     HAL_CAN_STATE_RESET, // State
     HAL_CAN_ERROR_NONE   // Error Code
@@ -116,6 +116,31 @@ uint32_t CAN_TX(uint32_t ID, uint8_t data[8])
   return (uint32_t)HAL_CAN_AddTxMessage(&CAN_Handle, &txHeader, data, NULL);
 }
 
+uint32_t CAN_TryTX(uint32_t ID, uint8_t data[8], uint32_t &mailbox)
+{
+
+  // Set up the message header
+  CAN_TxHeaderTypeDef txHeader = {
+      ID & 0x7ff,   // Standard ID
+      0,            // Ext ID = 0
+      CAN_ID_STD,   // Use Standard ID
+      CAN_RTR_DATA, // Data Frame
+      8,            // Send 8 bytes
+      DISABLE       // No time triggered mode
+  };
+
+  // Give up rather than wait if every mailbox is busy
+  if (!HAL_CAN_GetTxMailboxesFreeLevel(&CAN_Handle))
+    return (uint32_t)HAL_BUSY;
+
+  return (uint32_t)HAL_CAN_AddTxMessage(&CAN_Handle, &txHeader, data, &mailbox);
+}
+
+uint32_t CAN_TXPending(uint32_t mailbox)
+{
+  return HAL_CAN_IsTxMessagePending(&CAN_Handle, mailbox);
+}
+
 uint32_t CAN_CheckRXLevel()
 {
   return HAL_CAN_GetRxFifoFillLevel(&CAN_Handle, 0);
@@ -138,6 +163,14 @@ uint32_t CAN_RX(uint32_t &ID, uint8_t data[8])
   return result;
 }
 
+uint32_t CAN_RXOverrun()
+{
+  if (!__HAL_CAN_GET_FLAG(&CAN_Handle, CAN_FLAG_FOV0))
+    return 0;
+  __HAL_CAN_CLEAR_FLAG(&CAN_Handle, CAN_FLAG_FOV0);
+  return 1;
+}
+
 uint32_t CAN_RegisterRX_ISR(void (&callback)())
 {
   // Store pointer to user ISR
@@ -13,12 +13,22 @@ uint32_t setCANFilter(uint32_t filterID = 0, uint32_t maskID = 0, uint32_t filte
 // Send a message
 uint32_t CAN_TX(uint32_t ID, uint8_t data[8]);
 
+// Send a message if a mailbox is free, without waiting
+// Returns HAL_BUSY if not; otherwise mailbox is set to the one used
+uint32_t CAN_TryTX(uint32_t ID, uint8_t data[8], uint32_t &mailbox);
+
+// Check whether a message is still waiting in a mailbox
+uint32_t CAN_TXPending(uint32_t mailbox);
+
 // Get the number of received messages
 uint32_t CAN_CheckRXLevel();
 
 // Get a received message from the FIFO
 uint32_t CAN_RX(uint32_t &ID, uint8_t data[8]);
 
+// Check whether a message was lost to a full FIFO since the last call
+uint32_t CAN_RXOverrun();
+
 // Set up an interrupt on received messages
 uint32_t CAN_RegisterRX_ISR(void (&callback)());
 
@@ -0,0 +1,101 @@
+#include "audio.h"
+#include "globals.h"
+#include "isr.h"
+
+// Ping-pong buffer: the DMA streams one half to the DAC while the other half
+// is rendered. The half-transfer interrupt fires when the DMA moves into the
+// second half, so the first half is free to refill, and vice versa.
+static uint8_t sampleBuffer[2 * AUDIO_BLOCK_SIZE];
+
+static DAC_HandleTypeDef DAC_Handle;
+static DMA_HandleTypeDef DMA_DAC_Handle;
+static TIM_HandleTypeDef TIM6_Handle;
+
+volatile uint32_t audioBlockCount = 0;
+
+extern "C" void DMA1_Channel3_IRQHandler(void);
+
+void audio_init()
+{
+    // Prime both halves so the first transfer plays real samples
+    renderAudioBlock(sampleBuffer, 2 * AUDIO_BLOCK_SIZE);
+
+    __HAL_RCC_DAC1_CLK_ENABLE();
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    __HAL_RCC_TIM6_CLK_ENABLE();
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+
+    // OUTR_PIN (A3) is PA4, DAC1 channel 1
+    GPIO_InitTypeDef GPIO_InitDAC = {
+        GPIO_PIN_4,         // PA4 is DAC1_OUT1
+        GPIO_MODE_ANALOG,   // Analog mode
+        GPIO_NOPULL,        // No pull-up
+        GPIO_SPEED_FREQ_LOW // Unused in analog mode
+    };
+    HAL_GPIO_Init(GPIOA, &GPIO_InitDAC);
+
+    // TIM6 update event paces the DAC at fs
+    TIM6_Handle.Instance = TIM6;
+    TIM6_Handle.Init.Prescaler = 0;
+    TIM6_Handle.Init.CounterMode = TIM_COUNTERMODE_UP;
+    TIM6_Handle.Init.Period = SystemCoreClock / fs - 1;
+    TIM6_Handle.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+    HAL_TIM_Base_Init(&TIM6_Handle);
+
+    TIM_MasterConfigTypeDef masterConfig = {};
+    masterConfig.MasterOutputTrigger = TIM_TRGO_UPDATE;
+    masterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
+    HAL_TIMEx_MasterConfigSynchronization(&TIM6_Handle, &masterConfig);
+
+    // DMA1 channel 3, request 6 is DAC1 channel 1
+    DMA_DAC_Handle.Instance = DMA1_Channel3;
+    DMA_DAC_Handle.Init.Request = DMA_REQUEST_6;
+    DMA_DAC_Handle.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    DMA_DAC_Handle.Init.PeriphInc = DMA_PINC_DISABLE;
+    DMA_DAC_Handle.Init.MemInc = DMA_MINC_ENABLE;
+    DMA_DAC_Handle.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    DMA_DAC_Handle.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    DMA_DAC_Handle.Init.Mode = DMA_CIRCULAR;
+    DMA_DAC_Handle.Init.Priority = DMA_PRIORITY_HIGH;
+    HAL_DMA_Init(&DMA_DAC_Handle);
+
+    DAC_Handle.Instance = DAC1;
+    HAL_DAC_Init(&DAC_Handle);
+    __HAL_LINKDMA(&DAC_Handle, DMA_Handle1, DMA_DAC_Handle);
+
+    DAC_ChannelConfTypeDef dacConfig = {};
+    dacConfig.DAC_SampleAndHold = DAC_SAMPLEANDHOLD_DISABLE;
+    dacConfig.DAC_Trigger = DAC_TRIGGER_T6_TRGO;
+    dacConfig.DAC_OutputBuffer = DAC_OUTPUTBUFFER_ENABLE;
+    dacConfig.DAC_ConnectOnChipPeripheral = DAC_CHIPCONNECT_DISABLE;
+    dacConfig.DAC_UserTrimming = DAC_TRIMMING_FACTORY;
+    HAL_DAC_ConfigChannel(&DAC_Handle, &dacConfig, DAC_CHANNEL_1);
+
+    // Above the CAN interrupts (6) so bus traffic never delays a refill
+    HAL_NVIC_SetPriority(DMA1_Channel3_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel3_IRQn);
+
+    HAL_DAC_Start_DMA(&DAC_Handle, DAC_CHANNEL_1, (uint32_t *)sampleBuffer, 2 * AUDIO_BLOCK_SIZE, DAC_ALIGN_8B_R);
+    HAL_TIM_Base_Start(&TIM6_Handle);
+}
+
+// DMA has moved on to the second half: refill the first
+void HAL_DAC_ConvHalfCpltCallbackCh1(DAC_HandleTypeDef *hdac)
+{
+    renderAudioBlock(sampleBuffer, AUDIO_BLOCK_SIZE);
+    audioBlockCount++;
+}
+
+// DMA has wrapped back to the first half: refill the second
+void HAL_DAC_ConvCpltCallbackCh1(DAC_HandleTypeDef *hdac)
+{
+    renderAudioBlock(sampleBuffer + AUDIO_BLOCK_SIZE, AUDIO_BLOCK_SIZE);
+    audioBlockCount++;
+}
+
+// This is the base ISR at the interrupt vector
+void DMA1_Channel3_IRQHandler(void)
+{
+    // Use the HAL interrupt handler
+    HAL_DMA_IRQHandler(&DMA_DAC_Handle);
+}
@@ -1,48 +1,101 @@
 #include "autodetection.h"
 #include "globals.h"
 #include "pins.h"
-void autoDetectHandshake()
+#include "matrix.h"
+#include "can.h"
+#include "eventring.h"
+
+struct ChainMessage
+{
+    uint8_t data[8];
+};
+
+static ChainDetector detector;
+
+// Control frames from decodeTask, taken by chain_update
+static EventRing<ChainMessage, 8, 1> chainMessages;
+
+// The 96-bit device ID folded into 32 bits (FNV-1a)
+static uint32_t moduleId()
+{
+    uint32_t words[3] = {HAL_GetUIDw0(), HAL_GetUIDw1(), HAL_GetUIDw2()};
+    uint32_t hash = 2166136261u;
+    for (int w = 0; w < 3; w++)
+    {
+        for (int b = 0; b < 4; b++)
+        {
+            hash ^= (words[w] >> (8 * b)) & 0xff;
+            hash *= 16777619u;
+        }
+    }
+    return hash;
+}
+
+int chain_positionOf(uint8_t octave)
+{
+    int position = octave - chain_firstOctave(moduleCount);
+    return position >= 0 && position < moduleCount ? position : -1;
+}
+
+uint32_t chain_moduleId(int position)
+{
+    return detector.moduleId(position);
+}
+
+void chain_receive(const uint8_t msg[8])
 {
-    digitalWrite(OUT_PIN, HIGH);
-    delay(50);
+    ChainMessage message;
+    memcpy(message.data, msg, 8);
+    chainMessages.push(message);
+}
 
-    bool west, east;
+static void setOutputs()
+{
+    matrix_setOutput(HKOW_BIT, detector.westOutput() ? HIGH : LOW);
+    matrix_setOutput(HKOE_BIT, detector.eastOutput() ? HIGH : LOW);
+}
+
+void chain_begin(uint32_t now)
+{
+    uint32_t id = moduleId();
+    can_setModuleId(id);
+    detector.begin(id, now);
+    setOutputs();
+}
 
-    readHandshake(west, east);
+bool chain_update(uint32_t inputs, uint32_t now)
+{
+    ChainMessage message;
+    while (chainMessages.pop(0, message))
+    {
+        detector.receive(message.data, now);
+    }
 
-    if (west == HIGH && east == LOW)
+    bool west = inputs >> HANDSHAKE_WEST_BIT & 1;
+    bool east = inputs >> HANDSHAKE_EAST_BIT & 1;
+    bool eastWas = detector.eastOutput();
+    bool settled = detector.update(west, east, !can_busy(CAN_TX_CONTROL), now);
+    if (detector.eastOutput() != eastWas)
     {
-        moduleOctave = 4;
+        setOutputs();
     }
-    else if (east == HIGH && west == LOW)
+    uint8_t msg[8];
+    if (detector.takeMessage(msg))
     {
-        moduleOctave = 6;
+        can_send(CAN_TX_CONTROL, msg);
     }
-    else
+
+    if (settled)
     {
-        moduleOctave = 5;
+        modulePosition = detector.modulePosition();
+        moduleCount = detector.moduleCount();
+        moduleOctave = chain_firstOctave(moduleCount) + modulePosition;
+        can_setPositioned();
     }
+    return settled;
 }
 
-void readHandshake(bool &west, bool &east)
-{
-    digitalWrite(REN_PIN, LOW);
-    digitalWrite(RA0_PIN, 5 & 0x01);
-    digitalWrite(RA1_PIN, 5 & 0x02);
-    digitalWrite(RA2_PIN, 5 & 0x04);
-    digitalWrite(OUT_PIN, HIGH);
-    digitalWrite(REN_PIN, HIGH);
-    delayMicroseconds(3);
-    west = digitalRead(C3_PIN);
-    digitalWrite(REN_PIN, LOW);
-
-    digitalWrite(REN_PIN, LOW);
-    digitalWrite(RA0_PIN, 6 & 0x01);
-    digitalWrite(RA1_PIN, 6 & 0x02);
-    digitalWrite(RA2_PIN, 6 & 0x04);
-    digitalWrite(OUT_PIN, HIGH);
-    digitalWrite(REN_PIN, HIGH);
-    delayMicroseconds(3);
-    east = digitalRead(C3_PIN);
-    digitalWrite(REN_PIN, LOW);
-}
\ No newline at end of file
+bool chain_pending()
+{
+    return detector.pending();
+}
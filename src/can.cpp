@@ -1,36 +1,126 @@
 #include "globals.h"
 #include "can.h"
 #include "sampler.h"
+#include "key.h"
+#include "canframe.h"
+#include "cantx.h"
+#include "canlink.h"
 #include "autodetection.h"
 
 uint32_t decodeIterations = 0;
 TickType_t decodeStartTime = 0;
 
 uint32_t CAN_TX_Iterations = 0;
-TickType_t CAN_TX_StartTime = 0;
+uint32_t CAN_TX_Micros = 0;
 
+// The controller's mailboxes behind the class queues in cantx.h
+struct HalMailboxes
+{
+    bool tryTx(uint32_t id, const uint8_t data[8], uint32_t &mailbox)
+    {
+        return CAN_TryTX(id, (uint8_t *)data, mailbox) == HAL_OK;
+    }
+
+    bool pending(uint32_t mailbox)
+    {
+        return CAN_TXPending(mailbox);
+    }
+};
+
+static CanTxScheduler<HalMailboxes> txScheduler;
+
+// The receive FIFO, for canlink_drain
+struct HalRxFifo
+{
+    bool level()
+    {
+        return CAN_CheckRXLevel();
+    }
+
+    void rx(uint32_t &id, uint8_t data[8])
+    {
+        CAN_RX(id, data);
+    }
+};
+
+// Received frames, written in place by the RX interrupt and read by
+// decodeTask alone
+static EventRing<CanFrame, CAN_RX_RING_SIZE, 1> rxFrames;
+static volatile uint32_t rxFifoOverruns = 0;
+
+bool can_send(CanTxClass txClass, const uint8_t data[8])
+{
+    taskENTER_CRITICAL();
+    bool queued = txScheduler.send(txClass, data, modulePosition);
+    taskEXIT_CRITICAL();
+    return queued;
+}
+
+uint32_t can_dropped(CanTxClass txClass)
+{
+    return txScheduler.dropped(txClass);
+}
+
+uint8_t can_highWater(CanTxClass txClass)
+{
+    return txScheduler.highWater(txClass);
+}
+
+bool can_busy(CanTxClass txClass)
+{
+    taskENTER_CRITICAL();
+    bool busy = txScheduler.busy(txClass);
+    taskEXIT_CRITICAL();
+    return busy;
+}
+
+void can_setModuleId(uint32_t moduleId)
+{
+    taskENTER_CRITICAL();
+    txScheduler.setControlTag(can_controlTag(moduleId));
+    taskEXIT_CRITICAL();
+}
+
+void can_setPositioned()
+{
+    taskENTER_CRITICAL();
+    txScheduler.setPositioned();
+    taskEXIT_CRITICAL();
+}
+
+// Masked while can_send holds the critical section
 void CAN_TX_ISR(void)
 {
-    // Give semaphore from ISR
-    xSemaphoreGiveFromISR(CAN_TX_Semaphore, NULL);
+    txScheduler.refill(modulePosition);
+}
+
+uint32_t can_rxOverruns()
+{
+    return rxFifoOverruns + rxFrames.overflows(0);
 }
 
 void CAN_RX_ISR(void)
 {
-    uint8_t RX_Message_ISR[8];
-    uint32_t ID = 0x123;
-    CAN_RX(ID, RX_Message_ISR);
-    xQueueSendFromISR(msgInQ, RX_Message_ISR, NULL);
+    HalRxFifo fifo;
+    canlink_drain(fifo, rxFrames, xTaskGetTickCountFromISR());
+    if (CAN_RXOverrun())
+    {
+        rxFifoOverruns++;
+    }
+
+    BaseType_t woken = pdFALSE;
+    if (decodeHandle)
+    {
+        vTaskNotifyGiveFromISR(decodeHandle, &woken);
+    }
+    portYIELD_FROM_ISR(woken);
 }
 
 void CAN_RX_ISRTest(void)//WCET test function
 {
     uint32_t startTime = micros();
 
-    uint8_t RX_Message_ISR[8];
-    uint32_t ID = 0x123;
-    CAN_RX(ID, RX_Message_ISR);
-    xQueueSendFromISR(msgInQ, RX_Message_ISR, NULL);
+    CAN_RX_ISR();
 
     uint32_t endTime = micros();
     uint32_t isrDuration = endTime - startTime; 
@@ -50,88 +140,59 @@ void CAN_RX_ISRTest(void)//WCET test function
     Serial.println(" µs");
 }
 
-// The decodeTask receives messages from msgInQ
-void decodeTask(void *pvParameters)
+// Where decodeTask sends what it takes from the ring
+struct DecodeSink
 {
-    uint8_t local_RX_Message[8] = {0};
-    while (1)
+    void activity()
     {
-        xQueueReceive(msgInQ, local_RX_Message, portMAX_DELAY);
-
-        char msgType = local_RX_Message[0];   
-        uint8_t msgOct = local_RX_Message[1];
-        uint8_t noteIx = local_RX_Message[2];
+        lastActivityTick = xTaskGetTickCount();
+    }
 
-        static uint32_t localCurrentStepSize = 0;
-        bool sampler_enabled;
-        if (xSemaphoreTake(sysState.mutex, portMAX_DELAY) == pdTRUE)
+    void keyEvents(const NoteEvent *events, int count)
+    {
+        for (int i = 0; i < count; i++)
         {
-            sampler_enabled = sysState.knob2.getPress();
-            xSemaphoreGive(sysState.mutex);
+            remoteKeyEvents.push(events[i]);
         }
-        if (moduleOctave == 4)
-        {
-            if (msgType == 'P' && msgOct == 5)
-            {
-                localCurrentStepSize = stepSizes5[noteIx];
-                if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
-                {
-                    keys5.set(noteIx, true);
-                    xSemaphoreGive(externalKeyMutex);
-                }
-                if (sampler_enabled)
-                {
-                    sampler_recordEvent('P', 5, (uint8_t)noteIx);
-                }
-            }
-            else if (msgType == 'R' && msgOct == 5)
-            {
-                localCurrentStepSize = 0;
-                if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
-                {
-                    keys5.set(noteIx, false);
-                    xSemaphoreGive(externalKeyMutex);
-                }
-                if (sampler_enabled)
-                {
-                    sampler_recordEvent('R', 5, (uint8_t)noteIx);
-                }
-            }
+    }
 
-            if (msgType == 'P' && msgOct == 6)
-            {
-                localCurrentStepSize = stepSizes6[noteIx];
+    void control(const uint8_t msg[8])
+    {
+        chain_receive(msg);
+    }
 
-                if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
-                {
-                    keys6.set(noteIx, true);
-                    xSemaphoreGive(externalKeyMutex);
-                }
-                if (sampler_enabled)
-                {
-                    sampler_recordEvent('P', 6, (uint8_t)noteIx);
-                }
-            }
-            else if (msgType == 'R' && msgOct == 6)
-            {
-                localCurrentStepSize = 0;
-                if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
-                {
-                    keys6.set(noteIx, false);
-                    xSemaphoreGive(externalKeyMutex);
-                }
-                if (sampler_enabled)
-                {
-                    sampler_recordEvent('R', 6, (uint8_t)noteIx);
-                }
-            }
-        }
+    void wakeKeys()
+    {
+        xTaskNotifyGive(keyEventHandle);
+    }
+
+    // Enumeration advances in scanKeysTask
+    void wakeChain()
+    {
+        xTaskNotify(scanKeysHandle, 0, eNoAction);
+    }
+};
+
+// The decodeTask wakes once per RX interrupt, takes every frame waiting in
+// the ring, passes remote key edges on through remoteKeyEvents and chain
+// control messages to the enumeration
+void decodeTask(void *pvParameters)
+{
+    DecodeSink sink;
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        canlink_decode(rxFrames, modulePosition == 0, sink);
     }
 }
 
 void decodeFunction(void *pvParameters)//WCET test function
 {
-    uint8_t local_RX_Message[8] = {0};
+    // A four-note chord, the most events one frame can carry, queued as if
+    // received so the ring is timed as well
+    NoteEvent chord[CAN_FRAME_EVENTS] = {{0, 'P', 5, 0}, {0, 'P', 5, 4}, {0, 'P', 5, 7}, {0, 'P', 6, 0}};
+    CanFrame testFrame = {CAN_ID_NOTE + 5, {0}};
+    canframe_encode(chord, CAN_FRAME_EVENTS, testFrame.data);
 
     if (decodeIterations == 0)
     {
@@ -142,105 +203,52 @@ void decodeFunction(void *pvParameters)//WCET test function
     {
         decodeIterations++;
 
-        if (xQueueReceive(msgInQ, local_RX_Message, pdMS_TO_TICKS(10)) == pdTRUE)
+        testFrame.tick = xTaskGetTickCount();
+        rxFrames.push(testFrame);
+        CanFrame frame;
+        while (rxFrames.pop(0, frame))
         {
-            char msgType = local_RX_Message[0];   
-            uint8_t msgOct = local_RX_Message[1]; 
-            uint8_t noteIx = local_RX_Message[2];
-
-            static uint32_t localCurrentStepSize = 0;
-
-            if (msgType == 'P')
-            {
-                if (msgOct == 5)
-                {
-                    localCurrentStepSize = stepSizes5[noteIx];
-                    keys5.set(noteIx, true);
-                    if (samplerEnabled)
-                    {
-                        sampler_recordEvent('P', 5, noteIx);
-                    }
-                }
-                else if (msgOct == 6)
-                {
-                    localCurrentStepSize = stepSizes6[noteIx];
-                    keys6.set(noteIx, true);
-                    if (samplerEnabled)
-                    {
-                        sampler_recordEvent('P', 6, noteIx);
-                    }
-                }
-            }
-            else if (msgType == 'R') 
+            // Every consumer's work done inline, for a full frame of events
+            NoteEvent events[CAN_FRAME_EVENTS];
+            int count = canframe_decode(frame.data, frame.tick, events);
+            playKeyEvents(events, count);
+            for (int i = 0; i < count; i++)
             {
-                if (msgOct == 5)
+                remoteKeyEvents.push(events[i]);
+                showKeyEvent(events[i]);
+                if (samplerEnabled)
                 {
-                    localCurrentStepSize = 0;
-                    keys5.set(noteIx, false);
-                    if (samplerEnabled)
-                    {
-                        sampler_recordEvent('R', 5, noteIx);
-                    }
-                }
-                else if (msgOct == 6)
-                {
-                    localCurrentStepSize = 0;
-                    keys6.set(noteIx, false);
-                    if (samplerEnabled)
-                    {
-                        sampler_recordEvent('R', 6, noteIx);
-                    }
+                    sampler_recordEvent(events[i]);
                 }
             }
-
-            if (msgType == 'H')
-            {
-                autoDetectHandshake();
-            }
-        }
-        else
-        {
         }
 
-        vTaskDelay(pdMS_TO_TICKS(1)); 
+        vTaskDelay(pdMS_TO_TICKS(1));
     }
 }
 
-// The CAN TX task pulls messages from msgOutQ and sends them
-void CAN_TX_Task(void *pvParameters)
+// Bursts of can_send filling the telemetry queue from empty, so every call
+// queues a frame and runs a refill over all the classes. Only the calls are
+// timed, not the wait for the bus to drain the queue between bursts; with
+// nothing on the bus to acknowledge, the queue stays full and the bursts
+// time the drop path instead.
+void CAN_TX_Function(void *pvParameters)//WCET test function
 {
-    uint8_t msgOut[8];
-    while (1)
-    {
-        xQueueReceive(msgOutQ, msgOut, portMAX_DELAY);
-        xSemaphoreTake(CAN_TX_Semaphore, portMAX_DELAY);
-        CAN_TX(0x123, msgOut);
-    }
-}
-
-void CAN_TX_Function(void *pvParameters)
-{
-    uint8_t msgOut[8];
-
-    if (CAN_TX_Iterations == 0)
-    {
-        CAN_TX_StartTime = xTaskGetTickCount();
-    }
+    uint8_t msgOut[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
     while (1)
     {
-        CAN_TX_Iterations++;
-
-        if (xQueueReceive(msgOutQ, msgOut, pdMS_TO_TICKS(5)) == pdTRUE)
+        for (int wait = 0; wait < 100 && can_busy(CAN_TX_TELEMETRY); wait++)
         {
-            for (int i = 0; i < 8; i++)
-            {
-                msgOut[i] = 0xFF;
-            }
-            CAN_TX(0x123, msgOut);
+            vTaskDelay(pdMS_TO_TICKS(1));
         }
-        else
+
+        uint32_t startTime = micros();
+        for (int i = 0; i < CAN_TX_DEPTH_OTHER; i++)
         {
+            can_send(CAN_TX_TELEMETRY, msgOut);
         }
+        CAN_TX_Micros += micros() - startTime;
+        CAN_TX_Iterations += CAN_TX_DEPTH_OTHER;
     }
-}
\ No newline at end of file
+}
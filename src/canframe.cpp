@@ -0,0 +1,75 @@
+#include "canframe.h"
+
+#define EVENT_BITS 14
+
+static bool encodable(const NoteEvent &event)
+{
+    return event.octave <= 7 && event.noteIndex < 12 && (event.type == 'P' || event.type == 'R');
+}
+
+int canframe_encode(const NoteEvent *events, int count, uint8_t msg[8])
+{
+    if (count <= 0)
+        return 0;
+    if (!encodable(events[0]))
+        return 0;
+
+    // Take events while the span of octaves still fits the note field
+    uint8_t baseOctave = events[0].octave;
+    uint8_t topOctave = events[0].octave;
+    int n = 1;
+    while (n < count && n < CAN_FRAME_EVENTS && encodable(events[n]))
+    {
+        uint8_t low = events[n].octave < baseOctave ? events[n].octave : baseOctave;
+        uint8_t high = events[n].octave > topOctave ? events[n].octave : topOctave;
+        if ((high - low) * 12 + 11 >= CAN_FRAME_NOTES)
+            break;
+        baseOctave = low;
+        topOctave = high;
+        n++;
+    }
+
+    uint64_t bits = 0;
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t delta = i ? events[i].timestamp - events[i - 1].timestamp : 0;
+        if (delta > CAN_FRAME_MAX_DELTA)
+            delta = CAN_FRAME_MAX_DELTA;
+        uint32_t note = (events[i].octave - baseOctave) * 12 + events[i].noteIndex;
+        uint32_t field = (events[i].type == 'P') | note << 1 | delta << 7;
+        bits |= (uint64_t)field << (8 + EVENT_BITS * i);
+    }
+    bits |= CAN_FRAME_VERSION << 5 | (n - 1) << 3 | baseOctave; // Byte 0
+
+    for (int i = 0; i < 8; i++)
+        msg[i] = (uint8_t)(bits >> (8 * i));
+    return n;
+}
+
+int canframe_decode(const uint8_t msg[8], uint32_t rxTime, NoteEvent events[CAN_FRAME_EVENTS])
+{
+    if (!canframe_isKeyFrame(msg))
+        return 0;
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++)
+        bits |= (uint64_t)msg[i] << (8 * i);
+
+    int n = ((msg[0] >> 3) & 3) + 1;
+    uint8_t baseOctave = msg[0] & 7;
+    uint32_t time = 0;
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t field = (uint32_t)(bits >> (8 + EVENT_BITS * i)) & ((1 << EVENT_BITS) - 1);
+        uint8_t note = (field >> 1) & (CAN_FRAME_NOTES - 1);
+        if (i)
+            time += field >> 7;
+        events[i].timestamp = time;
+        events[i].type = (field & 1) ? 'P' : 'R';
+        events[i].octave = (uint8_t)(baseOctave + note / 12);
+        events[i].noteIndex = (uint8_t)(note % 12);
+    }
+    // Times so far are from the first event; anchor the last at rxTime
+    for (int i = 0; i < n; i++)
+        events[i].timestamp = rxTime - (time - events[i].timestamp);
+    return n;
+}
@@ -1,5 +1,6 @@
 #include "display.h"
 #include "globals.h"
+#include "key.h"
 #include "pins.h"    
 #include <U8g2lib.h> 
 #include <bitset>
@@ -18,77 +19,95 @@ void displayUpdateTask(void *pvParameters)
         digitalToggle(LED_BUILTIN);
         std::bitset<32> localInputs;
 
+        NoteEvent event;
+        while (localKeyEvents.pop(KEY_CONSUMER_DISPLAY, event))
+        {
+            showKeyEvent(event);
+        }
+        while (remoteKeyEvents.pop(KEY_CONSUMER_DISPLAY, event))
+        {
+            showKeyEvent(event);
+        }
+
         u8g2.clearBuffer();
         u8g2.setFont(u8g2_font_ncenB08_tr);
-        if (moduleOctave == 4)
+        if (modulePosition == 0)
         {
             u8g2.drawStr(2, 10, "Notes:");
 
             int cursorx = 40;
 
-            if (xSemaphoreTake(localKeyMutex, portMAX_DELAY) == pdTRUE)
+            if (xSemaphoreTake(keyStateMutex, portMAX_DELAY) == pdTRUE)
             {
-                for (int i = 0; i < 12; i++)
-                {
-                    if (keys4[i])
-                    {
-                        const char *localNoteNames[12] =
-                            {"C4", "C#4", "D4", "D#4", "E4", "F4", "F#4", "G4", "G#4", "A4", "A#4", "B4"};
-                        u8g2.setCursor(cursorx, 10);
-                        u8g2.print(localNoteNames[i]);
-                        cursorx += 15;
-                    }
-                }
-                xSemaphoreGive(localKeyMutex);
-            }
-            if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
-            {
-                for (int i = 0; i < 12; i++)
-                {
-                    if (keys5[i])
-                    {
-                        const char *remoteNoteNames[12] =
-                            {"C5", "C#5", "D5", "D#5", "E5", "F5", "F#5", "G5", "G#5", "A5", "A#5", "B5"};
-                        u8g2.setCursor(cursorx, 10);
-                        u8g2.print(remoteNoteNames[i]);
-                        cursorx += 15;
-                    }
-                }
-                for (int i = 0; i < 12; i++)
+                const char *noteNames[12] =
+                    {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+                int firstOctave = chain_firstOctave(moduleCount);
+                for (int m = 0; m < moduleCount; m++)
                 {
-                    if (keys6[i])
+                    for (int i = 0; i < 12; i++)
                     {
-                        const char *sixthNoteNames[12] =
-                            {"C6", "C#6", "D6", "D#6", "E6", "F6", "F#6", "G6", "G#6", "A6", "A#6", "B6"};
-                        u8g2.setCursor(cursorx, 10);
-                        u8g2.print(sixthNoteNames[i]);
-                        cursorx += 15;
+                        if (moduleKeys[m][i])
+                        {
+                            u8g2.setCursor(cursorx, 10);
+                            u8g2.print(noteNames[i]);
+                            u8g2.print(firstOctave + m);
+                            cursorx += 15;
+                        }
                     }
                 }
-                xSemaphoreGive(externalKeyMutex);
+                xSemaphoreGive(keyStateMutex);
             }
             u8g2.setCursor(2, 20);
             u8g2.print("Volume:");
             u8g2.setCursor(50, 20);
             u8g2.print(sysState.volume);
+            u8g2.setCursor(70, 20);
+            u8g2.print(waveformNames[synthControl.waveform]);
+
+            // Envelope page shown on knobs 0 and 1
+            u8g2.setCursor(100, 20);
+            if (sysState.envelopePage)
+            {
+                u8g2.print("S");
+                u8g2.print(sysState.envelope[2], HEX);
+                u8g2.print("R");
+                u8g2.print(sysState.envelope[3], HEX);
+            }
+            else
+            {
+                u8g2.print("A");
+                u8g2.print(sysState.envelope[0], HEX);
+                u8g2.print("D");
+                u8g2.print(sysState.envelope[1], HEX);
+            }
 
             u8g2.setCursor(2, 30);
-            if (sysState.knob2.getPress())
+            if (samplerEnabled)
             {
-                u8g2.print("Sampler Enabled");
+                // Selected track, then each track soloed, muted or heard
+                u8g2.print("Loop T");
+                u8g2.print(loopTrack + 1);
+                u8g2.print(" ");
+                for (int t = 0; t < LOOPER_TRACKS; t++)
+                {
+                    u8g2.print(sequencer.soloed >> t & 1 ? 'S' : sequencer.muted >> t & 1 ? 'M' : '-');
+                }
             }
             else
             {
                 u8g2.print("Sampler Disabled");
             }
         }
-        if (moduleOctave == 5)
+        else
         {
-            u8g2.drawStr(2, 10, "Octave 5");
-        }
-        if (moduleOctave == 6)
-        {
-            u8g2.drawStr(2, 10, "Octave 6");
+            u8g2.setCursor(2, 10);
+            u8g2.print("Octave ");
+            u8g2.print(moduleOctave);
+            u8g2.setCursor(2, 20);
+            u8g2.print("Module ");
+            u8g2.print(modulePosition + 1);
+            u8g2.print(" of ");
+            u8g2.print(moduleCount);
         }
         u8g2.sendBuffer();
     }
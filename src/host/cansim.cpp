@@ -0,0 +1,615 @@
+// Multi-module simulation for Linux: runs the key event path of several
+// modules on threads against a virtual CAN bus, and reports bus load,
+// queue depths and key-to-master latency.
+//
+//   cansim [-n modules] [-k presses_per_s] [-t telemetry_per_s] [-d seconds]
+//          [-b bit_rate] [-S seed] [-p plug_ms] [script.txt]
+//
+// Each module has a scan thread playing its key presses, a key event thread
+// batching them into frames through the firmware's transmit scheduler, and
+// a decode thread fed by the RX interrupt handler, as scanKeysTask,
+// keyEventTask and decodeTask on the board. A chain thread steps the
+// firmware's ChainDetector every millisecond, as scanKeysTask does once per
+// scan, so modules find their positions over the handshake lines before the
+// script starts. The RX drain, the decode pass and the key batching are the
+// firmware's own, from canlink.h. Position 0 is the master, where latency is measured from
+// the scan thread's push to the decoded event.
+//
+// With -p the east end module starts unplugged and is plugged in plug_ms
+// into the script, while the others keep playing; it plays nothing itself.
+//
+// Script lines are "timestamp module P|R noteIndex", with the timestamp in
+// ms from the start and the module by position from the west end. Without a
+// script every module other than the master plays random presses at -k per
+// second. The exit status is 1 if any remote key event failed to arrive or
+// the chain enumerated wrongly.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "vcan.h"
+#include "can.h"
+#include "cantx.h"
+#include "canlink.h"
+#include "canframe.h"
+#include "eventring.h"
+#include "noteevent.h"
+#include "autodetection.h"
+
+using std::chrono::steady_clock;
+
+static const uint32_t defaultBitRate = 125000; // As set up in lib/ES_CAN
+static const int keyRingSize = 32;             // KEY_EVENT_RING_SIZE
+
+struct ScriptEvent
+{
+    uint32_t time; // ms
+    int module;
+    char type;
+    uint8_t noteIndex;
+};
+
+// Like a FreeRTOS task notification used as a counting semaphore
+class Notification
+{
+private:
+    std::mutex lock;
+    std::condition_variable wake;
+    uint32_t count = 0;
+
+public:
+    void give()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        count++;
+        wake.notify_one();
+    }
+
+    // As ulTaskNotifyTake(pdTRUE, timeout)
+    uint32_t take(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait_for(guard, timeout, [this] { return count > 0; });
+        uint32_t taken = count;
+        count = 0;
+        return taken;
+    }
+
+    uint32_t takeUntil(std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait_until(guard, deadline, [this] { return count > 0; });
+        uint32_t taken = count;
+        count = 0;
+        return taken;
+    }
+};
+
+struct SimMailboxes
+{
+    VirtualCanBus *bus = nullptr;
+    int node = 0;
+
+    bool tryTx(uint32_t id, const uint8_t data[8], uint32_t &mailbox)
+    {
+        return bus->tryTx(node, id, data, mailbox);
+    }
+
+    bool pending(uint32_t mailbox)
+    {
+        return bus->txPending(node, mailbox);
+    }
+};
+
+struct SimRxFifo
+{
+    VirtualCanBus *bus;
+    int node;
+    std::atomic<uint32_t> *received;
+
+    bool level()
+    {
+        return bus->rxLevel(node);
+    }
+
+    void rx(uint32_t &id, uint8_t data[8])
+    {
+        bus->rx(node, id, data);
+        (*received)++;
+    }
+};
+
+static steady_clock::time_point simStart;
+static steady_clock::time_point scriptStart;
+static std::atomic<bool> stopping{false};
+
+static uint32_t ticks()
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now() - simStart).count();
+}
+
+static int64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - simStart).count();
+}
+
+// When each remote key edge left its scan thread, by octave, note and type
+static std::atomic<int64_t> edgeTime[8][12][2];
+static std::atomic<uint32_t> remoteSent{0};
+static std::mutex latencyLock;
+static std::vector<double> latencies; // ms
+
+class Module
+{
+private:
+    VirtualCanBus &bus;
+    int node;
+    uint8_t txPosition; // Under the interrupt lock, which the TX handler holds
+    CanTxScheduler<SimMailboxes> tx;
+    ChainDetector chain;
+    EventRing<NoteEvent, keyRingSize, 1> keyEvents;
+    EventRing<CanFrame, CAN_RX_RING_SIZE, 1> rxFrames;
+    EventRing<CanFrame, 8, 1> controlFrames;
+    std::atomic<uint32_t> rxPushed{0};
+    std::atomic<uint32_t> rxPopped{0};
+    Notification keyNotify;
+    Notification decodeNotify;
+    Notification chainNotify;
+    std::atomic<uint32_t> lastActivity{0}; // lastActivityTick
+    std::vector<std::thread> threads;
+
+    void rxIsr()
+    {
+        SimRxFifo fifo = {&bus, node, &rxPushed};
+        canlink_drain(fifo, rxFrames, ticks());
+        uint32_t depth = rxPushed - rxPopped;
+        if (depth > rxHighWater)
+            rxHighWater = depth;
+        if (bus.rxOverrun(node))
+            rxFifoOverruns++;
+        decodeNotify.give();
+    }
+
+    bool send(CanTxClass txClass, const uint8_t data[8])
+    {
+        std::lock_guard<std::mutex> irq(bus.interruptLock(node));
+        return tx.send(txClass, data, txPosition);
+    }
+
+    void scanThread()
+    {
+        for (const ScriptEvent &step : script)
+        {
+            std::this_thread::sleep_until(scriptStart + std::chrono::milliseconds(step.time));
+            if (stopping)
+                return;
+            uint8_t octave = this->octave;
+            NoteEvent event = {ticks(), step.type, octave, step.noteIndex};
+            if (position != 0)
+            {
+                edgeTime[octave][step.noteIndex][step.type == 'P'] = nowNs();
+                remoteSent++;
+            }
+            keyEvents.push(event);
+            keyNotify.give();
+        }
+    }
+
+    // The CAN consumer of keyEventTask: everything pending goes out up to
+    // four events to a frame
+    void keyEventThread()
+    {
+        while (!stopping)
+        {
+            if (!keyNotify.take(std::chrono::milliseconds(10)))
+                continue;
+            lastActivity = ticks();
+            canlink_sendKeyEvents(keyEvents, 0, position != 0, [this](const uint8_t msg[8]) {
+                if (send(CAN_TX_NOTE, msg))
+                    noteFrames++;
+            });
+        }
+    }
+
+    // decodeTask's DecodeSink, with latency measured where the master would
+    // push to remoteKeyEvents
+    struct DecodeSink
+    {
+        Module &module;
+
+        void activity()
+        {
+            module.lastActivity = ticks();
+        }
+
+        void keyEvents(const NoteEvent *events, int count)
+        {
+            int64_t arrived = nowNs();
+            std::lock_guard<std::mutex> guard(latencyLock);
+            for (int i = 0; i < count; i++)
+            {
+                int64_t sent = edgeTime[events[i].octave][events[i].noteIndex][events[i].type == 'P'];
+                latencies.push_back((arrived - sent) / 1e6);
+            }
+        }
+
+        void control(const uint8_t msg[8])
+        {
+            CanFrame frame = {CAN_ID_CONTROL, {0}, 0};
+            memcpy(frame.data, msg, 8);
+            module.controlFrames.push(frame);
+        }
+
+        // Nothing plays the remote keys here; their latency is taken above
+        void wakeKeys()
+        {
+        }
+
+        void wakeChain()
+        {
+            module.chainNotify.give();
+        }
+    };
+
+    void decodeThread()
+    {
+        while (!stopping)
+        {
+            if (!decodeNotify.take(std::chrono::milliseconds(10)))
+                continue;
+            // Every frame pushed before the pass is taken in it
+            uint32_t pushed = rxPushed;
+            DecodeSink sink = {*this};
+            canlink_decode(rxFrames, position == 0, sink);
+            rxPopped = pushed;
+        }
+    }
+
+    // The chain part of scanKeysTask and chain_update, at the scan period and
+    // whenever decodeThread has control frames for it
+    void chainThread()
+    {
+        uint32_t moduleId = 0x9e3779b9u * (node + 1);
+        {
+            std::lock_guard<std::mutex> irq(bus.interruptLock(node));
+            tx.setControlTag(can_controlTag(moduleId));
+        }
+        chain.begin(moduleId, ticks());
+        steady_clock::time_point next = steady_clock::now() + std::chrono::milliseconds(1);
+        while (!stopping)
+        {
+            if (!chainNotify.takeUntil(next))
+                next += std::chrono::milliseconds(1);
+            int64_t start = nowNs();
+            uint32_t now = ticks();
+            CanFrame frame;
+            while (controlFrames.pop(0, frame))
+                chain.receive(frame.data, now);
+
+            bool west, east, idle;
+            bus.readHandshake(node, west, east);
+            {
+                std::lock_guard<std::mutex> irq(bus.interruptLock(node));
+                idle = !tx.busy(CAN_TX_CONTROL);
+            }
+            bool changed = chain.update(west, east, idle, now);
+            bus.setHandshakeOutputs(node, chain.westOutput(), chain.eastOutput());
+            uint8_t msg[8];
+            if (chain.takeMessage(msg))
+                send(CAN_TX_CONTROL, msg);
+            if (changed)
+            {
+                {
+                    std::lock_guard<std::mutex> irq(bus.interruptLock(node));
+                    txPosition = (uint8_t)chain.modulePosition();
+                    tx.setPositioned();
+                }
+                count = chain.moduleCount();
+                octave = (uint8_t)(chain_firstOctave(count) + chain.modulePosition());
+                position = chain.modulePosition();
+                settles++;
+            }
+
+            int64_t step = nowNs() - start;
+            if (step > longestStep)
+                longestStep = step;
+        }
+    }
+
+    // Bulk traffic at the lowest class, as CAN_TX_Function
+    void telemetryThread()
+    {
+        uint8_t msg[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+        steady_clock::time_point next = steady_clock::now();
+        while (!stopping)
+        {
+            next += std::chrono::microseconds((int64_t)(1e6 / telemetryRate));
+            std::this_thread::sleep_until(next);
+            if (send(CAN_TX_TELEMETRY, msg))
+                telemetryFrames++;
+        }
+    }
+
+public:
+    std::atomic<int> position{0};
+    std::atomic<int> count{1};
+    std::atomic<uint8_t> octave{CHAIN_BASE_OCTAVE};
+    std::atomic<uint32_t> settles{0};
+    std::atomic<int64_t> longestStep{0}; // ns
+    double telemetryRate = 0;
+    std::vector<ScriptEvent> script;
+    uint32_t rxHighWater = 0;
+    uint32_t rxFifoOverruns = 0;
+    uint32_t noteFrames = 0;
+    uint32_t telemetryFrames = 0;
+
+    explicit Module(VirtualCanBus &bus)
+        : bus(bus), node(bus.addNode()), txPosition(0), tx(SimMailboxes{&bus, node})
+    {
+        bus.registerRxIsr(node, [this] { rxIsr(); });
+        bus.registerTxIsr(node, [this] { tx.refill(txPosition); });
+    }
+
+    // Power up: enumeration and the bus side
+    void start()
+    {
+        threads.emplace_back(&Module::chainThread, this);
+        threads.emplace_back(&Module::decodeThread, this);
+        threads.emplace_back(&Module::keyEventThread, this);
+        if (telemetryRate > 0)
+            threads.emplace_back(&Module::telemetryThread, this);
+    }
+
+    void play()
+    {
+        threads.emplace_back(&Module::scanThread, this);
+    }
+
+    void join()
+    {
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    void report()
+    {
+        printf("module %d of %d, octave %d: %u note and %u telemetry frames queued, dropped %u/%u/%u, "
+               "queue high-water %u/%u/%u, RX ring high-water %u/%d, RX overruns %u, "
+               "longest chain step %.1f us, last activity at %u ms\n",
+               (int)position, (int)count, (int)octave, noteFrames, telemetryFrames,
+               tx.dropped(CAN_TX_NOTE), tx.dropped(CAN_TX_CONTROL), tx.dropped(CAN_TX_TELEMETRY),
+               tx.highWater(CAN_TX_NOTE), tx.highWater(CAN_TX_CONTROL), tx.highWater(CAN_TX_TELEMETRY),
+               rxHighWater, CAN_RX_RING_SIZE, rxFifoOverruns + rxFrames.overflows(0), longestStep / 1e3,
+               (unsigned)lastActivity);
+    }
+};
+
+static bool readScript(const char *path, int modules, std::vector<ScriptEvent> &events)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+    char line[128];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        lineNumber++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        unsigned timestamp, noteIndex;
+        int module;
+        char type;
+        if (sscanf(line, "%u %d %c %u", &timestamp, &module, &type, &noteIndex) != 4 ||
+            (type != 'P' && type != 'R') || noteIndex >= 12 || module < 0 || module >= modules)
+        {
+            fprintf(stderr, "%s:%d: expected \"timestamp module P|R noteIndex\" for one of %d modules\n",
+                    path, lineNumber, modules);
+            fclose(file);
+            return false;
+        }
+        events.push_back({timestamp, module, type, (uint8_t)noteIndex});
+    }
+    fclose(file);
+    return true;
+}
+
+// Presses at random times, each held 50-300 ms, on keys not already down
+static void randomScript(int modules, double pressRate, uint32_t durationMs, uint32_t seed,
+                         std::vector<ScriptEvent> &events)
+{
+    std::mt19937 random(seed);
+    std::exponential_distribution<double> gap(pressRate / 1000);
+    std::uniform_int_distribution<int> hold(50, 300);
+    std::uniform_int_distribution<int> key(0, 11);
+    for (int module = 1; module < modules; module++)
+    {
+        uint32_t heldUntil[12] = {};
+        for (double time = gap(random); time < durationMs; time += gap(random))
+        {
+            uint8_t note = (uint8_t)key(random);
+            if (heldUntil[note] >= time)
+                continue;
+            heldUntil[note] = (uint32_t)time + hold(random);
+            events.push_back({(uint32_t)time, module, 'P', note});
+            events.push_back({heldUntil[note], module, 'R', note});
+        }
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: cansim [-n modules] [-k presses_per_s] [-t telemetry_per_s] [-d seconds]\n"
+                    "              [-b bit_rate] [-S seed] [-p plug_ms] [script.txt]\n");
+}
+
+// Wait for the first modules of the chain to have settled on their places
+// in it, as many as there are; returns how long that took in ms, or -1
+static int awaitChain(const std::vector<Module *> &chain, int modules, uint32_t timeoutMs)
+{
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point limit = start + std::chrono::milliseconds(timeoutMs);
+    while (steady_clock::now() < limit)
+    {
+        bool settled = true;
+        for (int m = 0; m < modules; m++)
+        {
+            const Module &module = *chain[m];
+            if (!module.settles || module.position != m || module.count != modules)
+                settled = false;
+        }
+        if (settled)
+            return (int)std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now() - start).count();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    int modules = 3;
+    double pressRate = 20;
+    double telemetryRate = 0;
+    double seconds = 5;
+    uint32_t bitRate = defaultBitRate;
+    uint32_t seed = 1;
+    int plugMs = -1;
+    const char *scriptPath = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "-n") && hasValue)
+            modules = atoi(argv[++i]);
+        else if (!strcmp(arg, "-k") && hasValue)
+            pressRate = atof(argv[++i]);
+        else if (!strcmp(arg, "-t") && hasValue)
+            telemetryRate = atof(argv[++i]);
+        else if (!strcmp(arg, "-d") && hasValue)
+            seconds = atof(argv[++i]);
+        else if (!strcmp(arg, "-b") && hasValue)
+            bitRate = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-S") && hasValue)
+            seed = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-p") && hasValue)
+            plugMs = atoi(argv[++i]);
+        else if (arg[0] != '-' && !scriptPath)
+            scriptPath = arg;
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+    if (modules < 2 || modules > CHAIN_MAX_MODULES || pressRate <= 0 || seconds <= 0 || bitRate < 1000)
+    {
+        usage();
+        return 2;
+    }
+
+    uint32_t durationMs = (uint32_t)(seconds * 1000);
+    std::vector<ScriptEvent> events;
+    if (!scriptPath)
+        randomScript(modules, pressRate, durationMs, seed, events);
+    else if (!readScript(scriptPath, modules, events))
+        return 1;
+    std::stable_sort(events.begin(), events.end(),
+                     [](const ScriptEvent &a, const ScriptEvent &b) { return a.time < b.time; });
+    uint32_t lastEvent = events.empty() ? 0 : events.back().time;
+
+    // Modules plugged in at power-up
+    int plugged = plugMs >= 0 ? modules - 1 : modules;
+    if (plugged < 2)
+    {
+        usage();
+        return 2;
+    }
+
+    VirtualCanBus bus(bitRate);
+    std::vector<Module *> chain;
+    for (int position = 0; position < modules; position++)
+    {
+        Module *module = new Module(bus);
+        module->telemetryRate = telemetryRate;
+        for (const ScriptEvent &event : events)
+        {
+            if (event.module == position && position < plugged)
+                module->script.push_back(event);
+        }
+        chain.push_back(module);
+    }
+    if (plugged < modules)
+        bus.setPlugged(modules - 1, false);
+
+    simStart = steady_clock::now();
+    bus.start();
+    for (Module *module : chain)
+        module->start();
+
+    bool enumerated = true;
+    int enumerationMs = awaitChain(chain, plugged, 5 * CHAIN_TIMEOUT_MS);
+    if (enumerationMs < 0)
+        enumerated = false;
+    else
+        printf("chain of %d enumerated in %d ms\n", plugged, enumerationMs);
+
+    scriptStart = steady_clock::now();
+    for (Module *module : chain)
+        module->play();
+    if (plugged < modules)
+    {
+        std::this_thread::sleep_until(scriptStart + std::chrono::milliseconds(plugMs));
+        bus.setPlugged(modules - 1, true);
+        int replugMs = awaitChain(chain, modules, 5 * CHAIN_TIMEOUT_MS);
+        if (replugMs < 0)
+            enumerated = false;
+        else
+            printf("module plugged in at %d ms, chain of %d enumerated in %d ms\n", plugMs, modules, replugMs);
+    }
+    if (!enumerated)
+        printf("chain did not enumerate in order\n");
+
+    // Leave time for the last frames to drain
+    uint32_t runMs = std::max(durationMs, lastEvent + 500);
+    std::this_thread::sleep_until(scriptStart + std::chrono::milliseconds(runMs));
+    double utilisation = bus.utilisation();
+    stopping = true;
+    for (Module *module : chain)
+        module->join();
+    bus.stop();
+
+    printf("%d modules, %.1f s, %llu frames, bus %.1f%% busy at %u bit/s\n", modules, runMs / 1000.0,
+           (unsigned long long)bus.framesSent(), utilisation * 100, bitRate);
+    for (Module *module : chain)
+        module->report();
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t received = latencies.size();
+    if (received)
+    {
+        double sum = 0;
+        for (double latency : latencies)
+            sum += latency;
+        printf("latency over %zu remote key events: min %.2f ms, mean %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               received, latencies.front(), sum / received, latencies[(received - 1) * 99 / 100], latencies.back());
+    }
+    uint32_t sent = remoteSent;
+    if (received < sent)
+        printf("%u of %u remote key events lost\n", (unsigned)(sent - received), sent);
+
+    for (Module *module : chain)
+        delete module;
+    return received < sent || !enumerated ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+// Flash store check for Linux: drives the firmware's FlashLog (flashlog.h)
+// over RAM flash (ramflash.h) the size of the store, with settings and loop
+// records laid out as store.h has them, and checks that after every reset
+// the log mounts with the last record of each type saved.
+//
+//   flashsim [-n appends] [-l loop_percent] [-q quiet_percent] [-b reboot_every] [-c cut_every] [-S seed]
+//
+// Each step appends a settings record or, -l percent of the time, a loop of
+// random length. After -q percent of steps the pending erase is done, as
+// storeTask does when the chain is idle. Every -b steps the board resets
+// and the log is mounted again. With -c, power is cut on average every that
+// many erases and programs, tearing the one in progress, and the board then
+// resets. The exit status is 1 on any error.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "flashlog.h"
+#include "store.h"
+#include "ramflash.h"
+
+typedef RamFlash<STORE_PAGE_SIZE, STORE_PAGES> Flash;
+
+static Flash flash;
+static FlashLog<Flash> storeLog(flash);
+
+// What each type should read back as after a reset; after a cut append,
+// either the record before it or the one being written
+static std::vector<uint8_t> saved[FLASHLOG_TYPES];
+static std::vector<uint8_t> cutShort[FLASHLOG_TYPES];
+
+static bool matches(const uint8_t *record, uint16_t length, const std::vector<uint8_t> &want)
+{
+    if (!record)
+        return want.empty();
+    return length == want.size() && !memcmp(record, want.data(), length);
+}
+
+static uint64_t check()
+{
+    uint64_t errors = 0;
+    for (uint8_t t = 0; t < FLASHLOG_TYPES; t++)
+    {
+        uint16_t length = 0;
+        const uint8_t *record = storeLog.find(t, length);
+        if (!cutShort[t].empty() && matches(record, length, cutShort[t]))
+            saved[t] = cutShort[t];
+        else if (!matches(record, length, saved[t]))
+        {
+            printf("type %u: found %s of %u bytes, saved %zu bytes\n", t, record ? "a record" : "nothing",
+                   record ? length : 0, saved[t].size());
+            errors++;
+        }
+        cutShort[t].clear();
+    }
+    return errors;
+}
+
+static std::vector<uint8_t> randomSettings(std::mt19937 &random)
+{
+    std::vector<uint8_t> record(sizeof(StoredSettings));
+    for (uint8_t &byte : record)
+        byte = (uint8_t)random();
+    return record;
+}
+
+static std::vector<uint8_t> randomLoop(std::mt19937 &random)
+{
+    static StoredLoop loop;
+    std::uniform_int_distribution<int> used(0, LOOPER_BANK_BYTES);
+    loop.loopTicks = 4800;
+    for (int t = 0; t < LOOPER_TRACKS; t++)
+        loop.bank.end[t] = (uint16_t)used(random);
+    std::sort(loop.bank.end, loop.bank.end + LOOPER_TRACKS);
+    for (int i = 0; i < looper_used(loop.bank); i++)
+        loop.bank.data[i] = (uint8_t)random();
+    const uint8_t *bytes = (const uint8_t *)&loop;
+    return std::vector<uint8_t>(bytes, bytes + store_loopLength(loop));
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: flashsim [-n appends] [-l loop_percent] [-q quiet_percent] [-b reboot_every] [-c cut_every] [-S seed]\n");
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t appends = 100000;
+    uint32_t loopPercent = 25;
+    uint32_t quietPercent = 50;
+    uint32_t rebootEvery = 1000;
+    uint32_t cutEvery = 0;
+    uint32_t seed = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "-n") && hasValue)
+            appends = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-l") && hasValue)
+            loopPercent = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-q") && hasValue)
+            quietPercent = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-b") && hasValue)
+            rebootEvery = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-c") && hasValue)
+            cutEvery = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-S") && hasValue)
+            seed = (uint32_t)atoi(argv[++i]);
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+    if (loopPercent > 100 || quietPercent > 100)
+    {
+        usage();
+        return 2;
+    }
+
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<uint32_t> percent(0, 99);
+    std::uniform_int_distribution<uint64_t> cut(0, 2ULL * cutEvery);
+    if (cutEvery)
+        flash.cutPowerAfter(cut(random));
+    storeLog.mount();
+
+    uint64_t saves = 0, refused = 0, failed = 0, reboots = 0, cuts = 0, bytes = 0, errors = 0;
+    for (uint32_t n = 0; n < appends; n++)
+    {
+        uint8_t type = percent(random) < loopPercent ? STORE_LOOP : STORE_SETTINGS;
+        std::vector<uint8_t> record = type == STORE_LOOP ? randomLoop(random) : randomSettings(random);
+        if (storeLog.append(type, record.data(), (uint16_t)record.size()))
+        {
+            saved[type] = record;
+            saves++;
+            bytes += record.size();
+            uint16_t length = 0;
+            const uint8_t *found = storeLog.find(type, length);
+            if (!matches(found, length, record))
+            {
+                printf("append %u: record not found\n", n);
+                errors++;
+            }
+        }
+        else if (flash.poweredDown())
+            cutShort[type] = record;
+        else if (storeLog.pending())
+            refused++;
+        else
+            failed++;
+
+        if (!flash.poweredDown() && percent(random) < quietPercent)
+            storeLog.maintain();
+
+        // A reset, planned or not
+        bool poweredDown = flash.poweredDown();
+        if (poweredDown || (rebootEvery && n % rebootEvery == rebootEvery - 1))
+        {
+            flash.powerUp();
+            if (poweredDown)
+                cuts++;
+            if (cutEvery)
+                flash.cutPowerAfter(cut(random));
+            storeLog.mount();
+            errors += check();
+            reboots++;
+        }
+    }
+
+    uint32_t fewest = UINT32_MAX, most = 0;
+    for (int p = 0; p < STORE_PAGES; p++)
+    {
+        fewest = std::min(fewest, flash.erases[p]);
+        most = std::max(most, flash.erases[p]);
+    }
+    if (flash.violations)
+    {
+        printf("%llu programs of double words not erased\n", (unsigned long long)flash.violations);
+        errors++;
+    }
+    if (failed)
+    {
+        printf("%llu appends failed with the flash powered\n", (unsigned long long)failed);
+        errors++;
+    }
+
+    printf("%llu records saved, %llu refused waiting for an erase, %llu resets of which %llu cut power\n",
+           (unsigned long long)saves, (unsigned long long)refused, (unsigned long long)reboots,
+           (unsigned long long)cuts);
+    printf("erases a page: %u to %u; %.2f bytes programmed a byte saved\n", fewest, most,
+           bytes ? (double)flash.programs * 8 / bytes : 0.0);
+    printf("%llu errors\n", (unsigned long long)errors);
+    return errors ? 1 : 0;
+}
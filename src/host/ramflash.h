@@ -0,0 +1,122 @@
+#ifndef RAMFLASH_H
+#define RAMFLASH_H
+
+// Flash in RAM for host tests of FlashLog (flashlog.h), with the L432's
+// rules: erased bits read 1, erasing works a page at a time, and each double
+// word can be programmed once between erases. Programming one that is not
+// erased fails and is counted as a violation.
+//
+// cutPowerAfter(n) lets n more erases and programs through, then tears the
+// next one as a reset would: an erase leaves only the first half of the page
+// erased and a program leaves some of the bits that should have gone to 0 at
+// 1. Every operation after that fails until powerUp().
+
+#include <stdint.h>
+#include <string.h>
+#include <random>
+
+template <uint32_t PageSize, uint16_t Pages>
+class RamFlash
+{
+public:
+    static const uint32_t PAGE_SIZE = PageSize;
+    static const uint16_t PAGES = Pages;
+
+    uint32_t erases[Pages] = {};
+    uint64_t programs = 0;
+    uint64_t violations = 0;
+
+    RamFlash(uint32_t seed = 1) : random(seed)
+    {
+        memset(memory, 0xff, sizeof(memory));
+    }
+
+    const uint8_t *data()
+    {
+        return memory;
+    }
+
+    bool erase(uint16_t page)
+    {
+        if (page >= Pages || !spend())
+        {
+            if (page < Pages && torn)
+                memset(memory + page * PageSize, 0xff, PageSize / 2);
+            return false;
+        }
+        memset(memory + page * PageSize, 0xff, PageSize);
+        erases[page]++;
+        return true;
+    }
+
+    bool program(uint32_t offset, uint64_t value)
+    {
+        uint64_t current;
+        if (offset % 8 || offset + 8 > sizeof(memory))
+        {
+            violations++;
+            return false;
+        }
+        memcpy(&current, memory + offset, sizeof(current));
+        if (current != ~0ULL)
+        {
+            violations++;
+            return false;
+        }
+        if (!spend())
+        {
+            if (torn)
+            {
+                uint64_t left = (uint64_t)random() << 32 | random();
+                value |= left & ~value;
+                memcpy(memory + offset, &value, sizeof(value));
+            }
+            return false;
+        }
+        memcpy(memory + offset, &value, sizeof(value));
+        programs++;
+        return true;
+    }
+
+    void cutPowerAfter(uint64_t operations)
+    {
+        countdown = operations;
+        cutting = true;
+    }
+
+    void powerUp()
+    {
+        cutting = false;
+        powered = true;
+    }
+
+    bool poweredDown() const
+    {
+        return !powered;
+    }
+
+private:
+    uint8_t memory[PageSize * Pages];
+    std::mt19937 random;
+    uint64_t countdown = 0;
+    bool cutting = false;
+    bool powered = true;
+    bool torn = false; // The operation being refused is the one cut short
+
+    // Whether an operation goes ahead
+    bool spend()
+    {
+        torn = false;
+        if (!powered)
+            return false;
+        if (cutting && countdown-- == 0)
+        {
+            powered = false;
+            torn = true;
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
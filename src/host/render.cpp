@@ -0,0 +1,238 @@
+// Offline renderer for Linux: plays a note-event script through the same
+// synthesis core the firmware runs and writes an 8-bit WAV, or benchmarks the
+// renderer with a fixed number of held voices.
+//
+//   render [-r rate] [-a a4_hz] [-o out.wav] [-t tail_ms] [-w waveform] [-v volume] script.txt
+//   render -b voices [-r rate] [-s seconds]
+//
+// Script lines are "timestamp type octave noteIndex" as in NoteEvent, with
+// the timestamp in ms and type P or R. Lines starting with # are ignored.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "synth.h"
+#include "noteevent.h"
+
+static const uint32_t defaultSampleRate = SYNTH_SAMPLE_RATE; // fs on the firmware
+static const uint8_t defaultVolume = 4;                      // sysState.volume at boot
+
+static SynthState synthState;
+static SynthControl synthControl;
+
+static TuningTable tuning;
+
+// The firmware's table is used as is at its own rate and pitch; anything
+// else is generated by the same function at startup
+static void initSynth(uint32_t sampleRate, double a4Hz, uint8_t waveform, uint8_t volume)
+{
+    bool firmwareTuning = sampleRate == SYNTH_SAMPLE_RATE && a4Hz == TUNING_A4_HZ;
+    tuning = firmwareTuning ? tuningTable : makeTuningTable(sampleRate, a4Hz);
+    synthState = SynthState();
+    synthControl = SynthControl();
+    synthControl.volume = volume;
+    synthControl.waveform = waveform;
+    synth_init(synthState, synthControl, sampleRate, tuning);
+}
+
+static bool readScript(const char *path, std::vector<NoteEvent> &events)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+    char line[128];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        lineNumber++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        unsigned timestamp, octave, noteIndex;
+        char type;
+        if (sscanf(line, "%u %c %u %u", &timestamp, &type, &octave, &noteIndex) != 4 ||
+            (type != 'P' && type != 'R') || noteIndex >= 12 || octave > 9)
+        {
+            fprintf(stderr, "%s:%d: expected \"timestamp P|R octave noteIndex\"\n", path, lineNumber);
+            fclose(file);
+            return false;
+        }
+        NoteEvent event = {timestamp, type, (uint8_t)octave, (uint8_t)noteIndex};
+        events.push_back(event);
+    }
+    fclose(file);
+    return true;
+}
+
+static void writeLE(FILE *file, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        fputc((value >> (8 * i)) & 0xff, file);
+}
+
+// Unsigned 8-bit mono, the DAC's own format
+static bool writeWav(const char *path, const std::vector<uint8_t> &samples, uint32_t sampleRate)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+    uint32_t dataSize = (uint32_t)samples.size();
+    fwrite("RIFF", 1, 4, file);
+    writeLE(file, 36 + dataSize, 4);
+    fwrite("WAVEfmt ", 1, 8, file);
+    writeLE(file, 16, 4);
+    writeLE(file, 1, 2); // PCM
+    writeLE(file, 1, 2); // mono
+    writeLE(file, sampleRate, 4);
+    writeLE(file, sampleRate, 4); // byte rate
+    writeLE(file, 1, 2);          // block align
+    writeLE(file, 8, 2);          // bits per sample
+    fwrite("data", 1, 4, file);
+    writeLE(file, dataSize, 4);
+    fwrite(samples.data(), 1, dataSize, file);
+    return fclose(file) == 0;
+}
+
+static double seconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Render up to sample position end in whole blocks where possible, so the
+// envelope runs at the same control rate as on the firmware
+static void renderTo(std::vector<uint8_t> &out, size_t end)
+{
+    while (out.size() < end)
+    {
+        size_t n = end - out.size();
+        if (n > AUDIO_BLOCK_SIZE)
+            n = AUDIO_BLOCK_SIZE;
+        size_t start = out.size();
+        out.resize(start + n);
+        synth_renderBlock(synthState, &out[start], n);
+    }
+}
+
+static int renderScript(const char *scriptPath, const char *outPath, uint32_t sampleRate,
+                        double a4Hz, uint32_t tailMs, uint8_t waveform, uint8_t volume)
+{
+    std::vector<NoteEvent> events;
+    if (!readScript(scriptPath, events))
+        return 1;
+
+    initSynth(sampleRate, a4Hz, waveform, volume);
+    std::vector<uint8_t> samples;
+    uint32_t lastTimestamp = 0;
+    double start = seconds();
+    for (const NoteEvent &event : events)
+    {
+        renderTo(samples, (size_t)event.timestamp * sampleRate / 1000);
+        synth_setGate(synthControl, noteNumber(event.octave, event.noteIndex), event.type == 'P');
+        synth_publish(synthState, synthControl);
+        if (event.timestamp > lastTimestamp)
+            lastTimestamp = event.timestamp;
+    }
+    renderTo(samples, (size_t)(lastTimestamp + tailMs) * sampleRate / 1000);
+    double elapsed = seconds() - start;
+
+    if (!writeWav(outPath, samples, sampleRate))
+        return 1;
+    printf("%s: %zu samples at %u Hz, %.1fx real time\n", outPath, samples.size(), sampleRate,
+           elapsed > 0 ? samples.size() / (double)sampleRate / elapsed : 0.0);
+    return 0;
+}
+
+// Hold a cluster of notes and time the renderer alone
+static int benchmark(uint32_t voices, uint32_t sampleRate, double duration)
+{
+    initSynth(sampleRate, TUNING_A4_HZ, WAVE_SAW, defaultVolume);
+    for (uint32_t i = 0; i < voices && i < SYNTH_MAX_VOICES; i++)
+        synth_setGate(synthControl, (uint8_t)(48 + i), true);
+    synth_publish(synthState, synthControl);
+
+    uint8_t block[AUDIO_BLOCK_SIZE];
+    size_t total = (size_t)(duration * sampleRate);
+    double start = seconds();
+    for (size_t done = 0; done < total; done += AUDIO_BLOCK_SIZE)
+        synth_renderBlock(synthState, block, AUDIO_BLOCK_SIZE);
+    double elapsed = seconds() - start;
+
+    uint32_t sounding = (uint32_t)__builtin_popcount(synthState.voices.activeMask);
+    double rate = total / elapsed;
+    printf("%u voices: %.3g samples/s, %.3g voice-samples/s, %.1fx real time at %u Hz\n",
+           sounding, rate, rate * sounding, rate / sampleRate, sampleRate);
+    return 0;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: render [-r rate] [-a a4_hz] [-o out.wav] [-t tail_ms] [-w waveform] [-v volume] script.txt\n"
+            "       render -b voices [-r rate] [-s seconds]\n");
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t sampleRate = defaultSampleRate;
+    double a4Hz = TUNING_A4_HZ;
+    const char *outPath = "out.wav";
+    uint32_t tailMs = 1000;
+    uint8_t waveform = WAVE_SAW;
+    int volume = defaultVolume;
+    int benchVoices = -1;
+    double benchSeconds = 10;
+    const char *scriptPath = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "-r") && hasValue)
+            sampleRate = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-a") && hasValue)
+            a4Hz = atof(argv[++i]);
+        else if (!strcmp(arg, "-o") && hasValue)
+            outPath = argv[++i];
+        else if (!strcmp(arg, "-t") && hasValue)
+            tailMs = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-w") && hasValue)
+            waveform = (uint8_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-v") && hasValue)
+            volume = atoi(argv[++i]);
+        else if (!strcmp(arg, "-b") && hasValue)
+            benchVoices = atoi(argv[++i]);
+        else if (!strcmp(arg, "-s") && hasValue)
+            benchSeconds = atof(argv[++i]);
+        else if (arg[0] != '-' && !scriptPath)
+            scriptPath = arg;
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+    if (sampleRate < 1000 || a4Hz <= 0 || waveform >= WAVE_COUNT || volume < 0 || volume > 8)
+    {
+        usage();
+        return 2;
+    }
+
+    if (benchVoices >= 0)
+        return benchmark((uint32_t)benchVoices, sampleRate, benchSeconds);
+    if (!scriptPath)
+    {
+        usage();
+        return 2;
+    }
+    return renderScript(scriptPath, outPath, sampleRate, a4Hz, tailMs, waveform, (uint8_t)volume);
+}
@@ -0,0 +1,346 @@
+// Sequencer timing check for Linux: plays a recorded loop through the
+// firmware's looper, sequencer and synth for many passes, block by block as
+// the DMA interrupts do, and checks every note and metronome click started
+// on the exact sample its loop position calls for.
+//
+//   seqsim [-n loops] [-l loop_ms] [-e events] [-o overdub_every] [-u undo_every] [-r rate] [-S seed]
+//
+// Every -o passes a take of -e random presses and releases is overdubbed
+// onto a random track, copied into the spare bank and published as
+// samplerTask does, until the bank is full; every -u passes the last
+// overdub is undone instead. Tracks are muted and soloed at random between
+// blocks. The sample clock starts just short of its 32-bit wrap, so the run
+// crosses it. A player holds one note the loop also plays, and it must keep
+// sounding. After every block, key events of several ages around the
+// start of the pass are placed as sampler_recordEvent does and checked. The
+// exit status is 1 on any error.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "sequencer.h"
+
+static const uint32_t clickSamples = 100; // TICK_DURATION_SAMPLES
+static const uint32_t beatsPerLoop = 8;   // Two bars of 4/4, as the sampler
+static const uint8_t heldNote = 60;       // Held by a player throughout, and in the loop's range
+
+static SynthState synthState;
+static SynthControl synthControl;
+static Sequencer sequencer;
+static TuningTable tuning;
+static LoopBank banks[2]; // As the sampler's
+
+// Tracks heard in each block rendered
+static std::vector<uint8_t> audibleInBlock;
+static uint32_t firstSample;
+
+static bool heard(uint32_t sample, int track)
+{
+    return audibleInBlock[(sample - firstSample) / AUDIO_BLOCK_SIZE] >> track & 1;
+}
+
+struct Expected
+{
+    uint32_t position;
+    uint8_t event;
+    uint8_t track;
+};
+
+// Take positions are in ticks, as sampler_recordEvent makes them
+static void randomTake(std::mt19937 &random, uint32_t loopSamples, int count, std::vector<uint32_t> &take)
+{
+    std::uniform_int_distribution<uint32_t> position(0, sequencer_sampleTick(sequencer, loopSamples - 1));
+    std::uniform_int_distribution<int> note(48, 83);
+    take.clear();
+    for (int i = 0; i < count; i++)
+    {
+        take.push_back(looper_takeEvent(position(random), i % 2 ? 'R' : 'P', (uint8_t)note(random)));
+    }
+    std::stable_sort(take.begin(), take.end(), [](uint32_t a, uint32_t b) { return a >> 8 < b >> 8; });
+}
+
+// Every event in the order the sequencer plays them: by position in samples,
+// then by track, then as stored
+static std::vector<Expected> decode(const LoopBank &bank)
+{
+    std::vector<Expected> events;
+    for (int t = 0; t < LOOPER_TRACKS; t++)
+    {
+        uint16_t i = looper_trackStart(bank, t);
+        uint32_t tick = 0;
+        while (i < bank.end[t])
+        {
+            uint8_t event = looper_next(bank.data, i, tick);
+            events.push_back({sequencer_tickSample(sequencer, tick), event, (uint8_t)t});
+        }
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const Expected &a, const Expected &b) { return a.position < b.position; });
+    return events;
+}
+
+// Where sampler_recordEvent places a key event of some age, around the start
+// of the pass and a block either side, against the position counted from the
+// first sample rendered
+static uint64_t checkPlacement(uint32_t loopSamples, uint64_t &placed)
+{
+    uint64_t errors = 0;
+    uint32_t sinceStart = synthState.samples - sequencer.loopStart;
+    const int64_t offsets[] = {-AUDIO_BLOCK_SIZE - 1, -1, 0, 1, AUDIO_BLOCK_SIZE, 1000};
+    for (int64_t offset : offsets)
+    {
+        int64_t age = (int64_t)sinceStart + offset;
+        uint32_t elapsed = synthState.samples - firstSample;
+        if (age < 0 || age > elapsed)
+            continue;
+        uint32_t want = (uint32_t)(elapsed - age) % loopSamples;
+        uint32_t position = sequencer_positionAgo(sequencer, synthState, (uint32_t)age);
+        if (position != want)
+        {
+            if (errors < 10)
+                printf("event %lld samples before sample %u placed at %u, want %u\n", (long long)age,
+                       synthState.samples, position, want);
+            errors++;
+        }
+        placed++;
+    }
+    return errors;
+}
+
+// Presses on tracks not heard when they fall due are skipped
+static void skipMuted(const std::vector<Expected> &pass, uint32_t loopStart, size_t &checked, uint64_t &skipped)
+{
+    while (checked < pass.size() && !(pass[checked].event & LOOPER_RELEASE) &&
+           !heard(loopStart + pass[checked].position, pass[checked].track))
+    {
+        checked++;
+        skipped++;
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: seqsim [-n loops] [-l loop_ms] [-e events] [-o overdub_every] [-u undo_every] [-r rate] [-S seed]\n");
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t loops = 10000;
+    uint32_t loopMs = 400;
+    int events = 16;
+    uint32_t overdubEvery = 10;
+    uint32_t undoEvery = 70;
+    uint32_t sampleRate = SYNTH_SAMPLE_RATE;
+    uint32_t seed = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(arg, "-n") && hasValue)
+            loops = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-l") && hasValue)
+            loopMs = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-e") && hasValue)
+            events = atoi(argv[++i]);
+        else if (!strcmp(arg, "-o") && hasValue)
+            overdubEvery = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-u") && hasValue)
+            undoEvery = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-r") && hasValue)
+            sampleRate = (uint32_t)atoi(argv[++i]);
+        else if (!strcmp(arg, "-S") && hasValue)
+            seed = (uint32_t)atoi(argv[++i]);
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+    uint32_t loopSamples = (uint32_t)((uint64_t)loopMs * sampleRate / 1000);
+    uint32_t beatSamples = loopSamples / beatsPerLoop;
+    if (loops == 0 || events < 0 || beatSamples == 0 || loopSamples >= 1UL << 24)
+    {
+        usage();
+        return 2;
+    }
+
+    tuning = sampleRate == SYNTH_SAMPLE_RATE ? tuningTable : makeTuningTable(sampleRate, TUNING_A4_HZ);
+    synthControl.volume = 8;
+    synth_init(synthState, synthControl, sampleRate, tuning);
+    sequencer_init(sequencer, sampleRate, loopMs * SEQUENCER_TICK_HZ / 1000, beatSamples, clickSamples);
+    loopSamples = sequencer.loopSamples;
+    synthState.samples = 0u - loops / 2 * loopSamples - 12345;
+
+    // A player holds a key the loop also plays; the loop must never cut it
+    synthState.voices.policy = STEAL_LOWEST_PRIORITY;
+    synth_setGate(synthControl, heldNote, true);
+    synth_publish(synthState, synthControl);
+
+    // The first take goes on track 0
+    std::mt19937 random(seed);
+    int current = 0;
+    bool canUndo = false;
+    std::vector<uint32_t> take;
+    looper_clear(banks[1]);
+    randomTake(random, loopSamples, events, take);
+    looper_overdub(banks[1], 0, take.data(), (int)take.size(), banks[current]);
+    sequencer_publish(sequencer, &banks[current], true);
+
+    // What each pass should play: the bank published before it began
+    std::deque<std::vector<Expected>> expected;
+    expected.push_back(decode(banks[current]));
+    uint32_t loopStart = synthState.samples;
+    firstSample = loopStart;
+    size_t checked = 0;
+    uint32_t beatLoopStart = loopStart;
+    uint32_t nextBeat = 0;
+    uint32_t seenBeat = sequencer.lastBeat;
+    uint32_t seenLoops = 0;
+
+    uint64_t placed = 0;
+    uint64_t played = 0, skipped = 0, beats = 0, overdubs = 0, undos = 0, full = 0, errors = 0;
+    size_t mostBytes = 0, mostEvents = 0;
+    int64_t worst = 0;
+    uint8_t block[AUDIO_BLOCK_SIZE];
+    std::uniform_int_distribution<int> track(0, LOOPER_TRACKS - 1);
+    std::uniform_int_distribution<int> toggle(0, 255);
+    while (sequencer.loops < loops)
+    {
+        // Now and then mute or solo a track, as a knob press would
+        int roll = toggle(random);
+        if (roll == 0)
+            sequencer.muted ^= 1 << track(random);
+        else if (roll == 1)
+            sequencer.soloed ^= 1 << track(random);
+        audibleInBlock.push_back(sequencer.soloed ? sequencer.soloed : (uint8_t)~sequencer.muted);
+
+        sequencer_render(sequencer, synthState, block, AUDIO_BLOCK_SIZE);
+        errors += checkPlacement(loopSamples, placed);
+        int held = voice_find(synthState.voices, heldNote);
+        if (held < 0 || synthState.voices.envStage[held] == ENV_RELEASE)
+        {
+            if (errors < 10)
+                printf("held note %u released by playback at sample %u\n", heldNote, synthState.samples);
+            errors++;
+        }
+
+        // A new pass takes up the bank last published
+        bool wrapped = sequencer.loops != seenLoops;
+        if (wrapped)
+        {
+            seenLoops = sequencer.loops;
+            expected.push_back(decode(banks[current]));
+        }
+
+        // A block can end one pass and begin the next
+        NoteEvent event;
+        while (sequencer.played.pop(0, event))
+        {
+            while (event.timestamp - loopStart >= loopSamples && expected.size() > 1)
+            {
+                skipMuted(expected.front(), loopStart, checked, skipped);
+                if (checked != expected.front().size())
+                {
+                    printf("pass from sample %u: %zu of %zu events played\n", loopStart, checked,
+                           expected.front().size());
+                    errors++;
+                }
+                expected.pop_front();
+                loopStart += loopSamples;
+                checked = 0;
+            }
+
+            const std::vector<Expected> &pass = expected.front();
+            skipMuted(pass, loopStart, checked, skipped);
+            if (checked >= pass.size())
+            {
+                printf("extra event at sample %u\n", event.timestamp);
+                errors++;
+                continue;
+            }
+            const Expected &want = pass[checked++];
+            uint32_t due = loopStart + want.position;
+            int64_t error = (int32_t)(event.timestamp - due);
+            uint8_t note = noteNumber(event.octave, event.noteIndex);
+            bool release = want.event & LOOPER_RELEASE;
+            if (error || (event.type == 'R') != release || note != (want.event & LOOPER_NOTE_MASK))
+            {
+                if (errors < 10)
+                    printf("event %zu at sample %u, due %u\n", checked - 1, event.timestamp, due);
+                errors++;
+            }
+            if (llabs(error) > worst)
+                worst = llabs(error);
+            played++;
+        }
+
+        // Clicks fall on the beats of each pass, the first on its first sample
+        if (sequencer.lastBeat != seenBeat)
+        {
+            seenBeat = sequencer.lastBeat;
+            if (seenBeat - beatLoopStart >= loopSamples)
+            {
+                beatLoopStart += loopSamples;
+                nextBeat = 0;
+            }
+            uint32_t due = beatLoopStart + nextBeat;
+            int64_t error = (int32_t)(seenBeat - due);
+            if (error)
+            {
+                if (errors < 10)
+                    printf("click at sample %u, due %u\n", seenBeat, due);
+                errors++;
+            }
+            if (llabs(error) > worst)
+                worst = llabs(error);
+            nextBeat += beatSamples;
+            beats++;
+        }
+
+        // Once a new pass has begun the other bank is free, as in samplerTask
+        if (wrapped && undoEvery && seenLoops % undoEvery == 0 && canUndo)
+        {
+            current = 1 - current;
+            canUndo = false;
+            sequencer_publish(sequencer, &banks[current], true);
+            undos++;
+        }
+        else if (wrapped && overdubEvery && seenLoops % overdubEvery == 0)
+        {
+            randomTake(random, loopSamples, events, take);
+            int spare = 1 - current;
+            if (looper_overdub(banks[current], track(random), take.data(), (int)take.size(), banks[spare]))
+            {
+                current = spare;
+                canUndo = true;
+                sequencer_publish(sequencer, &banks[current], true);
+                overdubs++;
+                mostBytes = std::max(mostBytes, (size_t)looper_used(banks[current]));
+                mostEvents = std::max(mostEvents, decode(banks[current]).size());
+            }
+            else
+                full++;
+        }
+    }
+    if (sequencer.played.overflows(0))
+    {
+        printf("%u played events lost from the ring\n", sequencer.played.overflows(0));
+        errors++;
+    }
+
+    printf("%u loops of %u samples at %u Hz: %llu overdubs, %llu undone, %llu refused with the bank full\n",
+           loops, loopSamples, sampleRate, (unsigned long long)overdubs, (unsigned long long)undos,
+           (unsigned long long)full);
+    printf("largest loop %zu events in %zu bytes, %.2f bytes an event\n", mostEvents, mostBytes,
+           mostEvents ? (double)mostBytes / mostEvents : 0.0);
+    printf("%llu events played, %llu presses muted, %llu clicks, %llu key events placed: worst error %lld samples, %llu errors\n",
+           (unsigned long long)played, (unsigned long long)skipped, (unsigned long long)beats,
+           (unsigned long long)placed, (long long)worst, (unsigned long long)errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,290 @@
+#include "vcan.h"
+
+#include <string.h>
+
+using std::chrono::steady_clock;
+
+VirtualCanBus::VirtualCanBus(uint32_t bitRate) : bitRate(bitRate)
+{
+}
+
+VirtualCanBus::~VirtualCanBus()
+{
+    stop();
+    for (Node *node : nodes)
+        delete node;
+}
+
+int VirtualCanBus::addNode()
+{
+    Node *node = new Node();
+    node->westOut = true;
+    node->eastOut = true;
+    node->plugged = true;
+    nodes.push_back(node);
+    return (int)nodes.size() - 1;
+}
+
+void VirtualCanBus::start()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    running = true;
+    startTime = steady_clock::now();
+    thread = std::thread(&VirtualCanBus::run, this);
+}
+
+void VirtualCanBus::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!running)
+            return;
+        running = false;
+    }
+    wake.notify_all();
+    thread.join();
+}
+
+bool VirtualCanBus::tryTx(int node, uint32_t id, const uint8_t data[8], uint32_t &mailbox)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Mailbox *mailboxes = nodes[node]->mailboxes;
+    for (int m = 0; m < VCAN_MAILBOXES; m++)
+    {
+        if (mailboxes[m].pending)
+            continue;
+        mailboxes[m].pending = true;
+        mailboxes[m].id = id & 0x7ff;
+        memcpy(mailboxes[m].data, data, 8);
+        mailboxes[m].sequence = sequence++;
+        mailbox = 1u << m;
+        wake.notify_all();
+        return true;
+    }
+    return false;
+}
+
+bool VirtualCanBus::txPending(int node, uint32_t mailbox)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (int m = 0; m < VCAN_MAILBOXES; m++)
+    {
+        if (mailbox == 1u << m)
+            return nodes[node]->mailboxes[m].pending;
+    }
+    return false;
+}
+
+uint32_t VirtualCanBus::rxLevel(int node)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return nodes[node]->fifoCount;
+}
+
+bool VirtualCanBus::rx(int node, uint32_t &id, uint8_t data[8])
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Node &n = *nodes[node];
+    if (!n.fifoCount)
+        return false;
+    id = n.fifoId[n.fifoHead];
+    memcpy(data, n.fifoData[n.fifoHead], 8);
+    n.fifoHead = (n.fifoHead + 1) % VCAN_RX_FIFO_DEPTH;
+    n.fifoCount--;
+    return true;
+}
+
+bool VirtualCanBus::rxOverrun(int node)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bool overrun = nodes[node]->overrun;
+    nodes[node]->overrun = false;
+    return overrun;
+}
+
+void VirtualCanBus::registerRxIsr(int node, std::function<void()> isr)
+{
+    std::lock_guard<std::mutex> irq(nodes[node]->irq);
+    nodes[node]->rxIsr = isr;
+}
+
+void VirtualCanBus::registerTxIsr(int node, std::function<void()> isr)
+{
+    std::lock_guard<std::mutex> irq(nodes[node]->irq);
+    nodes[node]->txIsr = isr;
+}
+
+std::mutex &VirtualCanBus::interruptLock(int node)
+{
+    return nodes[node]->irq;
+}
+
+void VirtualCanBus::setHandshakeOutputs(int node, bool west, bool east)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    nodes[node]->westOut = west;
+    nodes[node]->eastOut = east;
+}
+
+void VirtualCanBus::readHandshake(int node, bool &west, bool &east)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bool plugged = nodes[node]->plugged;
+    west = !(plugged && node > 0 && nodes[node - 1]->plugged && nodes[node - 1]->eastOut);
+    east = !(plugged && node + 1 < (int)nodes.size() && nodes[node + 1]->plugged && nodes[node + 1]->westOut);
+}
+
+void VirtualCanBus::setPlugged(int node, bool plugged)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    nodes[node]->plugged = plugged;
+    wake.notify_all();
+}
+
+double VirtualCanBus::utilisation() const
+{
+    double elapsed = std::chrono::duration<double>(steady_clock::now() - startTime).count();
+    return elapsed > 0 ? busyBits / (double)bitRate / elapsed : 0;
+}
+
+uint32_t VirtualCanBus::frameBits(uint32_t id, const uint8_t data[8])
+{
+    // SOF, 11-bit ID, RTR, IDE, r0, DLC = 8, then the data
+    uint8_t bits[128];
+    int n = 0;
+    bits[n++] = 0;
+    for (int i = 10; i >= 0; i--)
+        bits[n++] = (id >> i) & 1;
+    bits[n++] = 0;
+    bits[n++] = 0;
+    bits[n++] = 0;
+    for (int i = 3; i >= 0; i--)
+        bits[n++] = (8 >> i) & 1;
+    for (int byte = 0; byte < 8; byte++)
+    {
+        for (int i = 7; i >= 0; i--)
+            bits[n++] = (data[byte] >> i) & 1;
+    }
+
+    uint16_t crc = 0;
+    for (int i = 0; i < n; i++)
+    {
+        bool feedback = bits[i] ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7fff;
+        if (feedback)
+            crc ^= 0x4599;
+    }
+    for (int i = 14; i >= 0; i--)
+        bits[n++] = (crc >> i) & 1;
+
+    // A stuff bit follows every five equal bits, and starts the next run
+    int stuffed = 0;
+    int run = 0;
+    int last = -1;
+    for (int i = 0; i < n; i++)
+    {
+        if (bits[i] == last)
+        {
+            run++;
+        }
+        else
+        {
+            last = bits[i];
+            run = 1;
+        }
+        if (run == 5)
+        {
+            stuffed++;
+            last = !last;
+            run = 1;
+        }
+    }
+
+    // CRC delimiter, ACK slot and delimiter, EOF, interframe space
+    return n + stuffed + 1 + 2 + 7 + 3;
+}
+
+void VirtualCanBus::run()
+{
+    steady_clock::time_point wireFree = steady_clock::now();
+    std::unique_lock<std::mutex> guard(lock);
+    while (running)
+    {
+        // Lowest ID wins arbitration
+        int senderIndex = -1;
+        int mailboxIndex = -1;
+        int plugged = 0;
+        for (int n = 0; n < (int)nodes.size(); n++)
+        {
+            if (!nodes[n]->plugged)
+                continue;
+            plugged++;
+            for (int m = 0; m < VCAN_MAILBOXES; m++)
+            {
+                const Mailbox &mailbox = nodes[n]->mailboxes[m];
+                if (!mailbox.pending)
+                    continue;
+                if (senderIndex >= 0)
+                {
+                    const Mailbox &best = nodes[senderIndex]->mailboxes[mailboxIndex];
+                    if (mailbox.id > best.id || (mailbox.id == best.id && mailbox.sequence > best.sequence))
+                        continue;
+                }
+                senderIndex = n;
+                mailboxIndex = m;
+            }
+        }
+        // With nobody to acknowledge it a frame never completes
+        if (senderIndex < 0 || plugged < 2)
+        {
+            wake.wait(guard);
+            continue;
+        }
+
+        Mailbox frame = nodes[senderIndex]->mailboxes[mailboxIndex];
+        uint32_t bits = frameBits(frame.id, frame.data);
+        guard.unlock();
+        steady_clock::time_point now = steady_clock::now();
+        steady_clock::time_point start = wireFree > now ? wireFree : now;
+        wireFree = start + std::chrono::nanoseconds((uint64_t)bits * 1000000000 / bitRate);
+        std::this_thread::sleep_until(wireFree);
+        guard.lock();
+
+        nodes[senderIndex]->mailboxes[mailboxIndex].pending = false;
+        for (int n = 0; n < (int)nodes.size(); n++)
+        {
+            if (n == senderIndex || !nodes[n]->plugged)
+                continue;
+            Node &node = *nodes[n];
+            if (node.fifoCount == VCAN_RX_FIFO_DEPTH)
+            {
+                // Without FIFO locking the newest message is overwritten
+                node.overrun = true;
+                node.fifoCount--;
+            }
+            int slot = (node.fifoHead + node.fifoCount) % VCAN_RX_FIFO_DEPTH;
+            node.fifoId[slot] = frame.id;
+            memcpy(node.fifoData[slot], frame.data, 8);
+            node.fifoCount++;
+        }
+        frames++;
+        busyBits += bits;
+        guard.unlock();
+
+        for (int n = 0; n < (int)nodes.size(); n++)
+        {
+            Node &node = *nodes[n];
+            std::lock_guard<std::mutex> irq(node.irq);
+            if (n == senderIndex)
+            {
+                if (node.txIsr)
+                    node.txIsr();
+            }
+            else if (node.rxIsr)
+            {
+                node.rxIsr();
+            }
+        }
+        guard.lock();
+    }
+}
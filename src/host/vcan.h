@@ -0,0 +1,106 @@
+#ifndef VCAN_H
+#define VCAN_H
+
+// In-process CAN bus for host simulations. Each node has the controller's
+// three transmit mailboxes and three-deep receive FIFO, with the same
+// operations as lib/ES_CAN, and the west/east handshake lines of a module
+// wired to its neighbours. A bus thread arbitrates pending mailboxes by ID
+// and holds each frame for its real length at the bit rate, stuff bits
+// included, then calls the nodes' RX and TX interrupt handlers.
+//
+// Handlers run on the bus thread with the node's interrupt lock held;
+// node code masks them by holding the same lock, as taskENTER_CRITICAL
+// does on the board.
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define VCAN_MAILBOXES 3
+#define VCAN_RX_FIFO_DEPTH 3
+
+class VirtualCanBus
+{
+public:
+    explicit VirtualCanBus(uint32_t bitRate);
+    ~VirtualCanBus();
+
+    // Nodes are numbered from the west end of the chain, in order added.
+    // All must be added before start().
+    int addNode();
+    void start();
+    void stop();
+
+    // As CAN_TryTX: false when every mailbox is busy. Mailboxes are 1, 2, 4
+    // like the HAL's.
+    bool tryTx(int node, uint32_t id, const uint8_t data[8], uint32_t &mailbox);
+    bool txPending(int node, uint32_t mailbox);
+    uint32_t rxLevel(int node);
+    bool rx(int node, uint32_t &id, uint8_t data[8]);
+    bool rxOverrun(int node); // Clears the flag, as CAN_RXOverrun
+
+    void registerRxIsr(int node, std::function<void()> isr);
+    void registerTxIsr(int node, std::function<void()> isr);
+    std::mutex &interruptLock(int node);
+
+    // Each output, when on, drives the facing input of the neighbour. Inputs
+    // read true when nothing drives them, as the FET inverts.
+    void setHandshakeOutputs(int node, bool west, bool east);
+    void readHandshake(int node, bool &west, bool &east);
+
+    // An unplugged node is off the bus and its handshake lines are open.
+    // Nodes start plugged in.
+    void setPlugged(int node, bool plugged);
+
+    uint64_t framesSent() const { return frames; }
+    double utilisation() const; // Busy fraction since start()
+
+    // Bits on the wire for a standard 8-byte data frame, from SOF to the end
+    // of interframe space
+    static uint32_t frameBits(uint32_t id, const uint8_t data[8]);
+
+private:
+    struct Mailbox
+    {
+        bool pending;
+        uint32_t id;
+        uint8_t data[8];
+        uint64_t sequence; // Equal IDs go in the order queued
+    };
+
+    struct Node
+    {
+        Mailbox mailboxes[VCAN_MAILBOXES];
+        uint32_t fifoId[VCAN_RX_FIFO_DEPTH];
+        uint8_t fifoData[VCAN_RX_FIFO_DEPTH][8];
+        uint8_t fifoHead;
+        uint8_t fifoCount;
+        bool overrun;
+        bool westOut;
+        bool eastOut;
+        bool plugged;
+        std::function<void()> rxIsr;
+        std::function<void()> txIsr;
+        std::mutex irq;
+    };
+
+    void run();
+
+    uint32_t bitRate;
+    std::vector<Node *> nodes;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread thread;
+    bool running = false;
+    uint64_t sequence = 0;
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> busyBits{0};
+    std::chrono::steady_clock::time_point startTime;
+};
+
+#endif
@@ -1,60 +1,42 @@
 #include "isr.h"
 #include "globals.h"
+#include "mix.h"
+#include "joystick.h"
 
-// --------- The 22kHz Audio ISR --------------------
-void sampleISR()
+// Render from the latest published synthControl snapshot, with the
+// sequencer playing the loop and starting metronome clicks on their exact
+// samples. The click countdown is handed back through the globals so the
+// WCET tests can drive it. The joystick is read here so bend and modulation
+// update at the block rate.
+void renderAudioBlock(uint8_t *out, size_t n)
 {
-    phaseAcc1 += currentStepSize1;
-    phaseAcc2 += currentStepSize2;
-    phaseAcc3 += currentStepSize3;
-    phaseAcc4 += currentStepSize4;
-    phaseAcc5 += currentStepSize5;
-    int32_t Vout = ((phaseAcc1 >> 24) + (phaseAcc2 >> 24) + (phaseAcc3 >> 24) + (phaseAcc4 >> 24) + (phaseAcc5 >> 24)) / 5 - 128;
+    synthState.clickActive = metronomeActive;
+    synthState.clickCounter = metronomeCounter;
+    joystick_read(synthState.pitchBend, synthState.modulation);
 
-    int volumeLevel = sysState.volume;
-    Vout = Vout >> (8 - volumeLevel);
+    sequencer_render(sequencer, synthState, out, n);
 
-    // not activating metronome
+    metronomeCounter = synthState.clickCounter;
+    metronomeActive = synthState.clickActive;
+}
 
-    if (metronomeActive)
-    {
-        // Here, we simply add a constant amplitude. For a more natural click,
-        // you could apply a decaying envelope.
-        Vout += TICK_AMPLITUDE;
-        // Decrement the tick counter:
-        if (metronomeCounter > 0)
-            metronomeCounter--;
-        else
-            metronomeActive = false;
-    }
+// --------- The 22kHz Audio ISR --------------------
+// Per-sample reference path; normal builds stream blocks through audio.cpp
+void sampleISR()
+{
+    uint8_t Vout;
+    renderAudioBlock(&Vout, 1);
     // Output on e.g. OUTR_PIN = A3
-    analogWrite(A3, Vout + 128);
+    analogWrite(A3, Vout);
 }
 
 void sampleISRTest()//WCET test function
 {
     uint32_t startTime = micros();
 
-    phaseAcc1 += currentStepSize1;
-    phaseAcc2 += currentStepSize2;
-    phaseAcc3 += currentStepSize3;
-    phaseAcc4 += currentStepSize4;
-    phaseAcc5 += currentStepSize5;
-    int32_t Vout = ((phaseAcc1 >> 24) + (phaseAcc2 >> 24) + (phaseAcc3 >> 24) + (phaseAcc4 >> 24) + (phaseAcc5 >> 24)) / 5 - 128;
-
-    int volumeLevel = sysState.volume;
-    Vout = Vout >> (8 - volumeLevel);
-
-    if (metronomeActive)
-    {
-        Vout += TICK_AMPLITUDE;
-        if (metronomeCounter > 0)
-            metronomeCounter--;
-        else
-            metronomeActive = false;
-    }
-
-    analogWrite(A3, Vout + 128);
+    uint8_t Vout;
+    renderAudioBlock(&Vout, 1);
+    analogWrite(A3, Vout);
 
     uint32_t endTime = micros();
     uint32_t isrDuration = endTime - startTime;
@@ -73,3 +55,65 @@ void sampleISRTest()//WCET test function
         Serial.println(" µs");
     }
 }
+
+void mixKernelFunction(void *pvParameters)//mix kernel fuzz and benchmark test function
+{
+    alignas(4) static int16_t a[AUDIO_BLOCK_SIZE];
+    alignas(4) static int16_t b[AUDIO_BLOCK_SIZE];
+    static int32_t accKernel[AUDIO_BLOCK_SIZE];
+    static int32_t accPortable[AUDIO_BLOCK_SIZE];
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    uint32_t seed = 0x12345678;
+    uint32_t iterations = 0;
+    uint32_t mismatches = 0;
+    uint32_t kernelCycles = 0;
+    uint32_t portableCycles = 0;
+    while (1)
+    {
+        for (int i = 0; i < AUDIO_BLOCK_SIZE; i++)
+        {
+            // xorshift32
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            a[i] = (int16_t)seed;
+            b[i] = (int16_t)(seed >> 16);
+            accKernel[i] = accPortable[i] = (int32_t)(seed * 2654435761u);
+        }
+        int16_t gainA = (int16_t)(seed & 0x7fff);
+        int16_t gainB = (int16_t)((seed >> 15) & 0x7fff);
+        // Ramp towards random targets so the gains stay within Q15
+        int16_t stepA = (int16_t)(((int32_t)(seed >> 7 & 0x7fff) - gainA) / AUDIO_BLOCK_SIZE);
+        int16_t stepB = (int16_t)(((int32_t)(seed >> 3 & 0x7fff) - gainB) / AUDIO_BLOCK_SIZE);
+
+        uint32_t t0 = DWT->CYCCNT;
+        mix_accumulatePair(accKernel, a, b, gainA, gainB, stepA, stepB, AUDIO_BLOCK_SIZE);
+        uint32_t t1 = DWT->CYCCNT;
+        mix_accumulatePairPortable(accPortable, a, b, gainA, gainB, stepA, stepB, AUDIO_BLOCK_SIZE);
+        uint32_t t2 = DWT->CYCCNT;
+
+        kernelCycles += t1 - t0;
+        portableCycles += t2 - t1;
+        if (memcmp(accKernel, accPortable, sizeof(accKernel)) != 0)
+        {
+            mismatches++;
+        }
+
+        if (++iterations % 1000 == 0)
+        {
+            Serial.print("Mix kernel cycles/block: ");
+            Serial.print(kernelCycles / 1000);
+            Serial.print(" portable: ");
+            Serial.print(portableCycles / 1000);
+            Serial.print(" mismatches: ");
+            Serial.println(mismatches);
+            kernelCycles = 0;
+            portableCycles = 0;
+            vTaskDelay(pdMS_TO_TICKS(1));
+        }
+    }
+}
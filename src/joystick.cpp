@@ -0,0 +1,140 @@
+#include "joystick.h"
+#include "globals.h"
+
+// One-pole low-pass run once per audio block: a shift of 3 gives a time
+// constant of 8 blocks, about 23 ms at 22 kHz
+#define JOYSTICK_FILTER_SHIFT 3
+#define JOYSTICK_FRAC_BITS 4 // Filter state is the 12-bit reading in Q4
+
+// In ADC counts: movement ignored around the rest position, and the
+// deflection that reads as full scale
+#define JOYSTICK_DEAD_ZONE 48
+#define JOYSTICK_SPAN 1900
+
+// Written by the DMA, X then Y. 0xffff until the first conversion, which a
+// 12-bit result can never be.
+static volatile uint16_t joystickSamples[2] = {0xffff, 0xffff};
+
+static ADC_HandleTypeDef ADC_Handle;
+static DMA_HandleTypeDef DMA_ADC_Handle;
+
+static int32_t filtered[2];
+static int32_t centre[2];
+static bool calibrated = false;
+
+void joystick_init()
+{
+    RCC_PeriphCLKInitTypeDef clockConfig = {};
+    clockConfig.PeriphClockSelection = RCC_PERIPHCLK_ADC;
+    clockConfig.AdcClockSelection = RCC_ADCCLKSOURCE_SYSCLK;
+    HAL_RCCEx_PeriphCLKConfig(&clockConfig);
+
+    __HAL_RCC_ADC_CLK_ENABLE();
+    __HAL_RCC_DMA2_CLK_ENABLE();
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+
+    // JOYY_PIN (A0) is PA0, ADC1_IN5; JOYX_PIN (A1) is PA1, ADC1_IN6
+    GPIO_InitTypeDef GPIO_InitJoystick = {
+        GPIO_PIN_0 | GPIO_PIN_1,
+        GPIO_MODE_ANALOG,
+        GPIO_NOPULL,
+        GPIO_SPEED_FREQ_LOW};
+    HAL_GPIO_Init(GPIOA, &GPIO_InitJoystick);
+
+    // DMA2 channel 3, request 0 is ADC1. DMA1 channel 1 would also do but
+    // carries the key matrix captures.
+    DMA_ADC_Handle.Instance = DMA2_Channel3;
+    DMA_ADC_Handle.Init.Request = DMA_REQUEST_0;
+    DMA_ADC_Handle.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    DMA_ADC_Handle.Init.PeriphInc = DMA_PINC_DISABLE;
+    DMA_ADC_Handle.Init.MemInc = DMA_MINC_ENABLE;
+    DMA_ADC_Handle.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+    DMA_ADC_Handle.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+    DMA_ADC_Handle.Init.Mode = DMA_CIRCULAR;
+    DMA_ADC_Handle.Init.Priority = DMA_PRIORITY_LOW;
+    HAL_DMA_Init(&DMA_ADC_Handle);
+
+    // Continuous conversions of both channels. At 20 MHz with the longest
+    // sampling time and 16x oversampling each axis updates about 950 times a
+    // second, several times per audio block.
+    ADC_Handle.Instance = ADC1;
+    ADC_Handle.Init.ClockPrescaler = ADC_CLOCK_ASYNC_DIV4;
+    ADC_Handle.Init.Resolution = ADC_RESOLUTION_12B;
+    ADC_Handle.Init.DataAlign = ADC_DATAALIGN_RIGHT;
+    ADC_Handle.Init.ScanConvMode = ADC_SCAN_ENABLE;
+    ADC_Handle.Init.EOCSelection = ADC_EOC_SEQ_CONV;
+    ADC_Handle.Init.LowPowerAutoWait = DISABLE;
+    ADC_Handle.Init.ContinuousConvMode = ENABLE;
+    ADC_Handle.Init.NbrOfConversion = 2;
+    ADC_Handle.Init.DiscontinuousConvMode = DISABLE;
+    ADC_Handle.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+    ADC_Handle.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
+    ADC_Handle.Init.DMAContinuousRequests = ENABLE;
+    ADC_Handle.Init.Overrun = ADC_OVR_DATA_OVERWRITTEN;
+    // Sum 16 conversions and shift back to 12 bits
+    ADC_Handle.Init.OversamplingMode = ENABLE;
+    ADC_Handle.Init.Oversampling.Ratio = ADC_OVERSAMPLING_RATIO_16;
+    ADC_Handle.Init.Oversampling.RightBitShift = ADC_RIGHTBITSHIFT_4;
+    ADC_Handle.Init.Oversampling.TriggeredMode = ADC_TRIGGEREDMODE_SINGLE_TRIGGER;
+    ADC_Handle.Init.Oversampling.OversamplingStopReset = ADC_REGOVERSAMPLING_CONTINUED_MODE;
+    HAL_ADC_Init(&ADC_Handle);
+    __HAL_LINKDMA(&ADC_Handle, DMA_Handle, DMA_ADC_Handle);
+
+    ADC_ChannelConfTypeDef channelConfig = {};
+    channelConfig.SamplingTime = ADC_SAMPLETIME_640CYCLES_5;
+    channelConfig.SingleDiff = ADC_SINGLE_ENDED;
+    channelConfig.OffsetNumber = ADC_OFFSET_NONE;
+    channelConfig.Channel = ADC_CHANNEL_6; // X
+    channelConfig.Rank = ADC_REGULAR_RANK_1;
+    HAL_ADC_ConfigChannel(&ADC_Handle, &channelConfig);
+    channelConfig.Channel = ADC_CHANNEL_5; // Y
+    channelConfig.Rank = ADC_REGULAR_RANK_2;
+    HAL_ADC_ConfigChannel(&ADC_Handle, &channelConfig);
+
+    HAL_ADCEx_Calibration_Start(&ADC_Handle, ADC_SINGLE_ENDED);
+    // The DMA interrupts this enables stay masked in the NVIC
+    HAL_ADC_Start_DMA(&ADC_Handle, (uint32_t *)joystickSamples, 2);
+}
+
+// Deflection from centre as Q15 of JOYSTICK_SPAN, outside the dead zone
+static int32_t deflection(int axis)
+{
+    int32_t offset = (filtered[axis] - centre[axis]) >> JOYSTICK_FRAC_BITS;
+    int32_t magnitude = offset < 0 ? -offset : offset;
+    if (magnitude <= JOYSTICK_DEAD_ZONE)
+        return 0;
+    magnitude -= JOYSTICK_DEAD_ZONE;
+    if (magnitude > JOYSTICK_SPAN - JOYSTICK_DEAD_ZONE)
+        magnitude = JOYSTICK_SPAN - JOYSTICK_DEAD_ZONE;
+    int32_t value = magnitude * 32767 / (JOYSTICK_SPAN - JOYSTICK_DEAD_ZONE);
+    return offset < 0 ? -value : value;
+}
+
+void joystick_read(int16_t &pitchBend, int16_t &modulation)
+{
+    uint16_t x = joystickSamples[0];
+    uint16_t y = joystickSamples[1];
+    if (x == 0xffff || y == 0xffff)
+    {
+        pitchBend = 0;
+        modulation = 0;
+        return;
+    }
+
+    int32_t sample[2] = {(int32_t)x << JOYSTICK_FRAC_BITS, (int32_t)y << JOYSTICK_FRAC_BITS};
+    for (int axis = 0; axis < 2; axis++)
+    {
+        if (!calibrated)
+        {
+            // The stick is taken to be at rest at power-up
+            filtered[axis] = sample[axis];
+            centre[axis] = sample[axis];
+        }
+        filtered[axis] += (sample[axis] - filtered[axis]) >> JOYSTICK_FILTER_SHIFT;
+    }
+    calibrated = true;
+
+    pitchBend = (int16_t)deflection(0);
+    int32_t depth = deflection(1);
+    modulation = (int16_t)(depth < 0 ? -depth : depth);
+}
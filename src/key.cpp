@@ -1,418 +1,386 @@
 #include "key.h"     // Corresponding header
-#include "globals.h" // For global variables, e.g., sysState, keys4, ...
+#include "globals.h" // For global variables, e.g., sysState, moduleKeys, ...
 #include "pins.h"    // For pin definitions (RA0_PIN, etc.)
 #include "sampler.h"
 #include "autodetection.h"
+#include "matrix.h"
+#include "debounce.h"
+#include "knob.h"
+#include "canframe.h"
+#include "canlink.h"
+#include "can.h"
 #include <bitset>
 
-#include <vector>
-#include <bitset>
 #include <stdint.h>
-#define MAX_VOICES 5
 
 uint32_t scanKeysIterations = 0;
 TickType_t scanKeysStartTime = 0;
 
-enum KeyboardType
+// Key edges set a gate bit in synthControl and publish it; the renderer picks
+// the change up at its next block. voiceMutex only orders the writer tasks,
+// the audio interrupt never takes it.
+void noteOn(uint8_t octave, uint8_t noteIndex)
 {
-    KEYBOARD_4,
-    KEYBOARD_5,
-    KEYBOARD_6
-};
+    if (noteIndex >= 12)
+        return;
+    if (xSemaphoreTake(voiceMutex, portMAX_DELAY) == pdTRUE)
+    {
+        synth_setGate(synthControl, noteNumber(octave, noteIndex), true);
+        synth_publish(synthState, synthControl);
+        xSemaphoreGive(voiceMutex);
+    }
+}
 
-struct NoteRef
+void noteOff(uint8_t octave, uint8_t noteIndex)
 {
-    KeyboardType kb; // Which keyboard: C4, C5, or C6
-    uint8_t noteIdx; // Note index (0..11)
-};
+    if (noteIndex >= 12)
+        return;
+    if (xSemaphoreTake(voiceMutex, portMAX_DELAY) == pdTRUE)
+    {
+        synth_setGate(synthControl, noteNumber(octave, noteIndex), false);
+        synth_publish(synthState, synthControl);
+        xSemaphoreGive(voiceMutex);
+    }
+}
 
-// This function fills 5 step-size outputs (max voices) from three keyboards.
-void setStepSizes()
+void allNotesOff()
 {
-    uint32_t localStepSize1 = 0, localStepSize2 = 0, localStepSize3 = 0, localStepSize4 = 0, localStepSize5 = 0;
+    if (xSemaphoreTake(voiceMutex, portMAX_DELAY) == pdTRUE)
+    {
+        memset(synthControl.gate, 0, sizeof(synthControl.gate));
+        synth_publish(synthState, synthControl);
+        xSemaphoreGive(voiceMutex);
+    }
+}
 
-    std::vector<NoteRef> finalNotes;
-    finalNotes.reserve(MAX_VOICES);
+// Mirror a key event in the pressed-key sets the display draws from
+void showKeyEvent(const NoteEvent &event)
+{
+    if (event.noteIndex >= 12)
+        return;
+    int position = chain_positionOf(event.octave);
+    if (position < 0)
+        return;
+    if (xSemaphoreTake(keyStateMutex, portMAX_DELAY) == pdTRUE)
+    {
+        moduleKeys[position].set(event.noteIndex, event.type == 'P');
+        xSemaphoreGive(keyStateMutex);
+    }
+}
+
+// Gates edited in synthControl since it was last published, under voiceMutex
+static uint32_t batchGates[SYNTH_GATE_WORDS];
 
-    if (xSemaphoreTake(localKeyMutex, portMAX_DELAY) == pdTRUE)
+static void publishBatch()
+{
+    synth_publish(synthState, synthControl);
+    memset(batchGates, 0, sizeof(batchGates));
+}
+
+// A batch of key events goes into one snapshot so a chord never straddles
+// two audio blocks. The renderer only sees the difference between
+// snapshots, so a second edge of a note already edited in the batch, a
+// staccato press and release or a quick repeat, would cancel the first: the
+// batch so far is published and taken up by the renderer before it is
+// applied. The wait is at most one audio block.
+static void batchKeyEvent(const NoteEvent &event)
+{
+    if (event.noteIndex >= 12)
+        return;
+    uint8_t note = noteNumber(event.octave, event.noteIndex);
+    uint32_t bit = 1UL << (note & 31);
+    if (batchGates[note >> 5] & bit)
     {
-        for (uint8_t i = 0; i < 12; i++)
-        {
-            if (keys4.test(i))
-            {
-                if (finalNotes.size() < MAX_VOICES)
-                    finalNotes.push_back({KEYBOARD_4, i});
-                else
-                    break;
-            }
-        }
-        xSemaphoreGive(localKeyMutex);
+        publishBatch();
+        for (int i = 0; i < 4 && !synthState.control.taken(); i++)
+            vTaskDelay(1);
     }
-    if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
+    synth_setGate(synthControl, note, event.type == 'P');
+    batchGates[note >> 5] |= bit;
+}
+
+static bool batchPending()
+{
+    for (int w = 0; w < SYNTH_GATE_WORDS; w++)
     {
-        for (uint8_t i = 0; i < 12; i++)
-        {
-            if (keys5.test(i))
-            {
-                if (finalNotes.size() < MAX_VOICES)
-                    finalNotes.push_back({KEYBOARD_5, i});
-                else
-                    break;
-            }
-        }
-        xSemaphoreGive(externalKeyMutex);
+        if (batchGates[w])
+            return true;
     }
-    if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
+    return false;
+}
+
+// Every event of a CAN frame, as one batch
+void playKeyEvents(const NoteEvent *events, int count)
+{
+    if (xSemaphoreTake(voiceMutex, portMAX_DELAY) == pdTRUE)
     {
-        for (uint8_t i = 0; i < 12; i++)
-        {
-            if (keys6.test(i))
-            {
-                if (finalNotes.size() < MAX_VOICES)
-                    finalNotes.push_back({KEYBOARD_6, i});
-                else
-                    break;
-            }
-        }
-        xSemaphoreGive(externalKeyMutex);
+        for (int i = 0; i < count; i++)
+            batchKeyEvent(events[i]);
+        if (batchPending())
+            publishBatch();
+        xSemaphoreGive(voiceMutex);
     }
-    if (finalNotes.size() >= 1)
+}
+
+// Every pending voice event of both rings, as one batch
+static void playPendingKeyEvents()
+{
+    if (xSemaphoreTake(voiceMutex, portMAX_DELAY) == pdTRUE)
     {
-        switch (finalNotes[0].kb)
+        bool master = modulePosition == 0;
+        NoteEvent event;
+        while (localKeyEvents.pop(KEY_CONSUMER_VOICE, event))
         {
-        case KEYBOARD_4:
-            localStepSize1 = stepSizes4[finalNotes[0].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize1 = stepSizes5[finalNotes[0].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize1 = stepSizes6[finalNotes[0].noteIdx];
-            break;
+            if (master)
+                batchKeyEvent(event);
         }
-    }
-    if (finalNotes.size() >= 2)
-    {
-        switch (finalNotes[1].kb)
+        while (remoteKeyEvents.pop(KEY_CONSUMER_VOICE, event))
         {
-        case KEYBOARD_4:
-            localStepSize2 = stepSizes4[finalNotes[1].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize2 = stepSizes5[finalNotes[1].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize2 = stepSizes6[finalNotes[1].noteIdx];
-            break;
+            if (master)
+                batchKeyEvent(event);
         }
+        if (batchPending())
+            publishBatch();
+        xSemaphoreGive(voiceMutex);
     }
-    if (finalNotes.size() >= 3)
+}
+
+// Drains the voice, sampler and CAN cursors of both key event rings. Only the
+// master board plays and records; the others forward their own keys over CAN.
+// The display task drains its cursors itself.
+void keyEventTask(void *pvParameters)
+{
+    while (1)
     {
-        switch (finalNotes[2].kb)
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        lastActivityTick = xTaskGetTickCount();
+        bool master = modulePosition == 0;
+        playPendingKeyEvents();
+        NoteEvent event;
+        while (localKeyEvents.pop(KEY_CONSUMER_SAMPLER, event))
         {
-        case KEYBOARD_4:
-            localStepSize3 = stepSizes4[finalNotes[2].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize3 = stepSizes5[finalNotes[2].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize3 = stepSizes6[finalNotes[2].noteIdx];
-            break;
+            if (master)
+                sampler_recordEvent(event);
         }
+        while (remoteKeyEvents.pop(KEY_CONSUMER_SAMPLER, event))
+        {
+            if (master)
+                sampler_recordEvent(event);
+        }
+        canlink_sendKeyEvents(localKeyEvents, KEY_CONSUMER_CAN, !master,
+                              [](const uint8_t msg[8]) { can_send(CAN_TX_NOTE, msg); });
     }
-    if (finalNotes.size() >= 4)
+}
+
+// Publish volume, waveform and envelope knob positions, only when one moved
+static void setSynthParameters(int volume, int waveform, const int envelope[4])
+{
+    static int lastEnvelope[4] = {-1, -1, -1, -1};
+    bool envelopeChanged = memcmp(envelope, lastEnvelope, sizeof(lastEnvelope)) != 0;
+    if (!envelopeChanged && synthControl.volume == volume && synthControl.waveform == waveform)
+        return;
+    if (xSemaphoreTake(voiceMutex, portMAX_DELAY) == pdTRUE)
     {
-        switch (finalNotes[3].kb)
+        synthControl.volume = (uint8_t)volume;
+        synthControl.waveform = (uint8_t)waveform;
+        if (envelopeChanged)
         {
-        case KEYBOARD_4:
-            localStepSize4 = stepSizes4[finalNotes[3].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize4 = stepSizes5[finalNotes[3].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize4 = stepSizes6[finalNotes[3].noteIdx];
-            break;
+            synth_setEnvelope(synthControl, fs, envelope[0], envelope[1], envelope[2], envelope[3]);
+            memcpy(lastEnvelope, envelope, sizeof(lastEnvelope));
         }
+        synth_publish(synthState, synthControl);
+        xSemaphoreGive(voiceMutex);
     }
-    if (finalNotes.size() >= 5)
+}
+
+static int stepParameter(int value, int delta, int maxValue)
+{
+    value += delta;
+    return value < 0 ? 0 : value > maxValue ? maxValue : value;
+}
+
+// Knob 3 sets the volume and its press steps through the looper's tracks.
+// Knob 2 picks the waveform, its press toggles the sampler and a long press
+// undoes the last overdub. Knobs 0 and 1 set the envelope two parameters at
+// a time: a press on knob 0 flips between attack/decay and sustain/release,
+// and a long press restores the defaults. A press on knob 1 mutes the
+// selected track and a long press solos it.
+static void handleKnobEvent(const KnobEvent &event)
+{
+    int page = sysState.envelopePage ? 2 : 0;
+    switch (event.knob)
     {
-        switch (finalNotes[4].kb)
+    case 0:
+    case 1:
+        if (event.type == KNOB_ROTATE)
+        {
+            volatile int &parameter = sysState.envelope[page + event.knob];
+            parameter = stepParameter(parameter, event.delta, ENV_KNOB_STEPS - 1);
+        }
+        else if (event.knob == 0 && event.type == KNOB_PRESS)
+        {
+            sysState.envelopePage = !sysState.envelopePage;
+        }
+        else if (event.knob == 0 && event.type == KNOB_LONG_PRESS)
+        {
+            sysState.envelope[0] = ENV_DEFAULT_ATTACK;
+            sysState.envelope[1] = ENV_DEFAULT_DECAY;
+            sysState.envelope[2] = ENV_DEFAULT_SUSTAIN;
+            sysState.envelope[3] = ENV_DEFAULT_RELEASE;
+        }
+        else if (event.type == KNOB_PRESS)
+        {
+            sequencer.muted ^= 1 << loopTrack;
+        }
+        else if (event.type == KNOB_LONG_PRESS)
         {
-        case KEYBOARD_4:
-            localStepSize5 = stepSizes4[finalNotes[4].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize5 = stepSizes5[finalNotes[4].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize5 = stepSizes6[finalNotes[4].noteIdx];
-            break;
+            sequencer.soloed ^= 1 << loopTrack;
         }
+        break;
+    case 2:
+        if (event.type == KNOB_ROTATE)
+            sysState.waveform = stepParameter(sysState.waveform, event.delta, WAVE_COUNT - 1);
+        else if (event.type == KNOB_PRESS)
+            samplerEnabled = !samplerEnabled;
+        else
+            loopUndoRequests++;
+        break;
+    case 3:
+        if (event.type == KNOB_ROTATE)
+            sysState.volume = stepParameter(sysState.volume, event.delta, 8);
+        else if (event.type == KNOB_PRESS)
+            loopTrack = (loopTrack + 1) % LOOPER_TRACKS;
+        break;
     }
+}
 
-    // Atomically update the global step-size variables.
-    __atomic_store_n(&currentStepSize1, localStepSize1, __ATOMIC_RELAXED);
-    __atomic_store_n(&currentStepSize2, localStepSize2, __ATOMIC_RELAXED);
-    __atomic_store_n(&currentStepSize3, localStepSize3, __ATOMIC_RELAXED);
-    __atomic_store_n(&currentStepSize4, localStepSize4, __ATOMIC_RELAXED);
-    __atomic_store_n(&currentStepSize5, localStepSize5, __ATOMIC_RELAXED);
+// After the chain is enumerated again, keys held through it are released
+// in their old octave and pressed again in the new one
+static void moveHeldKeys(uint32_t held, int octave, TickType_t now)
+{
+    bool moved = false;
+    for (uint8_t key = 0; key < 12; key++)
+    {
+        if (held >> key & 1)
+            continue;
+        NoteEvent release = {now, 'R', (uint8_t)octave, key};
+        NoteEvent press = {now, 'P', (uint8_t)moduleOctave, key};
+        localKeyEvents.push(release);
+        localKeyEvents.push(press);
+        moved = true;
+    }
+    if (moved)
+        xTaskNotifyGive(keyEventHandle);
 }
 
 void scanKeysTask(void *pvParameters)
 {
-    const TickType_t xFrequency = 5 / portTICK_PERIOD_MS;
-    TickType_t xLastWakeTime = xTaskGetTickCount();
+    // The matrix is scanned in the background by TIM2 and DMA; this task only
+    // wakes when some input changed, with the new matrix as its notification.
+    // While a change is still being debounced it also wakes every scan period,
+    // since a contact that has stopped bouncing sends no more notifications,
+    // and likewise while a knob press may still become a long press or the
+    // chain is being enumerated.
+    static VerticalDebouncer<DEBOUNCE_DEPTH> debouncer;
+    static KnobBank knobs;
+    knobs.reset(debouncer.value());
+    chain_begin(xTaskGetTickCount());
+    if (xSemaphoreTake(sysState.mutex, portMAX_DELAY) == pdTRUE)
+    {
+        sysState.inputs = debouncer.value();
+        xSemaphoreGive(sysState.mutex);
+    }
+    // Settings may have been restored from the store
+    int envelope[4];
+    for (int i = 0; i < 4; i++)
+        envelope[i] = sysState.envelope[i];
+    setSynthParameters(sysState.volume, sysState.waveform, envelope);
     while (1)
     {
-        vTaskDelayUntil(&xLastWakeTime, xFrequency);
+        uint32_t raw;
+        TickType_t timeout = portMAX_DELAY;
+        if (debouncer.pending() || chain_pending())
+            timeout = pdMS_TO_TICKS(1000 / MATRIX_SCAN_HZ);
+        else if (knobs.pressPending())
+            timeout = pdMS_TO_TICKS(KNOB_HOLD_POLL_MS);
+        if (xTaskNotifyWait(0, 0, &raw, timeout) != pdTRUE)
+        {
+            raw = matrix_lastScan();
+        }
+        uint32_t previousScan = debouncer.value();
+        uint32_t scan = debouncer.update(raw);
+        uint32_t now = xTaskGetTickCount();
+
+        KnobEvent knobEvents[KNOB_EVENTS_MAX];
+        int knobEventCount = knobs.update(scan, now, knobEvents);
+        for (int i = 0; i < knobEventCount; i++)
+        {
+            handleKnobEvent(knobEvents[i]);
+        }
+        if (knobEventCount)
+        {
+            int envelope[4];
+            for (int i = 0; i < 4; i++)
+                envelope[i] = sysState.envelope[i];
+            setSynthParameters(sysState.volume, sysState.waveform, envelope);
+        }
+
+        int octave = moduleOctave;
+        bool master = modulePosition == 0;
+        if (chain_update(scan, now))
+        {
+            if (master && modulePosition != 0)
+                allNotesOff();
+            if (moduleOctave != octave)
+                moveHeldKeys(previousScan, octave, now);
+        }
+
+        if (scan == previousScan)
+        {
+            continue;
+        }
         std::bitset<32> localInputs;
-        int lastPressedKey = -1;
-        std::bitset<2> currentKnobState;
-        int localRotationVariable = 0;
-        int localVolume = sysState.volume;
         std::bitset<32> previousInput = sysState.inputs;
-        uint8_t TX_Message[8] = {0};
-        bool west, east;
-        bool sampler_enabled = sysState.knob2.getPress();
-        for (uint8_t row = 0; row < 7; row++)
+        bool keyEdges = false;
+        for (uint8_t row = 0; row < MATRIX_ROWS; row++)
         {
-            // Select row
-            digitalWrite(REN_PIN, LOW);
-            digitalWrite(RA0_PIN, row & 0x01);
-            digitalWrite(RA1_PIN, row & 0x02);
-            digitalWrite(RA2_PIN, row & 0x04);
-            digitalWrite(REN_PIN, HIGH);
-            delayMicroseconds(3);
-
-            // Read columns
-            std::bitset<4> colInputs;
-            colInputs[0] = digitalRead(C0_PIN);
-            colInputs[1] = digitalRead(C1_PIN);
-            colInputs[2] = digitalRead(C2_PIN);
-            colInputs[3] = digitalRead(C3_PIN);
-            digitalWrite(REN_PIN, LOW);
+            std::bitset<4> colInputs = (scan >> (row * 4)) & 0xf;
 
             for (uint8_t col = 0; col < 4; col++)
             {
                 int keyIndex = row * 4 + col;
                 localInputs[keyIndex] = colInputs[col];
 
-                // scan key
+                // Key edges only go into the ring; the consumers act on them
                 if (keyIndex <= 11 && keyIndex >= 0)
                 {
                     if (previousInput[keyIndex] && !colInputs[col])
                     {
-                        lastPressedKey = keyIndex;
-                        if (moduleOctave == 4)
-                        {
-                            if (xSemaphoreTake(localKeyMutex, portMAX_DELAY) == pdTRUE)
-                            {
-                                keys4.set(keyIndex, true);
-                                xSemaphoreGive(localKeyMutex);
-                            }
-                            __atomic_store_n(&currentStepSize, stepSizes4[lastPressedKey], __ATOMIC_RELAXED);
-                            if (sampler_enabled)
-                            {
-                                sampler_recordEvent('P', moduleOctave, (uint8_t)keyIndex);
-                            }
-                        }
-                        else
-                        {
-                            TX_Message[0] = 'P';
-                            TX_Message[1] = moduleOctave;
-                            TX_Message[2] = lastPressedKey;
-                            xQueueSend(msgOutQ, TX_Message, portMAX_DELAY);
-                        }
+                        NoteEvent event = {now, 'P', (uint8_t)moduleOctave, (uint8_t)keyIndex};
+                        localKeyEvents.push(event);
+                        keyEdges = true;
                     }
                     if (!previousInput[keyIndex] && colInputs[col])
                     {
-                        if (moduleOctave == 4)
-                        {
-                            if (xSemaphoreTake(localKeyMutex, portMAX_DELAY) == pdTRUE)
-                            {
-                                keys4.set(keyIndex, false);
-                                xSemaphoreGive(localKeyMutex);
-                            }
-                            __atomic_store_n(&currentStepSize, 0, __ATOMIC_RELAXED);
-                            if (sampler_enabled)
-                            {
-                                sampler_recordEvent('R', moduleOctave, (uint8_t)keyIndex);
-                            }
-                        }
-                        else
-                        {
-                            TX_Message[0] = 'R';
-                            TX_Message[1] = moduleOctave;
-                            TX_Message[2] = keyIndex;
-                            xQueueSend(msgOutQ, TX_Message, portMAX_DELAY);
-                        }
+                        NoteEvent event = {now, 'R', (uint8_t)moduleOctave, (uint8_t)keyIndex};
+                        localKeyEvents.push(event);
+                        keyEdges = true;
                     }
                 }
             }
         }
-        setStepSizes();
-        readHandshake(west, east);
-
-        // If either handshake input has changed, trigger auto-detection
-        if (west != prevWest || east != prevEast)
+        if (keyEdges)
         {
-            autoDetectHandshake();
-            TX_Message[0] = 'H';
-            TX_Message[1] = moduleOctave;
-            xQueueSend(msgOutQ, TX_Message, portMAX_DELAY);
+            xTaskNotifyGive(keyEventHandle);
         }
-        prevWest = west;
-        prevEast = east;
-
-        // Knob 3 for volume adjust
-        currentKnobState[0] = localInputs[12]; // A
-        currentKnobState[1] = localInputs[13]; // B
-        sysState.knob3.updateRotation(currentKnobState);
-        localVolume = sysState.knob3.getRotationValue();
-
-        // knob 2 for deciding whether sampleing
-        std::bitset<1> currentPressKnob2;
-        currentPressKnob2[0] = localInputs[20];
-
-        // Update global system state atomically and with mutex
         if (xSemaphoreTake(sysState.mutex, portMAX_DELAY) == pdTRUE)
         {
             memcpy(&sysState.inputs, &localInputs, sizeof(sysState.inputs));
-            sysState.knob2.updatePress(currentPressKnob2);
-            sysState.knob3.updateRotation(currentKnobState);
-            localVolume = sysState.knob3.getRotationValue();
             xSemaphoreGive(sysState.mutex);
         }
-        sysState.rotationVariable = localRotationVariable;
-        __atomic_store_n(&sysState.volume, localVolume, __ATOMIC_RELAXED);
     }
 }
 
-void setStepSizesFunction()//WCET test function
-{
-
-    uint32_t localStepSize1 = 0, localStepSize2 = 0, localStepSize3 = 0, localStepSize4 = 0, localStepSize5 = 0;
-
-    std::vector<NoteRef> finalNotes;
-    finalNotes.reserve(MAX_VOICES);
-
-    for (uint8_t i = 0; i < 12; i++)
-    {
-        if (keys4.test(i))
-        {
-            if (finalNotes.size() < MAX_VOICES)
-                finalNotes.push_back({KEYBOARD_4, i});
-            else
-                break;
-        }
-    }
-    for (uint8_t i = 0; i < 12; i++)
-    {
-        if (keys5.test(i))
-        {
-            if (finalNotes.size() < MAX_VOICES)
-                finalNotes.push_back({KEYBOARD_5, i});
-            else
-                break;
-        }
-    }
-    for (uint8_t i = 0; i < 12; i++)
-    {
-        if (keys6.test(i))
-        {
-            if (finalNotes.size() < MAX_VOICES)
-                finalNotes.push_back({KEYBOARD_6, i});
-            else
-                break;
-        }
-    }
-
-    if (finalNotes.size() >= 1)
-    {
-        switch (finalNotes[0].kb)
-        {
-        case KEYBOARD_4:
-            localStepSize1 = stepSizes4[finalNotes[0].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize1 = stepSizes5[finalNotes[0].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize1 = stepSizes6[finalNotes[0].noteIdx];
-            break;
-        }
-    }
-    if (finalNotes.size() >= 2)
-    {
-        switch (finalNotes[1].kb)
-        {
-        case KEYBOARD_4:
-            localStepSize2 = stepSizes4[finalNotes[1].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize2 = stepSizes5[finalNotes[1].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize2 = stepSizes6[finalNotes[1].noteIdx];
-            break;
-        }
-    }
-    if (finalNotes.size() >= 3)
-    {
-        switch (finalNotes[2].kb)
-        {
-        case KEYBOARD_4:
-            localStepSize3 = stepSizes4[finalNotes[2].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize3 = stepSizes5[finalNotes[2].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize3 = stepSizes6[finalNotes[2].noteIdx];
-            break;
-        }
-    }
-    if (finalNotes.size() >= 4)
-    {
-        switch (finalNotes[3].kb)
-        {
-        case KEYBOARD_4:
-            localStepSize4 = stepSizes4[finalNotes[3].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize4 = stepSizes5[finalNotes[3].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize4 = stepSizes6[finalNotes[3].noteIdx];
-            break;
-        }
-    }
-    if (finalNotes.size() >= 5)
-    {
-        switch (finalNotes[4].kb)
-        {
-        case KEYBOARD_4:
-            localStepSize5 = stepSizes4[finalNotes[4].noteIdx];
-            break;
-        case KEYBOARD_5:
-            localStepSize5 = stepSizes5[finalNotes[4].noteIdx];
-            break;
-        case KEYBOARD_6:
-            localStepSize5 = stepSizes6[finalNotes[4].noteIdx];
-            break;
-        }
-    }
-
-    // Atomically update the global step-size variables.
-    __atomic_store_n(&currentStepSize1, localStepSize1, __ATOMIC_RELAXED);
-    __atomic_store_n(&currentStepSize2, localStepSize2, __ATOMIC_RELAXED);
-    __atomic_store_n(&currentStepSize3, localStepSize3, __ATOMIC_RELAXED);
-    __atomic_store_n(&currentStepSize4, localStepSize4, __ATOMIC_RELAXED);
-    __atomic_store_n(&currentStepSize5, localStepSize5, __ATOMIC_RELAXED);
-}
-
 void scanKeysFunction(void *pvParameters)//WCET test function
 {
     const TickType_t xFrequency = 50 / portTICK_PERIOD_MS;
@@ -426,26 +394,17 @@ void scanKeysFunction(void *pvParameters)//WCET test function
         scanKeysIterations++;
         std::bitset<32> localInputs;
         int lastPressedKey = -1;
-        std::bitset<2> currentKnobState;
-        int localRotationVariable = 0;
-        int localVolume = sysState.volume;
         std::bitset<32> previousInput = sysState.inputs;
 
         localInputs.set();
 
-        for (uint8_t row = 0; row < 7; row++)
+        // Real register traffic, but every key reads as released so each
+        // iteration takes the same path
+        matrix_scan();
+        for (uint8_t row = 0; row < MATRIX_ROWS; row++)
         {
-
-            digitalWrite(REN_PIN, LOW);
-            digitalWrite(RA0_PIN, row & 0x01);
-            digitalWrite(RA1_PIN, row & 0x02);
-            digitalWrite(RA2_PIN, row & 0x04);
-            digitalWrite(REN_PIN, HIGH);
-            delayMicroseconds(3);
-
             std::bitset<4> colInputs;
             colInputs.set();
-            digitalWrite(REN_PIN, LOW);
 
             for (uint8_t col = 0; col < 4; col++)
             {
@@ -457,17 +416,19 @@ void scanKeysFunction(void *pvParameters)//WCET test function
                     if (previousInput[keyIndex] && !colInputs[col])
                     {
                         lastPressedKey = keyIndex;
-                        if (moduleOctave == 4)
+                        if (modulePosition == 0)
                         {
-                            keys4.set(keyIndex, true);
+                            moduleKeys[0].set(keyIndex, true);
+                            noteOn(moduleOctave, keyIndex);
                             __atomic_store_n(&currentStepSize, stepSizes4[lastPressedKey], __ATOMIC_RELAXED);
                         }
                     }
                     if (!previousInput[keyIndex] && colInputs[col])
                     {
-                        if (moduleOctave == 4)
+                        if (modulePosition == 0)
                         {
-                            keys4.set(keyIndex, false);
+                            moduleKeys[0].set(keyIndex, false);
+                            noteOff(moduleOctave, keyIndex);
                             __atomic_store_n(&currentStepSize, 0, __ATOMIC_RELAXED);
                         }
                     }
@@ -475,10 +436,8 @@ void scanKeysFunction(void *pvParameters)//WCET test function
             }
         }
 
-        setStepSizesFunction();
-
-        currentKnobState.set();
-        knob3.updateRotation(currentKnobState);
-        localVolume = knob3.getRotationValue();
+        static KnobBank knobs;
+        KnobEvent knobEvents[KNOB_EVENTS_MAX];
+        knobs.update(localInputs.to_ulong(), xTaskGetTickCount(), knobEvents);
     }
 }
@@ -0,0 +1,90 @@
+#include "looper.h"
+#include <string.h>
+
+void looper_clear(LoopBank &bank)
+{
+    memset(bank.end, 0, sizeof(bank.end));
+}
+
+// Bytes an event takes with this delta
+static inline int eventBytes(uint32_t delta)
+{
+    int n = 2;
+    while (delta >= 0x80)
+    {
+        delta >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline uint8_t *append(uint8_t *out, uint32_t delta, uint8_t event)
+{
+    while (delta >= 0x80)
+    {
+        *out++ = (uint8_t)(delta | 0x80);
+        delta >>= 7;
+    }
+    *out++ = (uint8_t)delta;
+    *out++ = event;
+    return out;
+}
+
+// Merge the take into a track of from, writing the events to out or, with
+// out null, only counting their bytes. Returns the bytes.
+static int mergeTrack(const LoopBank &from, int track, const uint32_t *take, int count, uint8_t *out)
+{
+    uint16_t i = looper_trackStart(from, track);
+    uint32_t position = 0;
+    uint32_t written = 0;
+    uint8_t event = 0;
+    bool pending = i < from.end[track];
+    if (pending)
+        event = looper_next(from.data, i, position);
+    int j = 0;
+    int bytes = 0;
+    while (pending || j < count)
+    {
+        uint32_t at;
+        uint8_t next;
+        if (pending && (j == count || position <= take[j] >> 8))
+        {
+            at = position;
+            next = event;
+            pending = i < from.end[track];
+            if (pending)
+                event = looper_next(from.data, i, position);
+        }
+        else
+        {
+            at = take[j] >> 8;
+            next = (uint8_t)take[j++];
+        }
+        bytes += eventBytes(at - written);
+        if (out)
+            out = append(out, at - written, next);
+        written = at;
+    }
+    return bytes;
+}
+
+bool looper_overdub(const LoopBank &from, int track, const uint32_t *take, int count, LoopBank &to)
+{
+    uint16_t start = looper_trackStart(from, track);
+    uint16_t rest = looper_used(from) - from.end[track];
+    int bytes = mergeTrack(from, track, take, count, nullptr);
+    if (start + bytes + rest > LOOPER_BANK_BYTES)
+        return false;
+
+    // Tracks before this one are copied as they are, and those after it
+    // move up by however much it grew
+    memcpy(to.data, from.data, start);
+    memcpy(to.end, from.end, sizeof(to.end[0]) * track);
+    mergeTrack(from, track, take, count, to.data + start);
+    uint16_t n = start + bytes;
+    to.end[track] = n;
+    memcpy(to.data + n, from.data + from.end[track], rest);
+    for (int t = track + 1; t < LOOPER_TRACKS; t++)
+        to.end[t] = from.end[t] - from.end[track] + n;
+    return true;
+}
@@ -5,7 +5,11 @@
 #include "pins.h"
 #include "isr.h"
 #include "sampler.h"
+#include "store.h"
 #include "autodetection.h"
+#include "audio.h"
+#include "matrix.h"
+#include "joystick.h"
 
 // uncomment below to enter testmode
 
@@ -19,6 +23,7 @@
 // #define CAN_TX
 // #define CAN_RX_TX
 // #define SAMPLE_ISR
+// #define MIX_KERNEL
 
 void printTaskStats()
 {
@@ -27,6 +32,23 @@ void printTaskStats()
   Serial.println(stats);
 }
 
+void printChain()
+{
+  Serial.print("Module ");
+  Serial.print(modulePosition);
+  Serial.print(" of ");
+  Serial.print(moduleCount);
+  Serial.print(", octave ");
+  Serial.println(moduleOctave);
+  for (int m = 0; m < moduleCount; m++)
+  {
+    Serial.print("  ");
+    Serial.print(m);
+    Serial.print(": ");
+    Serial.println(chain_moduleId(m), HEX);
+  }
+}
+
 void statsTask(void *pvParameters)
 {
   while (1)
@@ -39,6 +61,36 @@ void statsTask(void *pvParameters)
     Serial.println(stats);
 
     TickType_t currentTime = xTaskGetTickCount();
+    Serial.print("Key matrix scan cycles: ");
+    Serial.print(matrixScanCycles);
+    Serial.print(" max: ");
+    Serial.println(matrixScanCyclesMax);
+    const char *consumerNames[KEY_CONSUMERS] = {"voice", "sampler", "display", "CAN"};
+    for (int c = 0; c < KEY_CONSUMERS; c++)
+    {
+      Serial.print("Key events dropped, ");
+      Serial.print(consumerNames[c]);
+      Serial.print(": ");
+      Serial.print(localKeyEvents.overflows(c));
+      Serial.print(" local, ");
+      Serial.print(remoteKeyEvents.overflows(c));
+      Serial.println(" remote");
+    }
+    Serial.print("CAN frames dropped, note: ");
+    Serial.print(can_dropped(CAN_TX_NOTE));
+    Serial.print(" control: ");
+    Serial.print(can_dropped(CAN_TX_CONTROL));
+    Serial.print(" telemetry: ");
+    Serial.println(can_dropped(CAN_TX_TELEMETRY));
+    Serial.print("CAN queue high-water, note: ");
+    Serial.print(can_highWater(CAN_TX_NOTE));
+    Serial.print(" control: ");
+    Serial.print(can_highWater(CAN_TX_CONTROL));
+    Serial.print(" telemetry: ");
+    Serial.println(can_highWater(CAN_TX_TELEMETRY));
+    Serial.print("CAN frames lost on receive: ");
+    Serial.println(can_rxOverruns());
+    printChain();
     if (scanKeysIterations > 0)
     {
       float avgExecutionTime = (float)(currentTime - scanKeysStartTime) / scanKeysIterations;
@@ -76,10 +128,10 @@ void statsTask(void *pvParameters)
     }
     if (CAN_TX_Iterations > 0)
     {
-      float avgExecutionTime = (float)(currentTime - CAN_TX_StartTime) / CAN_TX_Iterations;
-      Serial.print("CAN_TX_Task Average Execution Time: ");
+      float avgExecutionTime = (float)CAN_TX_Micros / CAN_TX_Iterations;
+      Serial.print("can_send Average Execution Time: ");
       Serial.print(avgExecutionTime);
-      Serial.println(" ticks");
+      Serial.println(" us");
     }
   }
 }
@@ -101,6 +153,7 @@ void setup()
   pinMode(D1, INPUT);
   pinMode(JOYX_PIN, INPUT);
   pinMode(JOYY_PIN, INPUT);
+  matrix_init();
 
   setOutMuxBit(DRST_BIT, LOW);
   delayMicroseconds(2);
@@ -112,48 +165,39 @@ void setup()
   Serial.println("Hello World");
 
 #ifndef TestMode
-  sampleTimer.setOverflow(fs, HERTZ_FORMAT);
-  sampleTimer.attachInterrupt(sampleISR);
-  sampleTimer.resume();
+  synth_init(synthState, synthControl, fs, tuningTable);
+  joystick_init();
+  audio_init();
 
-  autoDetectHandshake();
-  Serial.print("Detected module octave: ");
-  Serial.println(moduleOctave);
+  // Init CAN, accepting IDs 0x000-0x3ff, which covers every class. The
+  // chain is enumerated over it from scanKeysTask once running.
+  CAN_Init(false);
+  setCANFilter(0x000, 0x400);
+  CAN_Start();
 
   xTaskCreate(scanKeysTask, "scanKeys", 256, NULL, 6, &scanKeysHandle);
+  xTaskCreate(keyEventTask, "keyEvents", 256, NULL, 6, &keyEventHandle);
+  matrix_startBackgroundScan(scanKeysHandle);
   xTaskCreate(displayUpdateTask, "displayUpdate", 256, NULL, 7, &displayTaskHandle);
 
   // Mutex
-  localKeyMutex = xSemaphoreCreateMutex();
-  externalKeyMutex = xSemaphoreCreateMutex();
+  keyStateMutex = xSemaphoreCreateMutex();
+  voiceMutex = xSemaphoreCreateMutex();
   sysState.mutex = xSemaphoreCreateMutex();
   sysState.volume = 4;
   sampler_init();
+  store_load();
 
-  // CAN Queues
-  msgInQ = xQueueCreate(36, 8);
-  msgOutQ = xQueueCreate(36, 8);
-
-  // Init CAN
-  CAN_Init(false);
-  setCANFilter(0x123, 0x7ff);
+  // decodeTask must exist before the RX interrupt can notify it
+  xTaskCreate(decodeTask, "decodeTask", 128, NULL, 5, &decodeHandle);
   CAN_RegisterRX_ISR(CAN_RX_ISR);
   CAN_RegisterTX_ISR(CAN_TX_ISR);
-  CAN_Start();
 
-  // Create decode & transmit tasks
-  xTaskCreate(decodeTask, "decodeTask", 128, NULL, 5, NULL);
-  xTaskCreate(CAN_TX_Task, "CAN_TX_Task", 128, NULL, 4, NULL);
+  // Idles unless this module is the master
+  xTaskCreate(samplerTask, "samplerTask", 256, NULL, 3, NULL);
 
-  if (moduleOctave == 4)
-  {
-    sampler_init();
-    xTaskCreate(samplerTask, "samplerTask", 256, NULL, 3, NULL);
-    xTaskCreate(metronomeTask, "metronomeTask", 128, NULL, 2, NULL);
-  }
-
-  // Counting semaphore for CAN TX
-  CAN_TX_Semaphore = xSemaphoreCreateCounting(3, 3);
+  // Saves settings and the loop to flash in the background
+  xTaskCreate(storeTask, "storeTask", 256, NULL, 1, NULL);
 
   #ifdef WORKMODECPU
   xTaskCreate(statsTask, "StatsTask", 256, NULL, 1, NULL);
@@ -163,10 +207,11 @@ void setup()
 #else
   // // Test mode
   // noInterrupts();
+  synth_init(synthState, synthControl, fs, tuningTable);
 
-  autoDetectHandshake();
-  Serial.print("Detected module octave: ");
-  Serial.println(moduleOctave);
+  CAN_Init(false);
+  setCANFilter(0x000, 0x400);
+  CAN_Start();
 #ifdef STATSTASK
   xTaskCreate(statsTask, "StatsTask", 256, NULL, 1, NULL);
 #endif
@@ -179,44 +224,28 @@ void setup()
 #endif
 
   // Mutex for sysState
+  keyStateMutex = xSemaphoreCreateMutex();
   sysState.mutex = xSemaphoreCreateMutex();
+  voiceMutex = xSemaphoreCreateMutex();
   sysState.volume = 4;
   sampler_init();
 
-  // // CAN Queues
-  msgInQ = xQueueCreate(384, 8);
-  msgOutQ = xQueueCreate(384, 8);
-
 // Init CAN
 #ifdef CAN_RX_TX
-  CAN_Init(false);
-  setCANFilter(0x123, 0x7ff);
   CAN_RegisterRX_ISR(CAN_RX_ISRTest);
   CAN_RegisterTX_ISR(CAN_TX_ISR);
-  CAN_Start();
 #endif
 
 // Create decode & transmit tasks
 #ifdef DECODE
   xTaskCreate(decodeFunction, "decodeTest", 128, NULL, 3, NULL);
-  uint8_t testMsg[8] = {'P', 5, 3, 0, 0, 0, 0, 0};
-  for (int i = 0; i < 384; i++)
-  {
-    xQueueSend(msgInQ, testMsg, portMAX_DELAY);
-  }
 #endif
 
 #ifdef CAN_TX
   xTaskCreate(CAN_TX_Function, "CAN_TX_Test", 128, NULL, 2, NULL);
-  uint8_t testMsg[8] = {0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF, 0x11, 0x22};
-
-  for (int i = 0; i < 384; i++)
-  {
-    xQueueSend(msgOutQ, testMsg, portMAX_DELAY);
-  }
 #endif
 
-  if (moduleOctave == 4)
+  if (modulePosition == 0)
   {
     sampler_init();
 #ifdef SAMPLER
@@ -234,7 +263,10 @@ void setup()
   sampleTimer.resume();
 #endif
 
-  CAN_TX_Semaphore = xSemaphoreCreateCounting(3, 3);
+#ifdef MIX_KERNEL
+  xTaskCreate(mixKernelFunction, "mixKernelTest", 256, NULL, 1, NULL);
+#endif
+
 
   vTaskStartScheduler();
 #endif
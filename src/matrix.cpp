@@ -0,0 +1,228 @@
+#include "matrix.h"
+#include <Arduino.h>
+
+volatile uint32_t matrixScanCycles = 0;
+volatile uint32_t matrixScanCyclesMax = 0;
+
+static_assert(RA0_PORTPIN.port == PORT_B && RA1_PORTPIN.port == PORT_B && RA2_PORTPIN.port == PORT_B &&
+                  OUT_PORTPIN.port == PORT_B,
+              "row address and OUT must share a port for a single BSRR write");
+static_assert(C0_PORTPIN.port == PORT_A && C1_PORTPIN.port == PORT_A && C2_PORTPIN.port == PORT_A &&
+                  C3_PORTPIN.port == PORT_A && REN_PORTPIN.port == PORT_A,
+              "columns must share a port for a single IDR read");
+
+namespace
+{
+    constexpr uint32_t bit(PortPin pin)
+    {
+        return 1UL << pin.bit;
+    }
+
+    constexpr uint32_t ROW_PINS = bit(RA0_PORTPIN) | bit(RA1_PORTPIN) | bit(RA2_PORTPIN) | bit(OUT_PORTPIN);
+
+    // BSRR word that drives the row address and OUT in one write: set bits in
+    // the low half, reset bits in the high half
+    constexpr uint32_t rowSelect(uint8_t row, bool out)
+    {
+        uint32_t set = ((row & 1) ? bit(RA0_PORTPIN) : 0) |
+                       ((row & 2) ? bit(RA1_PORTPIN) : 0) |
+                       ((row & 4) ? bit(RA2_PORTPIN) : 0) |
+                       (out ? bit(OUT_PORTPIN) : 0);
+        return set | ((ROW_PINS & ~set) << 16);
+    }
+
+    inline uint8_t columns(uint32_t idr)
+    {
+        return ((idr >> C0_PORTPIN.bit) & 1) |
+               ((idr >> C1_PORTPIN.bit) & 1) << 1 |
+               ((idr >> C2_PORTPIN.bit) & 1) << 2 |
+               ((idr >> C3_PORTPIN.bit) & 1) << 3;
+    }
+}
+
+// The output flip-flops hold OUT whenever their row is enabled, so scans must
+// keep driving the value last written. All high at reset, as setup leaves them.
+static uint8_t outputLatch = 0xff;
+
+// Background scan state. rowTable[i] selects row i + 1: the update event that
+// ends row i's period starts the next row, and row 0 is selected by hand
+// before the timer starts, so capture[i] always belongs to row i.
+static uint32_t rowTable[MATRIX_ROWS];
+static uint32_t capture[MATRIX_ROWS];
+static const uint32_t renBit = bit(REN_PORTPIN);
+static volatile bool backgroundScan = false;
+static volatile uint32_t lastInputs = 0xffffffff;
+static TaskHandle_t notifyTask = NULL;
+
+static TIM_HandleTypeDef TIM2_Handle;
+static DMA_HandleTypeDef DMA_Row_Handle;     // TIM2_UP: row address to GPIOB->BSRR
+static DMA_HandleTypeDef DMA_RenSet_Handle;   // TIM2_CH1: REN high
+static DMA_HandleTypeDef DMA_RenReset_Handle; // TIM2_CH2: REN low
+static DMA_HandleTypeDef DMA_Capture_Handle;  // TIM2_CH3: GPIOA->IDR to capture[]
+
+extern "C" void DMA1_Channel1_IRQHandler(void);
+
+// Column pull-ups need about 3 us to settle after a row change
+static uint32_t settleCycles = 0;
+
+void matrix_init()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    settleCycles = SystemCoreClock / 1000000 * 3;
+}
+
+static inline uint8_t readRow(uint8_t row)
+{
+    GPIOB->BSRR = rowSelect(row, (outputLatch >> row) & 1);
+    GPIOA->BSRR = bit(REN_PORTPIN);
+    uint32_t start = DWT->CYCCNT;
+    while (DWT->CYCCNT - start < settleCycles)
+    {
+    }
+    uint32_t idr = GPIOA->IDR;
+    GPIOA->BRR = bit(REN_PORTPIN);
+    return columns(idr);
+}
+
+uint32_t matrix_scan()
+{
+    uint32_t start = DWT->CYCCNT;
+    uint32_t inputs = 0;
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++)
+        inputs |= (uint32_t)readRow(row) << (row * 4);
+
+    uint32_t cycles = DWT->CYCCNT - start;
+    matrixScanCycles = cycles;
+    if (cycles > matrixScanCyclesMax)
+        matrixScanCyclesMax = cycles;
+    return inputs;
+}
+
+uint32_t matrix_lastScan()
+{
+    return lastInputs;
+}
+
+uint8_t matrix_readRow(uint8_t row)
+{
+    if (backgroundScan)
+        return (lastInputs >> (row * 4)) & 0xf;
+    return readRow(row);
+}
+
+void matrix_setOutput(uint8_t row, bool value)
+{
+    if (value)
+        outputLatch |= 1 << row;
+    else
+        outputLatch &= ~(1 << row);
+
+    if (backgroundScan)
+    {
+        // Takes effect the next time the DMA selects the row; a single word
+        // store, so the DMA never reads a half-updated entry
+        if (row < MATRIX_ROWS)
+            rowTable[(row + MATRIX_ROWS - 1) % MATRIX_ROWS] = rowSelect(row, value);
+        return;
+    }
+    // Selecting the row latches the new value; the settle time doubles as the
+    // latch pulse width
+    readRow(row);
+}
+
+static void initScanDma(DMA_HandleTypeDef &handle, DMA_Channel_TypeDef *channel,
+                        uint32_t direction, uint32_t memInc)
+{
+    handle.Instance = channel;
+    handle.Init.Request = DMA_REQUEST_4; // TIM2 on every channel used here
+    handle.Init.Direction = direction;
+    handle.Init.PeriphInc = DMA_PINC_DISABLE;
+    handle.Init.MemInc = memInc;
+    handle.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    handle.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    handle.Init.Mode = DMA_CIRCULAR;
+    handle.Init.Priority = DMA_PRIORITY_MEDIUM;
+    HAL_DMA_Init(&handle);
+}
+
+// A whole sweep has been captured
+static void captureComplete(DMA_HandleTypeDef *hdma)
+{
+    uint32_t start = DWT->CYCCNT;
+    uint32_t inputs = 0;
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++)
+        inputs |= (uint32_t)columns(capture[row]) << (row * 4);
+    uint32_t cycles = DWT->CYCCNT - start;
+    matrixScanCycles = cycles;
+    if (cycles > matrixScanCyclesMax)
+        matrixScanCyclesMax = cycles;
+    if (inputs == lastInputs)
+        return;
+    lastInputs = inputs;
+
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(notifyTask, inputs, eSetValueWithOverwrite, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+void matrix_startBackgroundScan(TaskHandle_t task)
+{
+    notifyTask = task;
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++)
+    {
+        uint8_t next = (row + 1) % MATRIX_ROWS;
+        rowTable[row] = rowSelect(next, (outputLatch >> next) & 1);
+    }
+    GPIOA->BRR = renBit;
+    GPIOB->BSRR = rowSelect(0, outputLatch & 1);
+
+    __HAL_RCC_TIM2_CLK_ENABLE();
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    // One period per row. Within it: address (update event), then REN high
+    // after 1 us, columns captured 3 us later, REN low 1 us after that.
+    const uint32_t ticksPerUs = SystemCoreClock / 1000000;
+    TIM2_Handle.Instance = TIM2;
+    TIM2_Handle.Init.Prescaler = 0;
+    TIM2_Handle.Init.CounterMode = TIM_COUNTERMODE_UP;
+    TIM2_Handle.Init.Period = SystemCoreClock / (MATRIX_SCAN_HZ * MATRIX_ROWS) - 1;
+    TIM2_Handle.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+    TIM2_Handle.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+    HAL_TIM_OC_Init(&TIM2_Handle);
+
+    TIM_OC_InitTypeDef ocConfig = {};
+    ocConfig.OCMode = TIM_OCMODE_TIMING;
+    ocConfig.Pulse = 1 * ticksPerUs;
+    HAL_TIM_OC_ConfigChannel(&TIM2_Handle, &ocConfig, TIM_CHANNEL_1);
+    ocConfig.Pulse = 5 * ticksPerUs;
+    HAL_TIM_OC_ConfigChannel(&TIM2_Handle, &ocConfig, TIM_CHANNEL_2);
+    ocConfig.Pulse = 4 * ticksPerUs;
+    HAL_TIM_OC_ConfigChannel(&TIM2_Handle, &ocConfig, TIM_CHANNEL_3);
+
+    // DMA1 request 4 channels: 2 is TIM2_UP, 5 TIM2_CH1, 7 TIM2_CH2, 1 TIM2_CH3
+    initScanDma(DMA_Row_Handle, DMA1_Channel2, DMA_MEMORY_TO_PERIPH, DMA_MINC_ENABLE);
+    initScanDma(DMA_RenSet_Handle, DMA1_Channel5, DMA_MEMORY_TO_PERIPH, DMA_MINC_DISABLE);
+    initScanDma(DMA_RenReset_Handle, DMA1_Channel7, DMA_MEMORY_TO_PERIPH, DMA_MINC_DISABLE);
+    initScanDma(DMA_Capture_Handle, DMA1_Channel1, DMA_PERIPH_TO_MEMORY, DMA_MINC_ENABLE);
+    DMA_Capture_Handle.XferCpltCallback = captureComplete;
+
+    HAL_DMA_Start(&DMA_Row_Handle, (uint32_t)(uintptr_t)rowTable, (uint32_t)(uintptr_t)&GPIOB->BSRR, MATRIX_ROWS);
+    HAL_DMA_Start(&DMA_RenSet_Handle, (uint32_t)(uintptr_t)&renBit, (uint32_t)(uintptr_t)&GPIOA->BSRR, 1);
+    HAL_DMA_Start(&DMA_RenReset_Handle, (uint32_t)(uintptr_t)&renBit, (uint32_t)(uintptr_t)&GPIOA->BRR, 1);
+    HAL_DMA_Start_IT(&DMA_Capture_Handle, (uint32_t)(uintptr_t)&GPIOA->IDR, (uint32_t)(uintptr_t)capture, MATRIX_ROWS);
+    __HAL_DMA_DISABLE_IT(&DMA_Capture_Handle, DMA_IT_HT);
+
+    // Below the audio DMA (5) and CAN (6); it only packs seven words
+    HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 7, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+
+    backgroundScan = true;
+    __HAL_TIM_ENABLE_DMA(&TIM2_Handle, TIM_DMA_UPDATE | TIM_DMA_CC1 | TIM_DMA_CC2 | TIM_DMA_CC3);
+    __HAL_TIM_ENABLE(&TIM2_Handle);
+}
+
+void DMA1_Channel1_IRQHandler(void)
+{
+    HAL_DMA_IRQHandler(&DMA_Capture_Handle);
+}
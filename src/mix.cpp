@@ -0,0 +1,111 @@
+#include "mix.h"
+#include <string.h>
+
+static inline int32_t qaddPortable(int32_t x, int32_t y)
+{
+    int64_t sum = (int64_t)x + y;
+    if (sum > INT32_MAX)
+        return INT32_MAX;
+    if (sum < INT32_MIN)
+        return INT32_MIN;
+    return (int32_t)sum;
+}
+
+void mix_accumulatePairPortable(int32_t *acc, const int16_t *a, const int16_t *b,
+                                int16_t gainA, int16_t gainB,
+                                int16_t stepA, int16_t stepB, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        int32_t product = (int32_t)a[i] * gainA + (int32_t)b[i] * gainB;
+        acc[i] = qaddPortable(acc[i], product);
+        // Halfword wrap-around, as SADD16 does
+        gainA = (int16_t)(uint16_t)((uint16_t)gainA + (uint16_t)stepA);
+        gainB = (int16_t)(uint16_t)((uint16_t)gainB + (uint16_t)stepB);
+    }
+}
+
+#if MIX_HAVE_DSP
+
+// DSP instructions written out directly so this file needs no CMSIS headers
+static inline uint32_t smlad(uint32_t x, uint32_t y, uint32_t sum)
+{
+    uint32_t result;
+    __asm__("smlad %0, %1, %2, %3" : "=r"(result) : "r"(x), "r"(y), "r"(sum));
+    return result;
+}
+
+static inline int32_t qadd(int32_t x, int32_t y)
+{
+    int32_t result;
+    __asm__("qadd %0, %1, %2" : "=r"(result) : "r"(x), "r"(y));
+    return result;
+}
+
+// Low halfword of x in the bottom, low halfword of y in the top
+static inline uint32_t pkhbt(uint32_t x, uint32_t y)
+{
+    uint32_t result;
+    __asm__("pkhbt %0, %1, %2, lsl #16" : "=r"(result) : "r"(x), "r"(y));
+    return result;
+}
+
+// Two halfword adds in one instruction
+static inline uint32_t sadd16(uint32_t x, uint32_t y)
+{
+    uint32_t result;
+    __asm__("sadd16 %0, %1, %2" : "=r"(result) : "r"(x), "r"(y));
+    return result;
+}
+
+// High halfword of x in the top, high halfword of y in the bottom
+static inline uint32_t pkhtb(uint32_t x, uint32_t y)
+{
+    uint32_t result;
+    __asm__("pkhtb %0, %1, %2, asr #16" : "=r"(result) : "r"(x), "r"(y));
+    return result;
+}
+
+static inline uint32_t packHalves(int16_t low, int16_t high)
+{
+    return (uint16_t)low | ((uint32_t)(uint16_t)high << 16);
+}
+
+void mix_accumulatePair(int32_t *acc, const int16_t *a, const int16_t *b,
+                        int16_t gainA, int16_t gainB,
+                        int16_t stepA, int16_t stepB, size_t n)
+{
+    // Both gains ramp together in one register, two samples per iteration
+    uint32_t gains = packHalves(gainA, gainB);
+    const uint32_t steps = packHalves(stepA, stepB);
+    const uint32_t steps2 = sadd16(steps, steps);
+
+    size_t pairs = n / 2;
+    for (size_t i = 0; i < pairs; i++)
+    {
+        // memcpy compiles to a single LDR and keeps the aliasing rules happy
+        uint32_t aWord; // a[2i] | a[2i+1] << 16
+        uint32_t bWord;
+        memcpy(&aWord, a + 2 * i, sizeof(aWord));
+        memcpy(&bWord, b + 2 * i, sizeof(bWord));
+        uint32_t even = pkhbt(aWord, bWord); // a[2i] | b[2i] << 16
+        uint32_t odd = pkhtb(bWord, aWord);  // a[2i+1] | b[2i+1] << 16
+        acc[2 * i] = qadd(acc[2 * i], (int32_t)smlad(even, gains, 0));
+        acc[2 * i + 1] = qadd(acc[2 * i + 1], (int32_t)smlad(odd, sadd16(gains, steps), 0));
+        gains = sadd16(gains, steps2);
+    }
+    if (n & 1)
+        mix_accumulatePairPortable(acc + n - 1, a + n - 1, b + n - 1,
+                                   (int16_t)gains, (int16_t)(gains >> 16), 0, 0, 1);
+}
+
+#else
+
+void mix_accumulatePair(int32_t *acc, const int16_t *a, const int16_t *b,
+                        int16_t gainA, int16_t gainB,
+                        int16_t stepA, int16_t stepB, size_t n)
+{
+    mix_accumulatePairPortable(acc, a, b, gainA, gainB, stepA, stepB, n);
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <Arduino.h>
 #include <string.h>
 #include "globals.h"
+#include "key.h"
 
 uint32_t samplerIterations = 0;
 TickType_t samplerStartTime = 0;
@@ -13,131 +14,160 @@ TickType_t metronomeStartTime = 0;
 const uint32_t BPM = 100;       // Beats per minute
 const uint32_t beatsPerBar = 4; // For a 4/4 time signature
 // Compute samplerLoopLength based on BPM (in milliseconds):
-const uint32_t samplerLoopLength = (60000UL / BPM) * beatsPerBar*2; // 2400 ms at 100 BPM
-
-const int MAX_EVENTS = 128;
-static NoteEvent recordingBuffer[MAX_EVENTS];
+const uint32_t samplerLoopLength = (60000UL / BPM) * beatsPerBar*2; // 4800 ms at 100 BPM
+
+// The loop and its clicks are timed in samples by the sequencer in the audio
+// path; samplerTask only looks in this often to merge overdubs
+const TickType_t samplerPollTicks = pdMS_TO_TICKS(20);
+
+// Both buffers are doubled. Key events are recorded into one recording
+// buffer while samplerTask takes the other at the loop boundary, and the
+// take is merged into a track of the loop as it is copied into the spare
+// bank. Only the recording swap needs samplerMutex. The bank left behind is
+// the loop before the last overdub, so undo just hands it back.
+const int MAX_TAKE = 128;
+static uint32_t recordingBuffers[2][MAX_TAKE]; // looper_takeEvent words
+static uint32_t *recordingBuffer = recordingBuffers[0];
 static int recordedCount = 0;
-static NoteEvent playbackBuffer[MAX_EVENTS];
-static int playbackCount = 0;
+static LoopBank banks[2];
+static LoopBank *bank = &banks[0];
+static bool canUndo = false;
+static bool restored = false;         // bank holds a loop from the store, to play first
+static volatile uint32_t loopVersion = 0; // Bumped whenever bank changes, and around writes to it
 
 static SemaphoreHandle_t samplerMutex = NULL;
 
-// This function simulates a key event during playback by updating the external
-void simulateKeyEvent(const NoteEvent &event)
+void sampler_init()
 {
-    if (event.octave == 4)
+    samplerMutex = xSemaphoreCreateMutex();
+    sequencer_init(sequencer, fs, samplerLoopLength * SEQUENCER_TICK_HZ / 1000, 60000UL / BPM * fs / 1000,
+                   TICK_DURATION_SAMPLES);
+}
+
+// Takes a key event with its tick timestamp from the key event ring, so the
+// recorded time is when the key moved rather than when this ran. The audio
+// clock is wound back by the event's age to place it in the loop.
+void sampler_recordEvent(const NoteEvent &keyEvent)
+{
+    if (!samplerEnabled || !sequencer.running)
     {
-        if (xSemaphoreTake(localKeyMutex, portMAX_DELAY) == pdTRUE)
-        {
-            if (event.type == 'P')
-            {
-                keys4.set(event.noteIndex, true);
-            }
-            else if (event.type == 'R')
-            {
-                keys4.set(event.noteIndex, false);
-            }
-            xSemaphoreGive(localKeyMutex);
-        }
+        return;
     }
-    if (event.octave == 5)
-    {
-        if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
-        {
 
-            if (event.type == 'P')
-            {
-                keys5.set(event.noteIndex, true);
-            }
-            else if (event.type == 'R')
-            {
-                keys5.set(event.noteIndex, false);
-            }
-            xSemaphoreGive(externalKeyMutex);
-        }
-    }
-    if (event.octave == 6)
+    uint32_t age = (uint32_t)((uint64_t)(xTaskGetTickCount() - keyEvent.timestamp) * portTICK_PERIOD_MS * fs / 1000);
+    uint32_t position = sequencer_sampleTick(sequencer, sequencer_positionAgo(sequencer, synthState, age));
+    uint32_t event = looper_takeEvent(position, keyEvent.type, noteNumber(keyEvent.octave, keyEvent.noteIndex));
+
+    // Local and remote events come from separate rings, so one can be a
+    // little older than the last recorded; keep the take in order
+    xSemaphoreTake(samplerMutex, portMAX_DELAY);
+    if (recordedCount < MAX_TAKE)
     {
-        if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
+        int i = recordedCount++;
+        while (i > 0 && recordingBuffer[i - 1] >> 8 > position)
         {
-
-            if (event.type == 'P')
-            {
-                keys6.set(event.noteIndex, true);
-            }
-            else if (event.type == 'R')
-            {
-                keys6.set(event.noteIndex, false);
-            }
-            xSemaphoreGive(externalKeyMutex);
+            recordingBuffer[i] = recordingBuffer[i - 1];
+            i--;
         }
+        recordingBuffer[i] = event;
     }
+    xSemaphoreGive(samplerMutex);
 }
-void sampler_init()
+
+// Swap in the other recording buffer and return the events recorded into
+// this one
+static int takeRecording(uint32_t *&taken)
 {
-    samplerMutex = xSemaphoreCreateMutex();
+    xSemaphoreTake(samplerMutex, portMAX_DELAY);
+    taken = recordingBuffer;
+    int count = recordedCount;
+    recordingBuffer = taken == recordingBuffers[0] ? recordingBuffers[1] : recordingBuffers[0];
+    recordedCount = 0;
+    xSemaphoreGive(samplerMutex);
+    return count;
 }
 
-void sampler_recordEvent(char type, uint8_t octave, uint8_t noteIndex)
+static LoopBank *spareBank()
 {
-    bool sampler_enabled;
-    if (xSemaphoreTake(sysState.mutex, portMAX_DELAY) == pdTRUE)
-    {
-        sampler_enabled = sysState.knob2.getPress();
-        xSemaphoreGive(sysState.mutex);
-    }
-    if (!sampler_enabled)
-    {
-        vTaskDelay(pdMS_TO_TICKS(50));
-        return;
-    }
-
-    uint32_t ts = xTaskGetTickCount() - samplerLoopStartTime;
-    NoteEvent event = {ts, type, octave, noteIndex};
+    return bank == &banks[0] ? &banks[1] : &banks[0];
+}
 
-    xSemaphoreTake(samplerMutex, portMAX_DELAY);
-    if (recordedCount < MAX_EVENTS)
+// Overdub a take onto a track, unless the loop has no room for all of it,
+// and hand the result to the sequencer for its next pass. Returns whether
+// anything was published.
+static bool overdub(int track, const uint32_t *recorded, int count)
+{
+    if (count == 0 || !looper_overdub(*bank, track, recorded, count, *spareBank()))
     {
-        recordingBuffer[recordedCount++] = event;
+        return false;
     }
+    xSemaphoreTake(samplerMutex, portMAX_DELAY);
+    bank = spareBank();
+    loopVersion++;
     xSemaphoreGive(samplerMutex);
+    canUndo = true;
+    sequencer_publish(sequencer, bank, true);
+    return true;
 }
 
-void releaseAllNotes()
+// Go back to the loop as it was before the last overdub
+static bool undo()
 {
-    if (xSemaphoreTake(localKeyMutex, portMAX_DELAY) == pdTRUE)
+    if (!canUndo)
     {
-        for (size_t i = 0; i < keys4.size(); i++)
-        {
-            if (keys4.test(i))
-            {
-                keys4.set(i, false);
-            }
-        }
-        xSemaphoreGive(localKeyMutex);
+        return false;
     }
-    if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
+    xSemaphoreTake(samplerMutex, portMAX_DELAY);
+    bank = spareBank();
+    loopVersion++;
+    xSemaphoreGive(samplerMutex);
+    canUndo = false;
+    sequencer_publish(sequencer, bank, true);
+    return true;
+}
+
+uint32_t sampler_loopVersion()
+{
+    return loopVersion;
+}
+
+// bank is only switched or cleared under samplerMutex, and loopVersion moves
+// with either. The copy itself is made outside the mutex, so samplerTask is
+// never held up behind it, and made again if the version moved meanwhile:
+// the bank may have become the spare and been merged into.
+uint32_t sampler_copyLoop(LoopBank &out)
+{
+    while (1)
     {
-        for (size_t i = 0; i < keys5.size(); i++)
-        {
-            if (keys5.test(i))
-            {
-                keys5.set(i, false);
-            }
-        }
-        xSemaphoreGive(externalKeyMutex);
+        xSemaphoreTake(samplerMutex, portMAX_DELAY);
+        const LoopBank *from = bank;
+        uint32_t version = loopVersion;
+        xSemaphoreGive(samplerMutex);
+
+        out = *from;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        if (loopVersion == version)
+            return version;
     }
-    if (xSemaphoreTake(externalKeyMutex, portMAX_DELAY) == pdTRUE)
+}
+
+void sampler_restoreLoop(const LoopBank &loop)
+{
+    *bank = loop;
+    restored = true;
+}
+
+// Clears the keys the loop lit. Stopping the sequencer releases the voices
+// it started; the player's gates are left alone.
+static void clearShownKeys()
+{
+    if (xSemaphoreTake(keyStateMutex, portMAX_DELAY) == pdTRUE)
     {
-        for (size_t i = 0; i < keys6.size(); i++)
+        for (int m = 0; m < CHAIN_MAX_MODULES; m++)
         {
-            if (keys6.test(i))
-            {
-                keys6.set(i, false);
-            }
+            moduleKeys[m].reset();
         }
-        xSemaphoreGive(externalKeyMutex);
+        xSemaphoreGive(keyStateMutex);
     }
 }
 
@@ -145,104 +175,77 @@ void releaseAllNotes()
 void resetSamplerState()
 {
     // Reset buffers and counters.
-    releaseAllNotes();
+    clearShownKeys();
     xSemaphoreTake(samplerMutex, portMAX_DELAY);
     recordedCount = 0;
-    playbackCount = 0;
     xSemaphoreGive(samplerMutex);
-    samplerLoopStartTime = 0;
+    sequencer_publish(sequencer, bank, false);
 }
 
+// The sequencer plays the loop and clicks the metronome from the audio path.
+// This task starts and stops it, mirrors what it played on the display, and
+// once it has begun a new pass merges the overdubs for the pass after.
 void samplerTask(void *pvParameters)
 {
-
-    const TickType_t loopTicks = pdMS_TO_TICKS(samplerLoopLength);
-    TickType_t xLastWakeTime = xTaskGetTickCount();
-    bool sampler_enabled = 0;
-    bool prevSamplerEnabled = 0;
+    bool running = false;
+    uint32_t loops = 0;
+    uint32_t undos = loopUndoRequests;
     while (1)
     {
-        if (xSemaphoreTake(sysState.mutex, portMAX_DELAY) == pdTRUE)
-        {
-            sampler_enabled = sysState.knob2.getPress();
-            xSemaphoreGive(sysState.mutex);
-        }
-        if (prevSamplerEnabled && !sampler_enabled)
+        vTaskDelay(samplerPollTicks);
+
+        // Only the master records; the role can move when the chain changes
+        bool enabled = samplerEnabled && modulePosition == 0;
+        if (running && !enabled)
         {
             // when exit samplier mode reset the state.
             resetSamplerState();
         }
-        prevSamplerEnabled = sampler_enabled;
-        if (!sampler_enabled)
-        {
-            vTaskDelay(pdMS_TO_TICKS(100));
-            continue;
-        }
-        samplerLoopStartTime = xTaskGetTickCount();
-
-        // Playback events recorded in the previous loop cycle.
-        uint32_t lastTimestamp = 0;
-        for (int i = 0; i < playbackCount; i++)
-        {
-            // Delay between events
-            uint32_t delayTime = playbackBuffer[i].timestamp - lastTimestamp;
-            vTaskDelay(pdMS_TO_TICKS(delayTime));
-            lastTimestamp = playbackBuffer[i].timestamp;
-            simulateKeyEvent(playbackBuffer[i]);
-        }
-
-        vTaskDelayUntil(&xLastWakeTime, loopTicks);
-
-        // Update playbackBuffer only if new events have been recorded.
-        xSemaphoreTake(samplerMutex, portMAX_DELAY);
-        if (recordedCount > 0)
+        else if (!running && enabled)
         {
-            if (playbackCount + recordedCount <= MAX_EVENTS)
-            {
-                memcpy(&playbackBuffer[playbackCount], recordingBuffer, recordedCount * sizeof(NoteEvent));
-                playbackCount += recordedCount;
-            }
-            recordedCount = 0;
-
-            // Use a simple insertion sort
-            for (int i = 1; i < playbackCount; i++)
+            // A fresh loop, unless this is the first start after a reset
+            // with a loop restored from the store. The bank the sequencer
+            // last had is not read again once it is stopped.
+            if (!restored)
             {
-                NoteEvent key = playbackBuffer[i];
-                int j = i - 1;
-                while (j >= 0 && playbackBuffer[j].timestamp > key.timestamp)
-                {
-                    playbackBuffer[j + 1] = playbackBuffer[j];
-                    j--;
-                }
-                playbackBuffer[j + 1] = key;
+                xSemaphoreTake(samplerMutex, portMAX_DELAY);
+                loopVersion++;
+                __atomic_signal_fence(__ATOMIC_SEQ_CST);
+                looper_clear(*bank);
+                __atomic_signal_fence(__ATOMIC_SEQ_CST);
+                loopVersion++;
+                xSemaphoreGive(samplerMutex);
             }
+            restored = false;
+            canUndo = false;
+            sequencer_publish(sequencer, bank, true);
+            loops = sequencer.loops;
         }
-        xSemaphoreGive(samplerMutex);
-    }
-}
-
-// simple metronome
-void metronomeTask(void *pvParameters)
-{
-    const TickType_t beatDelay = pdMS_TO_TICKS(60000UL / BPM);
-    TickType_t xLastWakeTime = xTaskGetTickCount();
-    bool sampler_enabled = 0;
+        running = enabled;
 
-    while (1)
-    {
-        if (xSemaphoreTake(sysState.mutex, portMAX_DELAY) == pdTRUE)
+        NoteEvent event;
+        while (sequencer.played.pop(0, event))
         {
-            sampler_enabled = sysState.knob2.getPress();
-            xSemaphoreGive(sysState.mutex);
+            showKeyEvent(event);
         }
 
-        if (sampler_enabled)
+        // The bank last published is in play once loops has moved, so the
+        // other is free to merge into. loops is read again after every
+        // publish, in case the loop wrapped while it was going on.
+        if (running && sequencer.loops != loops)
         {
-            metronomeActive = true;
-            metronomeCounter = TICK_DURATION_SAMPLES;
+            loops = sequencer.loops;
+            uint32_t *recorded;
+            int count = takeRecording(recorded);
+            if (overdub(loopTrack, recorded, count))
+                loops = sequencer.loops;
+        }
+        if (undos != loopUndoRequests)
+        {
+            undos = loopUndoRequests;
+            if (running && undo())
+                loops = sequencer.loops;
         }
-
-        vTaskDelayUntil(&xLastWakeTime, beatDelay);
     }
 }
 
@@ -282,7 +285,6 @@ void samplerFunction(void *pvParameters)// WCET test function
 {
     const TickType_t loopTicks = pdMS_TO_TICKS(1);
     TickType_t xLastWakeTime = xTaskGetTickCount();
-    bool prevSamplerEnabled = true;
 
     if (samplerIterations == 0)
     {
@@ -294,45 +296,43 @@ void samplerFunction(void *pvParameters)// WCET test function
         samplerIterations++;
 
         samplerEnabled = true;
-        playbackCount = MAX_EVENTS;
-        for (int i = 0; i < MAX_EVENTS; i++)
+
+        // A full ring of played events to mirror, as if the audio path had
+        // played them since the last poll
+        for (int i = 0; i < SEQUENCER_PLAYED_RING_SIZE; i++)
         {
-            playbackBuffer[i].timestamp = i * 10;
+            NoteEvent played = {(uint32_t)i, 'P', 4, (uint8_t)(i % 12)};
+            sequencer.played.push(played);
         }
-
-        uint32_t lastTimestamp = 0;
-        for (int i = 0; i < playbackCount; i++)
+        NoteEvent event;
+        while (sequencer.played.pop(0, event))
         {
-            uint32_t delayTime = playbackBuffer[i].timestamp - lastTimestamp;
-            vTaskDelay(pdMS_TO_TICKS(delayTime));
-            lastTimestamp = playbackBuffer[i].timestamp;
-            simulateKeyEvent(playbackBuffer[i]);
+            showKeyEvent(event);
         }
 
         vTaskDelayUntil(&xLastWakeTime, loopTicks);
 
-        recordedCount = MAX_EVENTS;
-        for (int i = 0; i < MAX_EVENTS; i++)
+        // The largest merge: a full take interleaved with a track that
+        // takes the rest of the bank, two bytes an event either way
+        const int trackEvents = LOOPER_BANK_BYTES / 2 - MAX_TAKE;
+        for (int i = 0; i < trackEvents; i++)
         {
-            recordingBuffer[i].timestamp = MAX_EVENTS - i;
+            bank->data[2 * i] = i ? 7 : 0;
+            bank->data[2 * i + 1] = 60;
         }
-
-        if (playbackCount + recordedCount <= MAX_EVENTS)
+        for (int t = 0; t < LOOPER_TRACKS; t++)
         {
-            memcpy(&playbackBuffer[playbackCount], recordingBuffer, recordedCount * sizeof(NoteEvent));
-            playbackCount += recordedCount;
+            bank->end[t] = 2 * trackEvents;
         }
-
-        for (int i = 1; i < playbackCount; i++)
+        recordedCount = MAX_TAKE;
+        for (int i = 0; i < MAX_TAKE; i++)
         {
-            NoteEvent key = playbackBuffer[i];
-            int j = i - 1;
-            while (j >= 0 && playbackBuffer[j].timestamp > key.timestamp)
-            {
-                playbackBuffer[j + 1] = playbackBuffer[j];
-                j--;
-            }
-            playbackBuffer[j + 1] = key;
+            recordingBuffer[i] = looper_takeEvent(i * 7 + 3, 'P', 60);
         }
+
+        uint32_t *recorded;
+        int count = takeRecording(recorded);
+        overdub(0, recorded, count);
+        undo();
     }
-}
\ No newline at end of file
+}
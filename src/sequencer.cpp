@@ -0,0 +1,133 @@
+#include "sequencer.h"
+
+void sequencer_init(Sequencer &seq, uint32_t sampleRate, uint32_t loopTicks, uint32_t beatSamples,
+                    uint32_t clickSamples)
+{
+    seq.tickSamples = (uint32_t)((((uint64_t)sampleRate << 16) + SEQUENCER_TICK_HZ / 2) / SEQUENCER_TICK_HZ);
+    seq.loopTicks = loopTicks;
+    seq.loopSamples = sequencer_tickSample(seq, loopTicks);
+    seq.beatSamples = beatSamples;
+    seq.clickSamples = clickSamples;
+    sequencer_publish(seq, nullptr, false);
+}
+
+void sequencer_publish(Sequencer &seq, const LoopBank *bank, bool running)
+{
+    SequencerPattern pattern = {bank, running};
+    seq.pattern.publish(pattern);
+}
+
+// Decode a track's next event, or park it past the end of the loop
+static inline void advance(Sequencer &seq, int track)
+{
+    if (seq.cursor[track] < seq.bank->end[track])
+    {
+        seq.event[track] = looper_next(seq.bank->data, seq.cursor[track], seq.tick[track]);
+        seq.due[track] = sequencer_tickSample(seq, seq.tick[track]);
+    }
+    else
+    {
+        seq.due[track] = UINT32_MAX;
+    }
+}
+
+// Take up the latest pattern at the start of a pass
+static void startPass(Sequencer &seq, uint32_t sample)
+{
+    const SequencerPattern &pattern = seq.pattern.read();
+    seq.bank = pattern.bank;
+    seq.running = pattern.running;
+    for (int t = 0; t < LOOPER_TRACKS; t++)
+    {
+        seq.due[t] = UINT32_MAX;
+        if (seq.bank)
+        {
+            seq.tick[t] = 0;
+            seq.cursor[t] = looper_trackStart(*seq.bank, t);
+            advance(seq, t);
+        }
+    }
+    seq.nextBeat = 0;
+    seq.loopStart = sample;
+}
+
+static void play(Sequencer &seq, SynthState &state, uint8_t event, bool audible, uint32_t sample)
+{
+    uint8_t note = event & LOOPER_NOTE_MASK;
+    if (event & LOOPER_RELEASE)
+        voice_playbackOff(state.voices, note);
+    else if (audible)
+        voice_noteOn(state.voices, note, state.tuning->step[note], VOICE_PRIORITY_PLAYBACK);
+    else
+        return;
+    NoteEvent &played = seq.played.claim();
+    played.timestamp = sample;
+    played.type = event & LOOPER_RELEASE ? 'R' : 'P';
+    played.octave = note / 12 - 1;
+    played.noteIndex = note % 12;
+    seq.played.commit();
+}
+
+void sequencer_render(Sequencer &seq, SynthState &state, uint8_t *out, size_t n)
+{
+    // Starting and stopping take effect at once, a new pattern at the wrap
+    const SequencerPattern &pattern = seq.pattern.read();
+    if (pattern.running != seq.running)
+    {
+        // Stopping silences whatever the loop left sounding, and only that
+        if (seq.running)
+            voice_allPlaybackOff(state.voices);
+        startPass(seq, state.samples);
+    }
+
+    while (n > 0)
+    {
+        size_t chunk = n;
+        if (seq.running)
+        {
+            uint32_t sample = state.samples;
+            uint32_t position = sample - seq.loopStart;
+            if (position >= seq.loopSamples)
+            {
+                startPass(seq, sample);
+                seq.loops++;
+                position = 0;
+                if (!seq.running)
+                {
+                    voice_allPlaybackOff(state.voices);
+                    continue;
+                }
+            }
+
+            // Play what is due on every track, noting which comes next
+            uint8_t audible = seq.soloed ? seq.soloed : (uint8_t)~seq.muted;
+            uint32_t until = seq.loopSamples;
+            for (int t = 0; t < LOOPER_TRACKS; t++)
+            {
+                while (seq.due[t] <= position)
+                {
+                    play(seq, state, seq.event[t], audible >> t & 1, sample);
+                    advance(seq, t);
+                }
+                if (seq.due[t] < until)
+                    until = seq.due[t];
+            }
+            if (seq.nextBeat <= position)
+            {
+                state.clickActive = true;
+                state.clickCounter = seq.clickSamples;
+                seq.lastBeat = sample;
+                seq.nextBeat += seq.beatSamples;
+            }
+
+            // Render up to whatever comes next
+            if (seq.nextBeat < until)
+                until = seq.nextBeat;
+            if (until - position < chunk)
+                chunk = until - position;
+        }
+        synth_renderBlock(state, out, chunk);
+        out += chunk;
+        n -= chunk;
+    }
+}
@@ -0,0 +1,206 @@
+#include "store.h"
+#include <Arduino.h>
+#include <STM32FreeRTOS.h>
+#include <string.h>
+#include "flashlog.h"
+#include "globals.h"
+#include "sampler.h"
+
+// A setting is saved once it has held this long, so turning a knob through
+// its range costs one record rather than one a step; likewise the loop,
+// which is larger and changes in bursts of overdubs
+const TickType_t storePollTicks = pdMS_TO_TICKS(500);
+const TickType_t settingsSettleTicks = pdMS_TO_TICKS(2000);
+const TickType_t loopSettleTicks = pdMS_TO_TICKS(10000);
+
+// Erases wait for this long with no key pressed or released and nothing on
+// the bus, anywhere in the chain
+const TickType_t eraseIdleTicks = pdMS_TO_TICKS(5000);
+
+// The store's pages at the top of flash. Programming a double word holds
+// up the CPU for under 0.1 ms, well inside an audio block, but an erase
+// holds it up for about 22 ms, so storeTask only erases once the whole
+// chain has gone quiet.
+struct InternalFlash
+{
+    static const uint32_t PAGE_SIZE = STORE_PAGE_SIZE;
+    static const uint16_t PAGES = STORE_PAGES;
+
+    static uint32_t base()
+    {
+        return FLASH_BASE + FLASH_SIZE - PAGES * PAGE_SIZE;
+    }
+
+    const uint8_t *data()
+    {
+        return (const uint8_t *)(uintptr_t)base();
+    }
+
+    bool erase(uint16_t page)
+    {
+        FLASH_EraseInitTypeDef erase = {};
+        erase.TypeErase = FLASH_TYPEERASE_PAGES;
+        erase.Banks = FLASH_BANK_1;
+        erase.Page = (base() - FLASH_BASE) / PAGE_SIZE + page;
+        erase.NbPages = 1;
+        uint32_t failedPage;
+        HAL_FLASH_Unlock();
+        __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+        bool ok = HAL_FLASHEx_Erase(&erase, &failedPage) == HAL_OK;
+        HAL_FLASH_Lock();
+        return ok;
+    }
+
+    bool program(uint32_t offset, uint64_t value)
+    {
+        HAL_FLASH_Unlock();
+        __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+        bool ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, base() + offset, value) == HAL_OK;
+        HAL_FLASH_Lock();
+        return ok;
+    }
+};
+
+static_assert(STORE_PAGE_SIZE == FLASH_PAGE_SIZE, "STORE_PAGE_SIZE must be the flash page size");
+static_assert(16 + ((sizeof(StoredSettings) + 7) & ~7) + ((sizeof(StoredLoop) + 7) & ~7) <= STORE_PAGE_SIZE - 8,
+              "Every record type must fit in one page together");
+
+// From the linker script: where the initialised data is loaded from
+extern "C" uint32_t _sidata, _sdata, _edata;
+
+static InternalFlash internalFlash;
+static FlashLog<InternalFlash> storeLog(internalFlash);
+static bool storeUsable = false;
+static StoredSettings savedSettings;
+static uint32_t savedLoopVersion;
+static StoredLoop loopRecord; // Too big for a task stack
+
+static void currentSettings(StoredSettings &settings)
+{
+    settings.volume = (uint8_t)sysState.volume;
+    settings.waveform = (uint8_t)sysState.waveform;
+    for (int i = 0; i < 4; i++)
+        settings.envelope[i] = (uint8_t)sysState.envelope[i];
+    settings.envelopePage = sysState.envelopePage;
+    settings.samplerEnabled = samplerEnabled;
+    settings.loopTrack = loopTrack;
+    settings.muted = sequencer.muted;
+    settings.soloed = sequencer.soloed;
+}
+
+static uint8_t limit(uint8_t value, uint8_t maxValue)
+{
+    return value > maxValue ? maxValue : value;
+}
+
+static void applySettings(const StoredSettings &settings)
+{
+    sysState.volume = limit(settings.volume, 8);
+    sysState.waveform = limit(settings.waveform, WAVE_COUNT - 1);
+    for (int i = 0; i < 4; i++)
+        sysState.envelope[i] = limit(settings.envelope[i], ENV_KNOB_STEPS - 1);
+    sysState.envelopePage = settings.envelopePage;
+    samplerEnabled = settings.samplerEnabled;
+    loopTrack = limit(settings.loopTrack, LOOPER_TRACKS - 1);
+    sequencer.muted = settings.muted;
+    sequencer.soloed = settings.soloed;
+}
+
+// The ends of the tracks must run in order within the bank
+static bool loopValid(const StoredLoop &loop, uint16_t length)
+{
+    uint16_t end = 0;
+    for (int t = 0; t < LOOPER_TRACKS; t++)
+    {
+        if (loop.bank.end[t] < end)
+            return false;
+        end = loop.bank.end[t];
+    }
+    return end <= LOOPER_BANK_BYTES && length == store_loopLength(loop);
+}
+
+void store_load()
+{
+    // A firmware image grown into the store's pages must not be erased
+    uintptr_t imageEnd = (uintptr_t)&_sidata + ((uintptr_t)&_edata - (uintptr_t)&_sdata);
+    storeUsable = imageEnd <= InternalFlash::base();
+    if (storeUsable)
+    {
+        storeLog.mount();
+
+        uint16_t length;
+        const uint8_t *record = storeLog.find(STORE_SETTINGS, length);
+        if (record && length == sizeof(StoredSettings))
+        {
+            StoredSettings settings;
+            memcpy(&settings, record, sizeof(settings));
+            applySettings(settings);
+        }
+
+        record = storeLog.find(STORE_LOOP, length);
+        if (record && length >= offsetof(StoredLoop, bank.data) && length <= sizeof(StoredLoop))
+        {
+            memcpy(&loopRecord, record, length);
+            if (loopRecord.loopTicks == sequencer.loopTicks && loopValid(loopRecord, length))
+                sampler_restoreLoop(loopRecord.bank);
+        }
+    }
+    currentSettings(savedSettings);
+    savedLoopVersion = sampler_loopVersion();
+}
+
+// Saves whatever has changed once it has settled, and erases the page the
+// log moves onto next while nobody is playing
+void storeTask(void *pvParameters)
+{
+    StoredSettings seenSettings = savedSettings;
+    uint32_t seenLoopVersion = savedLoopVersion;
+    TickType_t settingsChanged = xTaskGetTickCount();
+    TickType_t loopChanged = settingsChanged;
+    while (1)
+    {
+        vTaskDelay(storePollTicks);
+        if (!storeUsable)
+        {
+            continue;
+        }
+        TickType_t now = xTaskGetTickCount();
+
+        StoredSettings settings;
+        currentSettings(settings);
+        if (memcmp(&settings, &seenSettings, sizeof(settings)))
+        {
+            seenSettings = settings;
+            settingsChanged = now;
+        }
+        else if (memcmp(&settings, &savedSettings, sizeof(settings)) && now - settingsChanged >= settingsSettleTicks)
+        {
+            if (storeLog.append(STORE_SETTINGS, &settings, sizeof(settings)))
+                savedSettings = settings;
+        }
+
+        uint32_t version = sampler_loopVersion();
+        if (version != seenLoopVersion)
+        {
+            seenLoopVersion = version;
+            loopChanged = now;
+        }
+        else if (version != savedLoopVersion && now - loopChanged >= loopSettleTicks)
+        {
+            loopRecord.loopTicks = sequencer.loopTicks;
+            uint32_t copied = sampler_copyLoop(loopRecord.bank);
+            if (storeLog.append(STORE_LOOP, &loopRecord, store_loopLength(loopRecord)))
+                savedLoopVersion = copied;
+        }
+
+        // An erase stops the audio interrupt, key scan and CAN along with
+        // everything else. Only the master sounds, so the other modules go
+        // by the key and CAN traffic they all see.
+        bool idle = now - lastActivityTick >= eraseIdleTicks && !sequencer.running &&
+                    synthState.voices.activeMask == 0;
+        if (storeLog.pending() && idle)
+        {
+            storeLog.maintain();
+        }
+    }
+}
@@ -0,0 +1,391 @@
+#include "synth.h"
+#include "mix.h"
+
+// The accumulator holds int16 samples times Q15 levels. Shifting by 15 + 8
+// brings one voice to the 8-bit DAC range, and 2 more bits of headroom let
+// four full-level voices sum before clipping. This replaces the old /5.
+#define MIX_SHIFT 25
+
+// Attack, decay and release time for each knob position
+static const uint16_t envelopeTimesMs[ENV_KNOB_STEPS] = {
+    1, 2, 5, 10, 20, 35, 50, 75,
+    100, 150, 200, 300, 500, 750, 1000, 2000};
+
+// 2^(s/12) in Q16 for s in eighths of a semitone over +-PITCH_RANGE, for
+// pitch bend and vibrato. Entries are interpolated, within 0.01 cent.
+#define PITCH_RANGE 4
+#define PITCH_STEPS 8
+#define PITCH_FRAC_BITS 12 // Semitone offsets are Q12
+
+static_assert(SYNTH_BEND_SEMITONES * 100 + SYNTH_VIBRATO_CENTS < PITCH_RANGE * 100,
+              "pitch ratio table too small for bend plus vibrato");
+
+struct PitchRatioTable
+{
+    uint32_t ratio[2 * PITCH_RANGE * PITCH_STEPS + 2]; // One guard entry
+};
+
+static constexpr PitchRatioTable makePitchRatioTable()
+{
+    PitchRatioTable table = {};
+    for (int i = 0; i < 2 * PITCH_RANGE * PITCH_STEPS + 2; i++)
+    {
+        double semitones = (double)(i - PITCH_RANGE * PITCH_STEPS) / PITCH_STEPS;
+        table.ratio[i] = (uint32_t)(tuning_detail::exp2Fraction(semitones / 12.0) * 65536.0 + 0.5);
+    }
+    return table;
+}
+
+static constexpr PitchRatioTable pitchRatios = makePitchRatioTable();
+
+// Q16 frequency ratio for a Q12 semitone offset
+static uint32_t pitchRatio(int32_t offset)
+{
+    const int32_t limit = (PITCH_RANGE << PITCH_FRAC_BITS) - 1;
+    if (offset > limit)
+        offset = limit;
+    else if (offset < -limit)
+        offset = -limit;
+    const int fracBits = PITCH_FRAC_BITS - 3; // log2(PITCH_STEPS)
+    uint32_t position = (uint32_t)(offset + (PITCH_RANGE << PITCH_FRAC_BITS));
+    uint32_t index = position >> fracBits;
+    uint32_t frac = position & ((1 << fracBits) - 1);
+    uint32_t a = pitchRatios.ratio[index];
+    uint32_t b = pitchRatios.ratio[index + 1];
+    return a + (((b - a) * frac) >> fracBits);
+}
+
+static int32_t envelopeRate(uint8_t knob, uint32_t sampleRate)
+{
+    if (knob >= ENV_KNOB_STEPS)
+        knob = ENV_KNOB_STEPS - 1;
+    uint32_t samples = (uint32_t)envelopeTimesMs[knob] * sampleRate / 1000;
+    return (int32_t)(ENV_LEVEL_MAX / (samples ? samples : 1));
+}
+
+void synth_setEnvelope(SynthControl &control, uint32_t sampleRate,
+                       uint8_t attack, uint8_t decay, uint8_t sustain, uint8_t release)
+{
+    if (sustain >= ENV_KNOB_STEPS)
+        sustain = ENV_KNOB_STEPS - 1;
+    control.envelope.attackRate = envelopeRate(attack, sampleRate);
+    control.envelope.decayRate = envelopeRate(decay, sampleRate);
+    control.envelope.sustainLevel = (int32_t)((int64_t)ENV_LEVEL_MAX * sustain / (ENV_KNOB_STEPS - 1));
+    control.envelope.releaseRate = envelopeRate(release, sampleRate);
+}
+
+void synth_init(SynthState &state, SynthControl &control, uint32_t sampleRate,
+                const TuningTable &tuning)
+{
+    state.tuning = &tuning;
+    state.lfoStep = (uint32_t)(((uint64_t)SYNTH_VIBRATO_HZ << 32) / sampleRate);
+    synth_setEnvelope(control, sampleRate, ENV_DEFAULT_ATTACK, ENV_DEFAULT_DECAY, ENV_DEFAULT_SUSTAIN, ENV_DEFAULT_RELEASE);
+    synth_publish(state, control);
+}
+
+void synth_publish(SynthState &state, SynthControl &control)
+{
+    control.version++;
+    state.control.publish(control);
+}
+
+static int selectVictim(const VoicePool &pool)
+{
+    // A voice in its release tail is already fading out, so take the quietest
+    int victim = -1;
+    for (int v = 0; v < SYNTH_MAX_VOICES; v++)
+    {
+        if (pool.envStage[v] == ENV_RELEASE && (victim < 0 || pool.level[v] < pool.level[victim]))
+            victim = v;
+    }
+    if (victim >= 0)
+        return victim;
+
+    victim = 0;
+    for (int v = 1; v < SYNTH_MAX_VOICES; v++)
+    {
+        bool older = (uint32_t)(pool.sequence - pool.age[v]) > (uint32_t)(pool.sequence - pool.age[victim]);
+        switch (pool.policy)
+        {
+        case STEAL_QUIETEST:
+            if (pool.level[v] < pool.level[victim] || (pool.level[v] == pool.level[victim] && older))
+                victim = v;
+            break;
+        case STEAL_LOWEST_PRIORITY:
+            if (pool.priority[v] < pool.priority[victim] || (pool.priority[v] == pool.priority[victim] && older))
+                victim = v;
+            break;
+        case STEAL_OLDEST:
+        default:
+            if (older)
+                victim = v;
+            break;
+        }
+    }
+    return victim;
+}
+
+int voice_noteOn(VoicePool &pool, uint8_t note, uint32_t stepSize, uint8_t priority)
+{
+    if (note >= SYNTH_NOTES)
+        return -1;
+
+    int voice = voice_find(pool, note);
+    if (voice < 0)
+    {
+        uint32_t freeMask = ~pool.activeMask;
+#if SYNTH_MAX_VOICES < 32
+        freeMask &= (1UL << SYNTH_MAX_VOICES) - 1;
+#endif
+        if (freeMask)
+        {
+            voice = __builtin_ctz(freeMask);
+        }
+        else
+        {
+            voice = selectVictim(pool);
+        }
+        if (pool.noteVoice[pool.note[voice]] == voice + 1)
+            pool.noteVoice[pool.note[voice]] = 0;
+        pool.noteVoice[note] = (uint8_t)(voice + 1);
+    }
+    else if (pool.envStage[voice] != ENV_RELEASE && pool.priority[voice] > priority)
+    {
+        priority = pool.priority[voice];
+    }
+
+    pool.stepSize[voice] = stepSize;
+    pool.note[voice] = note;
+    pool.priority[voice] = priority;
+    pool.wave[voice] = pool.waveform;
+    pool.age[voice] = pool.sequence++;
+    pool.envStage[voice] = ENV_ATTACK;
+    pool.activeMask |= 1UL << voice;
+    return voice;
+}
+
+void voice_noteOff(VoicePool &pool, uint8_t note)
+{
+    int voice = voice_find(pool, note);
+    if (voice >= 0)
+        pool.envStage[voice] = ENV_RELEASE;
+}
+
+void voice_allNotesOff(VoicePool &pool)
+{
+    uint32_t mask = pool.activeMask;
+    while (mask)
+    {
+        int v = __builtin_ctz(mask);
+        mask &= mask - 1;
+        pool.envStage[v] = ENV_RELEASE;
+    }
+}
+
+void voice_playbackOff(VoicePool &pool, uint8_t note)
+{
+    int voice = voice_find(pool, note);
+    if (voice >= 0 && pool.priority[voice] == VOICE_PRIORITY_PLAYBACK)
+        pool.envStage[voice] = ENV_RELEASE;
+}
+
+void voice_allPlaybackOff(VoicePool &pool)
+{
+    uint32_t mask = pool.activeMask;
+    while (mask)
+    {
+        int v = __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (pool.priority[v] == VOICE_PRIORITY_PLAYBACK)
+            pool.envStage[v] = ENV_RELEASE;
+    }
+}
+
+// Advance a voice's envelope by n samples. Returns false once the release
+// has finished and the voice can be freed.
+static bool advanceEnvelope(VoicePool &pool, const EnvelopeParams &env, int v, size_t n)
+{
+    int64_t level = pool.envLevel[v];
+    switch (pool.envStage[v])
+    {
+    case ENV_ATTACK:
+        level += (int64_t)env.attackRate * n;
+        if (level >= ENV_LEVEL_MAX)
+        {
+            level = ENV_LEVEL_MAX;
+            pool.envStage[v] = ENV_DECAY;
+        }
+        break;
+    case ENV_DECAY:
+        level -= (int64_t)env.decayRate * n;
+        if (level <= env.sustainLevel)
+        {
+            level = env.sustainLevel;
+            pool.envStage[v] = ENV_SUSTAIN;
+        }
+        break;
+    case ENV_SUSTAIN:
+        level = env.sustainLevel;
+        break;
+    case ENV_RELEASE:
+        level -= (int64_t)env.releaseRate * n;
+        if (level <= 0)
+        {
+            level = 0;
+            pool.envStage[v] = ENV_IDLE;
+        }
+        break;
+    default:
+        level = 0;
+        break;
+    }
+    pool.envLevel[v] = (int32_t)level;
+    return pool.envStage[v] != ENV_IDLE;
+}
+
+// Advance one voice's oscillator and write its raw int16 samples, with its
+// pitch scaled by ratio (Q16)
+static void renderVoice(VoicePool &pool, int v, int16_t *out, size_t n, uint32_t ratio)
+{
+    uint32_t phaseAcc = pool.phaseAcc[v];
+    uint32_t stepSize = pool.stepSize[v];
+    if (ratio != 1UL << 16)
+        stepSize = (uint32_t)(((uint64_t)stepSize * ratio) >> 16);
+    const int16_t *table = wavetable_select(pool.wave[v], stepSize);
+    for (size_t i = 0; i < n; i++)
+    {
+        phaseAcc += stepSize;
+        out[i] = (int16_t)wavetable_lookup(table, phaseAcc);
+    }
+    pool.phaseAcc[v] = phaseAcc;
+}
+
+// Advance the envelope over the block and return the per-sample gain step
+// that ramps level[v] from its value at the start of the block towards its
+// value at the end. Clears the voice's active bit once its release is done.
+static int16_t envelopeStep(VoicePool &pool, const EnvelopeParams &env, int v, size_t n, int16_t &gain)
+{
+    gain = pool.level[v];
+    if (!advanceEnvelope(pool, env, v, n))
+        pool.activeMask &= ~(1UL << v);
+    int32_t end = pool.envLevel[v] >> 15;
+    if (end > VOICE_LEVEL_MAX)
+        end = VOICE_LEVEL_MAX;
+    pool.level[v] = (int16_t)end;
+    return (int16_t)((end - gain) / (int32_t)n);
+}
+
+// Start and release voices for every gate that changed since the last
+// snapshot applied. All changes in one snapshot land in the same block.
+// Gates are only ever held by players; loop playback starts its own voices
+// from the sequencer at VOICE_PRIORITY_PLAYBACK.
+static void applyControl(SynthState &state, const SynthControl &control)
+{
+    VoicePool &pool = state.voices;
+    pool.waveform = control.waveform;
+    for (int w = 0; w < SYNTH_GATE_WORDS; w++)
+    {
+        uint32_t changed = control.gate[w] ^ state.appliedGate[w];
+        while (changed)
+        {
+            int bit = __builtin_ctz(changed);
+            changed &= changed - 1;
+            uint8_t note = (uint8_t)(w * 32 + bit);
+            if (control.gate[w] & (1UL << bit))
+            {
+                voice_noteOn(pool, note, state.tuning->step[note], VOICE_PRIORITY_LIVE);
+            }
+            else
+            {
+                voice_noteOff(pool, note);
+            }
+        }
+        state.appliedGate[w] = control.gate[w];
+    }
+    state.appliedVersion = control.version;
+}
+
+// Render at most AUDIO_BLOCK_SIZE samples
+static void renderChunk(SynthState &state, const SynthControl &control, uint8_t *out, size_t n)
+{
+    VoicePool &pool = state.voices;
+    int32_t acc[AUDIO_BLOCK_SIZE] = {0};
+    alignas(4) int16_t voiceA[AUDIO_BLOCK_SIZE];
+    alignas(4) int16_t voiceB[AUDIO_BLOCK_SIZE];
+
+    // Bend and vibrato move every voice by the same interval, held for the
+    // block. The joystick is filtered upstream, so the steps are too small to
+    // hear as zipper noise.
+    int32_t offset = (int32_t)state.pitchBend * SYNTH_BEND_SEMITONES >> (15 - PITCH_FRAC_BITS);
+    if (state.modulation)
+    {
+        int32_t lfo = wavetable_lookup(waveTables.table[WAVE_SINE][0], state.lfoPhase);
+        int32_t depth = (lfo * state.modulation) >> 15;
+        offset += depth * SYNTH_VIBRATO_CENTS / 100 >> (15 - PITCH_FRAC_BITS);
+    }
+    state.lfoPhase += state.lfoStep * (uint32_t)n;
+    uint32_t ratio = offset ? pitchRatio(offset) : 1UL << 16;
+
+    // Voices are rendered and mixed two at a time. The envelope is evaluated
+    // once per block; the kernel interpolates the gain between blocks.
+    uint32_t mask = pool.activeMask;
+    while (mask)
+    {
+        int a = __builtin_ctz(mask);
+        mask &= mask - 1;
+        int16_t gainA;
+        int16_t stepA = envelopeStep(pool, control.envelope, a, n, gainA);
+        renderVoice(pool, a, voiceA, n, ratio);
+        if (mask)
+        {
+            int b = __builtin_ctz(mask);
+            mask &= mask - 1;
+            int16_t gainB;
+            int16_t stepB = envelopeStep(pool, control.envelope, b, n, gainB);
+            renderVoice(pool, b, voiceB, n, ratio);
+            mix_accumulatePair(acc, voiceA, voiceB, gainA, gainB, stepA, stepB, n);
+        }
+        else
+        {
+            mix_accumulatePair(acc, voiceA, voiceA, gainA, 0, stepA, 0, n);
+        }
+    }
+
+    const int shift = 8 - control.volume;
+    for (size_t i = 0; i < n; i++)
+    {
+        int32_t Vout = acc[i] >> MIX_SHIFT;
+        if (Vout > 127)
+            Vout = 127;
+        else if (Vout < -128)
+            Vout = -128;
+        Vout = Vout >> shift;
+
+        if (state.clickActive)
+        {
+            Vout += TICK_AMPLITUDE;
+            if (state.clickCounter > 0)
+                state.clickCounter--;
+            else
+                state.clickActive = false;
+        }
+        out[i] = (uint8_t)(Vout + 128);
+    }
+}
+
+void synth_renderBlock(SynthState &state, uint8_t *out, size_t n)
+{
+    // The only read of control state on the audio path
+    const SynthControl &control = state.control.read();
+    if (control.version != state.appliedVersion)
+        applyControl(state, control);
+
+    state.samples += (uint32_t)n;
+    while (n > AUDIO_BLOCK_SIZE)
+    {
+        renderChunk(state, control, out, AUDIO_BLOCK_SIZE);
+        out += AUDIO_BLOCK_SIZE;
+        n -= AUDIO_BLOCK_SIZE;
+    }
+    renderChunk(state, control, out, n);
+}
@@ -0,0 +1,16 @@
+#include "tuning.h"
+
+// e.g. -D TUNING_CENTS="0,12,4,16,-14,-2,-10,2,14,-16,18,-12" for just intonation on C
+#ifdef TUNING_CENTS
+constexpr TuningTable tuningTable = makeTuningTable(SYNTH_SAMPLE_RATE, TUNING_A4_HZ, TuningOffsets{{TUNING_CENTS}});
+#else
+constexpr TuningTable tuningTable = makeTuningTable(SYNTH_SAMPLE_RATE);
+#endif
+
+#ifndef TUNING_CENTS
+static_assert(tuningTable.step[TUNING_A4_NOTE] == (uint32_t)(TUNING_A4_HZ * 4294967296.0 / SYNTH_SAMPLE_RATE + 0.5),
+              "A4 is the reference pitch");
+#endif
+static_assert((int64_t)tuningTable.step[TUNING_A4_NOTE + 12] - 2 * (int64_t)tuningTable.step[TUNING_A4_NOTE] <= 1 &&
+                  (int64_t)tuningTable.step[TUNING_A4_NOTE + 12] - 2 * (int64_t)tuningTable.step[TUNING_A4_NOTE] >= -1,
+              "octaves double the step");
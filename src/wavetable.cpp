@@ -0,0 +1,127 @@
+#include "wavetable.h"
+
+// Everything below is evaluated by the compiler; waveTables is constant
+// initialised into .rodata, so nothing is generated at boot.
+
+namespace
+{
+    constexpr double PI = 3.14159265358979323846;
+
+    // Taylor series on [-pi, pi], accurate to well below one LSB of int16
+    constexpr double constexprSin(double x)
+    {
+        while (x > PI)
+            x -= 2 * PI;
+        while (x < -PI)
+            x += 2 * PI;
+        double term = x;
+        double sum = x;
+        for (int n = 1; n < 12; n++)
+        {
+            term *= -x * x / ((2 * n) * (2 * n + 1));
+            sum += term;
+        }
+        return sum;
+    }
+
+    struct SineTable
+    {
+        double value[WAVETABLE_SIZE];
+    };
+
+    constexpr SineTable makeSineTable()
+    {
+        SineTable sine = {};
+        for (int i = 0; i < WAVETABLE_SIZE; i++)
+            sine.value[i] = constexprSin(2 * PI * i / WAVETABLE_SIZE);
+        return sine;
+    }
+
+    // Fourier series amplitude of harmonic k
+    constexpr double harmonicAmplitude(int waveform, int k)
+    {
+        switch (waveform)
+        {
+        case WAVE_SAW:
+            return 1.0 / k;
+        case WAVE_SQUARE:
+            return (k & 1) ? 1.0 / k : 0.0;
+        case WAVE_TRIANGLE:
+            return (k & 1) ? ((k & 2) ? -1.0 : 1.0) / (k * k) : 0.0;
+        default:
+            return k == 1 ? 1.0 : 0.0;
+        }
+    }
+
+    constexpr int bandHarmonics(int band)
+    {
+        return band == 0 ? WAVETABLE_SIZE / 2 - 1 : (WAVETABLE_SIZE / 2) >> band;
+    }
+
+    struct BandSums
+    {
+        double value[WAVETABLE_BANDS][WAVETABLE_SIZE];
+    };
+
+    // sin(2*pi*k*i/N) is sine[(k*i) mod N], so additive synthesis needs no
+    // further trig
+    constexpr BandSums makeBandSums(int waveform, const SineTable &sine)
+    {
+        BandSums sums = {};
+        for (int band = 0; band < WAVETABLE_BANDS; band++)
+        {
+            for (int i = 0; i < WAVETABLE_SIZE; i++)
+            {
+                double s = 0;
+                for (int k = 1; k <= bandHarmonics(band); k++)
+                {
+                    double a = harmonicAmplitude(waveform, k);
+                    if (a != 0.0)
+                        s += a * sine.value[(k * i) & (WAVETABLE_SIZE - 1)];
+                }
+                sums.value[band][i] = s;
+            }
+        }
+        return sums;
+    }
+
+    constexpr WaveTables makeWaveTables()
+    {
+        WaveTables tables = {};
+        const SineTable sine = makeSineTable();
+        for (int waveform = 0; waveform < WAVE_COUNT; waveform++)
+        {
+            const BandSums sums = makeBandSums(waveform, sine);
+
+            // One scale per waveform so every band plays at the same level
+            double peak = 0;
+            for (int band = 0; band < WAVETABLE_BANDS; band++)
+                for (int i = 0; i < WAVETABLE_SIZE; i++)
+                {
+                    double v = sums.value[band][i];
+                    if (v > peak)
+                        peak = v;
+                    if (-v > peak)
+                        peak = -v;
+                }
+
+            for (int band = 0; band < WAVETABLE_BANDS; band++)
+            {
+                for (int i = 0; i < WAVETABLE_SIZE; i++)
+                {
+                    double v = sums.value[band][i] * 32767.0 / peak;
+                    tables.table[waveform][band][i] = (int16_t)(v < 0 ? v - 0.5 : v + 0.5);
+                }
+                tables.table[waveform][band][WAVETABLE_SIZE] = tables.table[waveform][band][0];
+            }
+        }
+        return tables;
+    }
+}
+
+constexpr WaveTables waveTables = makeWaveTables();
+
+static_assert(waveTables.table[WAVE_SINE][0][WAVETABLE_SIZE / 4] == 32767, "sine peaks at a quarter cycle");
+static_assert(waveTables.table[WAVE_SQUARE][WAVETABLE_BANDS - 1][0] == 0, "band-limited square starts at zero");
+
+const char *const waveformNames[WAVE_COUNT] = {"Saw", "Square", "Tri", "Sine"};
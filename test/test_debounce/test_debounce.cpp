@@ -0,0 +1,112 @@
+// Replays key bounce traces through VerticalDebouncer at several depths and
+// checks it against a plain per-input counter. Run with: pio test -e native
+
+#include <unity.h>
+#include <stdint.h>
+#include <string.h>
+#include "debounce.h"
+
+// Column reads at the 1 kHz scan rate, one character a sample; keys read 0
+// while pressed
+static const char *const traces[] = {
+    // Clean press and release
+    "1111111111000000000000000000001111111111111111",
+    // Press bouncing for 3 ms, release for 2 ms
+    "1111101001100000000000000000000010110111111111",
+    // Long, ragged bounce on a worn switch
+    "1111010110100101100000000000000001001011010111",
+    // Single-sample glitches either way
+    "1111101111111111000000000010000000001111111111",
+    // Taps shorter than some depths
+    "1111100111111110001111111000011111111000001111",
+};
+static const int TRACES = sizeof(traces) / sizeof(traces[0]);
+
+// The reference: an input changes after depth consecutive disagreeing
+// samples, and any agreeing sample starts the count again
+struct CounterDebouncer
+{
+    unsigned depth;
+    unsigned count = 0;
+    bool state = true;
+
+    bool update(bool raw)
+    {
+        if (raw == state)
+            count = 0;
+        else if (++count >= depth)
+        {
+            state = raw;
+            count = 0;
+        }
+        return state;
+    }
+};
+
+// Every input is fed a trace, rotated by its bit number so the 32 inputs
+// bounce out of step with one another
+template <unsigned DEPTH>
+static void replayTraces()
+{
+    for (int t = 0; t < TRACES; t++)
+    {
+        const char *trace = traces[t];
+        int length = (int)strlen(trace);
+        VerticalDebouncer<DEPTH> debouncer;
+        CounterDebouncer reference[32];
+        for (int bit = 0; bit < 32; bit++)
+            reference[bit].depth = DEPTH;
+
+        for (int i = 0; i < length + (int)DEPTH; i++)
+        {
+            uint32_t raw = 0, expected = 0;
+            for (int bit = 0; bit < 32; bit++)
+            {
+                // Past the end of the trace the input holds its last level
+                int at = i < length ? (i + bit) % length : length - 1;
+                bool level = trace[at] == '1';
+                raw |= (uint32_t)level << bit;
+                expected |= (uint32_t)reference[bit].update(level) << bit;
+            }
+            TEST_ASSERT_EQUAL_HEX32_MESSAGE(expected, debouncer.update(raw), trace);
+        }
+        TEST_ASSERT_FALSE_MESSAGE(debouncer.pending(), trace);
+    }
+}
+
+// A bounce that never holds DEPTH samples is never seen, and a press is seen
+// exactly DEPTH samples after it settles
+template <unsigned DEPTH>
+static void settleLatency()
+{
+    VerticalDebouncer<DEPTH> debouncer;
+    for (unsigned i = 0; i < 4 * DEPTH; i++)
+        TEST_ASSERT_EQUAL_HEX32(0xffffffff, debouncer.update(i % DEPTH == DEPTH - 1 ? 0xffffffff : 0xfffffffe));
+    for (unsigned i = 1; i < DEPTH; i++)
+        TEST_ASSERT_EQUAL_HEX32(0xffffffff, debouncer.update(0xfffffffe));
+    TEST_ASSERT_EQUAL_HEX32(0xfffffffe, debouncer.update(0xfffffffe));
+}
+
+static void test_depth_1() { replayTraces<1>(); }
+static void test_depth_2() { replayTraces<2>(); settleLatency<2>(); }
+static void test_depth_3() { replayTraces<3>(); settleLatency<3>(); }
+static void test_depth_4() { replayTraces<4>(); settleLatency<4>(); }
+static void test_depth_5() { replayTraces<5>(); settleLatency<5>(); }
+static void test_depth_8() { replayTraces<8>(); settleLatency<8>(); }
+static void test_depth_16() { replayTraces<16>(); settleLatency<16>(); }
+
+void setUp() {}
+void tearDown() {}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_depth_1);
+    RUN_TEST(test_depth_2);
+    RUN_TEST(test_depth_3);
+    RUN_TEST(test_depth_4);
+    RUN_TEST(test_depth_5);
+    RUN_TEST(test_depth_8);
+    RUN_TEST(test_depth_16);
+    return UNITY_END();
+}